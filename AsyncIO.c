@@ -0,0 +1,196 @@
+/**
+* Implementation of loading and storing BMP files in the background.
+* Each load or store runs on its own thread; the caller joins it with waitLoadBMP or waitStoreBMP.
+*
+* @author Sheldon Pang
+* @version 1.0
+*/
+
+////////////////////////////////////////////////////////////////////////////////
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include "AsyncIO.h"
+
+/* Map the file, decode its pixels into a freshly allocated image, then release the mapping. */
+static void* loadBMPThread(void* arg) {
+    struct BMP_Load* load = (struct BMP_Load*)arg;
+    struct BMP_Map map;
+
+    load->result = mapBMP(load->filename, &map);
+    if (load->result != 0) {
+        return NULL;
+    }
+
+    load->bmp = map.bmp;
+    load->dib = map.dib;
+    load->format = map.format;
+    // rows are stored bottom-up in pixels whatever the file uses, keep the height positive
+    load->dib.image_height = map.format.height;
+
+    // one contiguous block for the whole image, as large as it is after shrinking
+    load->img = image_new(shrinkSizeBMP(map.format.width, load->shrink),
+                          shrinkSizeBMP(map.format.height, load->shrink));
+    if (load->img == NULL) {
+        unmapBMP(&map);
+        load->result = -1;
+        return NULL;
+    }
+
+    // keep the mapping, finishLoadBMP decodes it and runs the point operations in one pass
+    if (load->defer && load->shrink == 1 &&
+        map.format.compression != BI_RLE8 && map.format.compression != BI_RLE4) {
+        load->map = map;
+        load->mapped = 1;
+        return NULL;
+    }
+
+    if (readPixelsShrunkMappedBMP(&map, image_get_pixels(load->img), load->shrink) != 0) {
+        image_destroy(&load->img);
+        load->result = -1;
+    }
+    unmapBMP(&map);
+    return NULL;
+}
+
+/* Unpack one row of a mapped file into image row row, rows of the image run bottom-up. */
+static void mappedRowBMP(void* arg, struct Pixel* dst, int row) {
+    const struct BMP_Map* map = (const struct BMP_Map*)arg;
+    const struct BMP_Format* format = &map->format;
+    int fileRow = format->top_down ? format->height - 1 - row : row;
+    format->unpack(mapRowBMP(map, fileRow), dst, format->width, format);
+}
+
+/* Write the headers and pixels, then release the image. */
+static void* storeBMPThread(void* arg) {
+    struct BMP_Store* store = (struct BMP_Store*)arg;
+    Image* img = store->img;
+    int width = image_get_width(img);
+    int height = image_get_height(img);
+
+    // the writers read the packed pixel array
+    image_set_layout(img, IMAGE_LAYOUT_RGB);
+
+    FILE* file_output = fopen(store->filename, "wb");
+    int rle_result = -2;
+    if (file_output != NULL && store->rle_output == 1) {
+        rle_result = writeRLE8BMP(file_output, &store->bmp, &store->dib, image_get_pixels(img), width, height);
+    }
+
+    if (file_output == NULL || rle_result == -1) {
+        store->result = -1;
+    } else if (rle_result == 0) {
+        store->result = 1;
+    } else {
+        // nothing went through the stream, write headers and rows straight to the descriptor
+        makeBMPHeader(&store->bmp, width, height);
+        makeDIBHeader(&store->dib, width, height);
+        store->result = writeBMPFd(fileno(file_output), &store->bmp, &store->dib,
+                                   image_get_pixels(img), width, height, 1) == 0 ? 0 : -1;
+    }
+    // fclose flushes what the RLE8 writer buffered, it can fail too
+    if (file_output != NULL && fclose(file_output) != 0) {
+        store->result = -1;
+    }
+
+    image_destroy(&store->img);
+    return NULL;
+}
+
+/**
+ * Start loading a BMP file in the background. Falls back to loading it right away
+ * if no thread can be started. With a shrink above 1 the image is decoded straight at
+ * shrinkSizeBMP of the file's size, see readPixelsShrunkMappedBMP.
+ * With defer, a full size uncompressed file is only mapped and its image allocated, the
+ * pixels are decoded by finishLoadBMP together with the point operations.
+ *
+ * @param  load: The load to start
+ * @param  filename: Name of the file to load
+ * @param  shrink: Factor both sides are divided by while decoding, 1 for the full image
+ * @param  defer: 1 to leave decoding to finishLoadBMP where it can be
+ */
+void startLoadBMP(struct BMP_Load* load, const char* filename, int shrink, int defer) {
+    load->filename = filename;
+    load->shrink = shrink;
+    load->defer = defer;
+    load->img = NULL;
+    load->mapped = 0;
+    load->result = -1;
+    load->started = pthread_create(&load->thread, NULL, loadBMPThread, load) == 0;
+    if (!load->started) {
+        loadBMPThread(load);
+    }
+}
+
+/**
+ * Wait for a load started by startLoadBMP to finish.
+ *
+ * @param  load: The load to wait for
+ * @return 0 on success, -1 if the file can not be opened, -2 if it is not a supported BMP
+ */
+int waitLoadBMP(struct BMP_Load* load) {
+    if (load->started) {
+        pthread_join(load->thread, NULL);
+        load->started = 0;
+    }
+    return load->result;
+}
+
+/**
+ * Finish a successful load. If decoding was deferred, each row is unpacked straight from the
+ * mapped file into the image and run through ops while it is still in cache, then the file
+ * is unmapped; the image is written once instead of once to decode and again to filter.
+ *
+ * @param  load: The load, waited for with waitLoadBMP
+ * @param  ops: The point operations to fuse with decoding, may be empty
+ * @return 1 if ops were applied, 0 if the image was already decoded and ops are still to apply
+ */
+int finishLoadBMP(struct BMP_Load* load, const struct Image_Ops* ops) {
+    if (!load->mapped) {
+        return 0;
+    }
+    image_apply_ops_from(load->img, ops, mappedRowBMP, &load->map);
+    unmapBMP(&load->map);
+    load->mapped = 0;
+    return 1;
+}
+
+/**
+ * Start writing an image as a BMP file in the background. The store takes ownership of the
+ * image. Falls back to writing right away if no thread can be started.
+ *
+ * @param  store: The store to start
+ * @param  filename: Name of the file to write
+ * @param  bmp: BMP header of the input, updated for the output
+ * @param  dib: DIB header of the input, updated for the output
+ * @param  img: The image to write, destroyed once written
+ * @param  rle_output: 1 to write RLE8 output when the image has 256 colors or less
+ */
+void startStoreBMP(struct BMP_Store* store, const char* filename,
+                   struct BMP_Header* bmp, struct DIB_Header* dib,
+                   Image* img, int rle_output) {
+    store->filename = filename;
+    store->bmp = *bmp;
+    store->dib = *dib;
+    store->img = img;
+    store->rle_output = rle_output;
+    store->result = -1;
+    store->started = pthread_create(&store->thread, NULL, storeBMPThread, store) == 0;
+    if (!store->started) {
+        storeBMPThread(store);
+    }
+}
+
+/**
+ * Wait for a store started by startStoreBMP to finish.
+ *
+ * @param  store: The store to wait for
+ * @return 0 if written as 24-bit, 1 if written as RLE8, -1 if the file can not be written
+ */
+int waitStoreBMP(struct BMP_Store* store) {
+    if (store->started) {
+        pthread_join(store->thread, NULL);
+        store->started = 0;
+    }
+    return store->result;
+}
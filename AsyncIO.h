@@ -0,0 +1,106 @@
+/**
+* Header file for loading and storing BMP files in the background.
+* Lets a batch run read the next file and write the previous one while the current one is filtered.
+*
+* @author Sheldon Pang
+* @version 1.0
+*/
+
+#ifndef AsyncIO_H
+#define AsyncIO_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Include Files
+#include <pthread.h>
+#include "BMPHandler.h"
+#include "Image.h"
+
+////////////////////////////////////////////////////////////////////////////////
+/* A BMP file being loaded on a background thread. */
+struct BMP_Load {
+    const char* filename;       /* File to load */
+    int result;                 /* 0 on success, -1 file can not be opened, -2 not a supported BMP */
+    struct BMP_Header bmp;      /* BMP header of the file */
+    struct DIB_Header dib;      /* DIB header of the file, height made positive */
+    struct BMP_Format format;   /* Layout of the pixel array in the file, full size */
+    int shrink;                 /* Factor both sides of img are shrunk by while decoding */
+    int defer;                  /* 1 to leave decoding to finishLoadBMP where it can be */
+    Image* img;                 /* Decoded image, rows bottom-up, owns its pixels */
+    struct BMP_Map map;         /* The file, still mapped while decoding is left to finishLoadBMP */
+    int mapped;                 /* 1 if img is not decoded yet and map must be released */
+    pthread_t thread;           /* Thread doing the load */
+    int started;                /* 1 if thread was started and must be joined */
+};
+
+/* A BMP file being written on a background thread. */
+struct BMP_Store {
+    const char* filename;       /* File to write */
+    int result;                 /* 0 written as 24-bit, 1 written as RLE8, -1 file can not be written in full */
+    struct BMP_Header bmp;      /* BMP header of the output */
+    struct DIB_Header dib;      /* DIB header of the output */
+    Image* img;                 /* Image to write, destroyed once written */
+    int rle_output;             /* 1 to try RLE8 output first */
+    pthread_t thread;           /* Thread doing the write */
+    int started;                /* 1 if thread was started and must be joined */
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//Function Declarations
+
+/**
+ * Start loading a BMP file in the background. Falls back to loading it right away
+ * if no thread can be started. With a shrink above 1 the image is decoded straight at
+ * shrinkSizeBMP of the file's size, see readPixelsShrunkMappedBMP.
+ * With defer, a full size uncompressed file is only mapped and its image allocated, the
+ * pixels are decoded by finishLoadBMP together with the point operations.
+ *
+ * @param  load: The load to start
+ * @param  filename: Name of the file to load
+ * @param  shrink: Factor both sides are divided by while decoding, 1 for the full image
+ * @param  defer: 1 to leave decoding to finishLoadBMP where it can be
+ */
+void startLoadBMP(struct BMP_Load* load, const char* filename, int shrink, int defer);
+
+/**
+ * Wait for a load started by startLoadBMP to finish.
+ *
+ * @param  load: The load to wait for
+ * @return 0 on success, -1 if the file can not be opened, -2 if it is not a supported BMP
+ */
+int waitLoadBMP(struct BMP_Load* load);
+
+/**
+ * Finish a successful load. If decoding was deferred, each row is unpacked straight from the
+ * mapped file into the image and run through ops while it is still in cache, then the file
+ * is unmapped; the image is written once instead of once to decode and again to filter.
+ *
+ * @param  load: The load, waited for with waitLoadBMP
+ * @param  ops: The point operations to fuse with decoding, may be empty
+ * @return 1 if ops were applied, 0 if the image was already decoded and ops are still to apply
+ */
+int finishLoadBMP(struct BMP_Load* load, const struct Image_Ops* ops);
+
+/**
+ * Start writing an image as a BMP file in the background. The store takes ownership of the
+ * image. Falls back to writing right away if no thread can be started.
+ *
+ * @param  store: The store to start
+ * @param  filename: Name of the file to write
+ * @param  bmp: BMP header of the input, updated for the output
+ * @param  dib: DIB header of the input, updated for the output
+ * @param  img: The image to write, destroyed once written
+ * @param  rle_output: 1 to write RLE8 output when the image has 256 colors or less
+ */
+void startStoreBMP(struct BMP_Store* store, const char* filename,
+                   struct BMP_Header* bmp, struct DIB_Header* dib,
+                   Image* img, int rle_output);
+
+/**
+ * Wait for a store started by startStoreBMP to finish.
+ *
+ * @param  store: The store to wait for
+ * @return 0 if written as 24-bit, 1 if written as RLE8, -1 if the file can not be written
+ */
+int waitStoreBMP(struct BMP_Store* store);
+
+#endif
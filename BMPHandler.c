@@ -6,6 +6,14 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "BMPHandler.h"
 
 /**
@@ -85,8 +93,8 @@ void writeDIBHeader(FILE* file, struct DIB_Header* header) {
  * @param  height: Height of the image that this header is for
  */
 void makeBMPHeader(struct BMP_Header* header, int width, int height) {
-    //change the size of the header
-    header->size = width * height * 3 + 54;
+    //change the size of the header, rows are padded to 4 bytes
+    header->size = ((width * 3 + 3) & ~3) * height + 54;
     //update image offset value
     header->offset_pixel_array = 54;
 }
@@ -102,6 +110,14 @@ void makeDIBHeader(struct DIB_Header* header, int width, int height) {
     // we need to update the width and height info
     header->image_width = width;
     header->image_height = height;
+    // output is always a plain 24-bit BI_RGB file, whatever the input was
+    header->dib_header = 40;
+    header->planes = 1;
+    header->bits_per_pixel = 24;
+    header->compression = BI_RGB;
+    header->image_size = ((width * 3 + 3) & ~3) * height;
+    header->color_table = 0;
+    header->important_color_count = 0;
 }
 
 /**
@@ -111,24 +127,38 @@ void makeDIBHeader(struct DIB_Header* header, int width, int height) {
  * @param  pArr: Pixel array to store the pixels being read
  * @param  width: Width of the pixel array of this image
  * @param  height: Height of the pixel array of this image
+ * @return 0 on success, -1 if the file ends early or the memory can not be allocated, rows
+ *         that could not be read are set to 0
  */
-void readPixelsBMP(FILE* file, struct Pixel** pArr, int width, int height) {
-    // calculate padding size
-    int length = width * 3;
-    if (length % 4 != 0) {
-        length = length + 4 - (length % 4);
-    }
-    int paddingSize = length - (width * 3);
+int readPixelsBMP(FILE* file, struct Pixel** pArr, int width, int height) {
+    // padded row size, rounded up to 4 bytes
+    int rowSize = (width * 3 + 3) & ~3;
+    unsigned char* row = (unsigned char*)malloc(rowSize);
+    int i = 0;
 
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            fread(&pArr[i][j].blue, sizeof(char),1, file);
-            fread(&pArr[i][j].green, sizeof(char),1, file);
-            fread(&pArr[i][j].red, sizeof(char),1, file);
+    if (row != NULL) {
+        for (; i < height; i++) {
+            // one read per scanline, padding included
+            if (fread(row, 1, rowSize, file) != (size_t)rowSize) {
+                break;
+            }
+            const unsigned char* src = row;
+            struct Pixel* dst = pArr[i];
+            for (int j = 0; j < width; j++) {
+                dst[j].blue = src[0];
+                dst[j].green = src[1];
+                dst[j].red = src[2];
+                src += 3;
+            }
         }
-        //skip padding
-        fseek(file, sizeof(unsigned char) * paddingSize, SEEK_CUR);
     }
+
+    // a short read or no buffer, the rows not read are left black
+    for (int k = i; k < height; k++) {
+        memset(pArr[k], 0, sizeof(struct Pixel) * width);
+    }
+    free(row);
+    return i == height ? 0 : -1;
 }
 
 /**
@@ -138,24 +168,1116 @@ void readPixelsBMP(FILE* file, struct Pixel** pArr, int width, int height) {
  * @param  pArr: Pixel array of the image to write to the file
  * @param  width: Width of the pixel array of this image
  * @param  height: Height of the pixel array of this image
+ * @return 0 on success, -1 if a write fails or the memory can not be allocated
  */
-void writePixelsBMP(FILE* file, struct Pixel** pArr, int width, int height) {
-    // calculate padding size
-    int length = width * 3;
-    if (length % 4 != 0) {
-        length = length + 4 - (length % 4);
+int writePixelsBMP(FILE* file, struct Pixel** pArr, int width, int height) {
+    // padded row size, rounded up to 4 bytes
+    int rowSize = (width * 3 + 3) & ~3;
+    // padding bytes stay 0
+    unsigned char* row = (unsigned char*)calloc(rowSize, 1);
+    if (row == NULL) {
+        return -1;
     }
-    int paddingSize = length - (width * 3);
 
     for (int i = 0; i < height; i++) {
+        const struct Pixel* src = pArr[i];
+        unsigned char* dst = row;
         for (int j = 0; j < width; j++) {
-            fwrite(&pArr[i][j].blue, sizeof(char),1, file);
-            fwrite(&pArr[i][j].green, sizeof(char),1, file);
-            fwrite(&pArr[i][j].red, sizeof(char),1, file);
+            dst[0] = src[j].blue;
+            dst[1] = src[j].green;
+            dst[2] = src[j].red;
+            dst += 3;
+        }
+        if (fwrite(row, 1, rowSize, file) != (size_t)rowSize) {
+            free(row);
+            return -1;
+        }
+    }
+    free(row);
+    return 0;
+}
+
+
+/**
+ * Unpack one row of 24-bit BGR pixels.
+ */
+static void unpackBGR24(const unsigned char* src, struct Pixel* dst, int width, const struct BMP_Format* format) {
+    (void)format;
+    for (int j = 0; j < width; j++) {
+        dst[j].blue = src[0];
+        dst[j].green = src[1];
+        dst[j].red = src[2];
+        src += 3;
+    }
+}
+
+/**
+ * Unpack one row of 32-bit BGRX/BGRA pixels with the default masks, alpha is dropped.
+ */
+static void unpackBGRX32(const unsigned char* src, struct Pixel* dst, int width, const struct BMP_Format* format) {
+    (void)format;
+    for (int j = 0; j < width; j++) {
+        dst[j].blue = src[0];
+        dst[j].green = src[1];
+        dst[j].red = src[2];
+        src += 4;
+    }
+}
+
+/**
+ * Unpack one row of 16-bit RGB565 pixels.
+ */
+static void unpackRGB565(const unsigned char* src, struct Pixel* dst, int width, const struct BMP_Format* format) {
+    (void)format;
+    for (int j = 0; j < width; j++) {
+        unsigned int value = src[0] | (src[1] << 8);
+        // expand 5 and 6 bit channels to 8 bits, rounded to nearest
+        dst[j].red = (((value >> 11) & 0x1F) * 527 + 23) >> 6;
+        dst[j].green = (((value >> 5) & 0x3F) * 259 + 33) >> 6;
+        dst[j].blue = ((value & 0x1F) * 527 + 23) >> 6;
+        src += 2;
+    }
+}
+
+/**
+ * Unpack one row of 16-bit RGB555 pixels, the top bit is ignored.
+ */
+static void unpackRGB555(const unsigned char* src, struct Pixel* dst, int width, const struct BMP_Format* format) {
+    (void)format;
+    for (int j = 0; j < width; j++) {
+        unsigned int value = src[0] | (src[1] << 8);
+        dst[j].red = (((value >> 10) & 0x1F) * 527 + 23) >> 6;
+        dst[j].green = (((value >> 5) & 0x1F) * 527 + 23) >> 6;
+        dst[j].blue = ((value & 0x1F) * 527 + 23) >> 6;
+        src += 2;
+    }
+}
+
+/**
+ * Scale one channel taken out of a pixel with a bit mask to 8 bits, rounded to nearest.
+ */
+static unsigned char scaleMaskedBMP(unsigned int value, unsigned int mask, int shift, int bits) {
+    if (mask == 0) {
+        return 0;
+    }
+    unsigned int channel = (value & mask) >> shift;
+    if (bits > 8) {
+        return channel >> (bits - 8);
+    }
+    unsigned int max = (1u << bits) - 1;
+    return (channel * 255 + max / 2) / max;
+}
+
+/**
+ * Unpack one row of 16-bit pixels with arbitrary BI_BITFIELDS masks.
+ */
+static void unpackMasked16(const unsigned char* src, struct Pixel* dst, int width, const struct BMP_Format* format) {
+    for (int j = 0; j < width; j++) {
+        unsigned int value = src[0] | (src[1] << 8);
+        dst[j].red = scaleMaskedBMP(value, format->masks[0], format->shifts[0], format->bits[0]);
+        dst[j].green = scaleMaskedBMP(value, format->masks[1], format->shifts[1], format->bits[1]);
+        dst[j].blue = scaleMaskedBMP(value, format->masks[2], format->shifts[2], format->bits[2]);
+        src += 2;
+    }
+}
+
+/**
+ * Unpack one row of 32-bit pixels with arbitrary BI_BITFIELDS masks.
+ */
+static void unpackMasked32(const unsigned char* src, struct Pixel* dst, int width, const struct BMP_Format* format) {
+    for (int j = 0; j < width; j++) {
+        unsigned int value = src[0] | (src[1] << 8) | (src[2] << 16) | ((unsigned int)src[3] << 24);
+        dst[j].red = scaleMaskedBMP(value, format->masks[0], format->shifts[0], format->bits[0]);
+        dst[j].green = scaleMaskedBMP(value, format->masks[1], format->shifts[1], format->bits[1]);
+        dst[j].blue = scaleMaskedBMP(value, format->masks[2], format->shifts[2], format->bits[2]);
+        src += 4;
+    }
+}
+
+/**
+ * Unpack one row of 8-bit palette indices.
+ */
+static void unpackPalette8(const unsigned char* src, struct Pixel* dst, int width, const struct BMP_Format* format) {
+    for (int j = 0; j < width; j++) {
+        dst[j] = format->palette[src[j]];
+    }
+}
+
+/**
+ * Unpack one row of 4-bit palette indices, high nibble first.
+ */
+static void unpackPalette4(const unsigned char* src, struct Pixel* dst, int width, const struct BMP_Format* format) {
+    for (int j = 0; j + 1 < width; j += 2) {
+        dst[j] = format->palette[src[j / 2] >> 4];
+        dst[j + 1] = format->palette[src[j / 2] & 0x0F];
+    }
+    if (width % 2 != 0) {
+        dst[width - 1] = format->palette[src[width / 2] >> 4];
+    }
+}
+
+/**
+ * Unpack one row of 1-bit palette indices, most significant bit first.
+ */
+static void unpackPalette1(const unsigned char* src, struct Pixel* dst, int width, const struct BMP_Format* format) {
+    for (int j = 0; j < width; j++) {
+        dst[j] = format->palette[(src[j / 8] >> (7 - j % 8)) & 1];
+    }
+}
+
+/**
+ * Work out the pixel layout of a BMP file from its DIB header and the bytes that follow it.
+ *
+ * @param  dib: DIB header of the file
+ * @param  extra: Bytes from the end of the 40-byte DIB header up to the pixel array
+ * @param  extra_size: Number of bytes in extra
+ * @param  format: Pointer to the destination format
+ * @return 0 on success, -1 if the layout is not supported
+ */
+static int makeFormatBMP(struct DIB_Header* dib, const unsigned char* extra, int extra_size,
+                         struct BMP_Format* format) {
+    memset(format, 0, sizeof(*format));
+
+    // OS/2 core headers and JPEG/PNG payloads are not supported, nor is more than one plane
+    if (dib->dib_header < 40 || dib->planes != 1 || dib->image_width <= 0 || dib->image_height == 0) {
+        return -1;
+    }
+    format->width = dib->image_width;
+    format->height = dib->image_height < 0 ? -dib->image_height : dib->image_height;
+    format->top_down = dib->image_height < 0;
+    format->bits_per_pixel = dib->bits_per_pixel;
+    format->compression = dib->compression;
+    format->row_size = (int)((((long)format->width * format->bits_per_pixel + 31) / 32) * 4);
+
+    // bit masks follow a 40-byte header, or are part of a larger one
+    int masks_size = 0;
+    if (dib->compression == BI_BITFIELDS || dib->compression == BI_ALPHABITFIELDS) {
+        masks_size = dib->compression == BI_BITFIELDS ? 12 : 16;
+        if (extra_size < masks_size) {
+            return -1;
         }
-        //write padding
-        for (int k = 0; k < paddingSize; k++) {
-            fputc(0, file);
+        memcpy(format->masks, extra, masks_size);
+    } else if (dib->compression == BI_RLE8 || dib->compression == BI_RLE4) {
+        // run length encoding only exists for 8 and 4 bit palette indices, bottom-up
+        if (dib->bits_per_pixel != (dib->compression == BI_RLE8 ? 8 : 4) || format->top_down) {
+            return -1;
         }
+    } else if (dib->compression != BI_RGB) {
+        return -1;
     }
-}
\ No newline at end of file
+
+    // color table sits right after the DIB header and any separate bit masks
+    if (format->bits_per_pixel <= 8) {
+        int palette_start = dib->dib_header - 40 + (dib->dib_header == 40 ? masks_size : 0);
+        int palette_size = dib->color_table;
+        if (palette_size <= 0 || palette_size > (1 << format->bits_per_pixel)) {
+            palette_size = 1 << format->bits_per_pixel;
+        }
+        if (palette_start + palette_size * 4 > extra_size) {
+            palette_size = (extra_size - palette_start) / 4;
+        }
+        for (int i = 0; i < palette_size; i++) {
+            const unsigned char* entry = extra + palette_start + i * 4;
+            format->palette[i].blue = entry[0];
+            format->palette[i].green = entry[1];
+            format->palette[i].red = entry[2];
+        }
+        format->palette_size = palette_size < 0 ? 0 : palette_size;
+    }
+
+    // pick the unpack loop once for the whole file
+    switch (format->bits_per_pixel) {
+        case 1: format->unpack = unpackPalette1;
+            break;
+        case 4: format->unpack = unpackPalette4;
+            break;
+        case 8: format->unpack = unpackPalette8;
+            break;
+        case 16:
+            if (masks_size == 0) {
+                format->masks[0] = 0x7C00;
+                format->masks[1] = 0x03E0;
+                format->masks[2] = 0x001F;
+            }
+            if (format->masks[0] == 0xF800 && format->masks[1] == 0x07E0 && format->masks[2] == 0x001F) {
+                format->unpack = unpackRGB565;
+            } else if (format->masks[0] == 0x7C00 && format->masks[1] == 0x03E0 && format->masks[2] == 0x001F) {
+                format->unpack = unpackRGB555;
+            } else {
+                format->unpack = unpackMasked16;
+            }
+            break;
+        case 24: format->unpack = unpackBGR24;
+            break;
+        case 32:
+            if (masks_size == 0) {
+                format->masks[0] = 0x00FF0000;
+                format->masks[1] = 0x0000FF00;
+                format->masks[2] = 0x000000FF;
+            }
+            if (format->masks[0] == 0x00FF0000 && format->masks[1] == 0x0000FF00 && format->masks[2] == 0x000000FF) {
+                format->unpack = unpackBGRX32;
+            } else {
+                format->unpack = unpackMasked32;
+            }
+            break;
+        default:
+            return -1;
+    }
+
+    // position and width of each masked channel
+    for (int c = 0; c < 4; c++) {
+        unsigned int mask = format->masks[c];
+        format->shifts[c] = 0;
+        format->bits[c] = 0;
+        while (mask != 0 && (mask & 1) == 0) {
+            mask >>= 1;
+            format->shifts[c]++;
+        }
+        while (mask & 1) {
+            mask >>= 1;
+            format->bits[c]++;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Read the bit masks and color table that follow the headers and work out the pixel layout.
+ * The file must be positioned right after readBMPHeader and readDIBHeader.
+ *
+ * @param  file: A pointer to the file being read
+ * @param  bmp: BMP header of the file
+ * @param  dib: DIB header of the file
+ * @param  format: Pointer to the destination format
+ * @return 0 on success, -1 if the file is not a supported BMP
+ */
+int readFormatBMP(FILE* file, struct BMP_Header* bmp, struct DIB_Header* dib, struct BMP_Format* format) {
+    if (bmp->signature[0] != 'B' || bmp->signature[1] != 'M' || bmp->offset_pixel_array < 54) {
+        return -1;
+    }
+    int extra_size = bmp->offset_pixel_array - 54;
+    unsigned char* extra = (unsigned char*)malloc(extra_size + 1);
+    int got = (int)fread(extra, 1, extra_size, file);
+    int result = makeFormatBMP(dib, extra, got, format);
+    free(extra);
+    return result;
+}
+
+/**
+ * Read a band of rows of any uncompressed layout, rows are numbered bottom-up like pArr.
+ *
+ * @param  file: A pointer to the file being read
+ * @param  bmp: BMP header of the file, for the pixel array offset
+ * @param  format: Layout of the pixel array, from readFormatBMP
+ * @param  pArr: Pixel array to store the rows being read
+ * @param  first_row: Index of the first row to read
+ * @param  rows: Number of rows to read
+ * @return 0 on success, -1 if the file ends early or the memory can not be allocated, rows
+ *         that could not be read are set to 0
+ */
+int readRowsBMP(FILE* file, struct BMP_Header* bmp, const struct BMP_Format* format,
+                struct Pixel** pArr, int first_row, int rows) {
+    unsigned char* row = (unsigned char*)malloc((size_t)format->row_size * rows);
+    size_t got = 0;
+
+    if (row != NULL) {
+        // top-down files store the band in the opposite order
+        int first_file_row = format->top_down ? format->height - first_row - rows : first_row;
+        long offset = bmp->offset_pixel_array + (long)format->row_size * first_file_row;
+        if (fseek(file, offset, SEEK_SET) == 0) {
+            got = fread(row, format->row_size, rows, file);
+        }
+    }
+
+    for (int i = 0; i < rows; i++) {
+        struct Pixel* dst = format->top_down ? pArr[rows - 1 - i] : pArr[i];
+        if (i < (int)got) {
+            format->unpack(row + (size_t)format->row_size * i, dst, format->width, format);
+        } else {
+            // past the end of a truncated file
+            memset(dst, 0, sizeof(struct Pixel) * format->width);
+        }
+    }
+    free(row);
+    return got == (size_t)rows ? 0 : -1;
+}
+
+/* Called with each row of an RLE stream once it is fully decoded, bottom-up. */
+typedef void (*BMP_Row_Done)(void* arg, int row);
+
+/**
+ * Finish the rows of an RLE stream below target and start each row reached with color 0 of
+ * the table.
+ *
+ * @param  pArr: Pixel array being decoded into, rows bottom-up
+ * @param  format: Layout of the file, from makeFormatBMP
+ * @param  y: Row being decoded
+ * @param  target: Row to move to, may lie past the last row
+ * @param  done: Called with each finished row, or NULL
+ * @param  arg: Passed to done
+ * @return target
+ */
+static int advanceRowsRLEBMP(struct Pixel** pArr, const struct BMP_Format* format, int y, int target,
+                             BMP_Row_Done done, void* arg) {
+    for (; y < target && y < format->height; y++) {
+        if (done != NULL) {
+            done(arg, y);
+        }
+        if (y + 1 < format->height) {
+            for (int j = 0; j < format->width; j++) {
+                pArr[y + 1][j] = format->palette[0];
+            }
+        }
+    }
+    return target;
+}
+
+/**
+ * Decode a BI_RLE8 or BI_RLE4 pixel array straight into the pixel array.
+ * Pixels the encoded data skips over (deltas, early end of line) get color 0 of the table.
+ * Rows are decoded strictly bottom-up and each is started only once the one below it is
+ * finished, so all rows may share one buffer when done takes each row as it is finished.
+ *
+ * @param  data: Start of the encoded pixel array
+ * @param  size: Number of encoded bytes available
+ * @param  format: Layout of the file, from makeFormatBMP
+ * @param  pArr: Pixel array to store the pixels, rows bottom-up
+ * @param  done: Called with each row once it is finished, or NULL
+ * @param  arg: Passed to done
+ */
+static void decodeRLEBMP(const unsigned char* data, size_t size, const struct BMP_Format* format,
+                         struct Pixel** pArr, BMP_Row_Done done, void* arg) {
+    int width = format->width;
+    int height = format->height;
+    int rle4 = format->compression == BI_RLE4;
+
+    if (height <= 0) {
+        return;
+    }
+    for (int j = 0; j < width; j++) {
+        pArr[0][j] = format->palette[0];
+    }
+
+    int x = 0, y = 0;
+    size_t pos = 0;
+    while (pos + 1 < size && y < height) {
+        int count = data[pos];
+        int value = data[pos + 1];
+        pos += 2;
+
+        if (count > 0) {
+            // encoded run: count pixels of one index, RLE4 alternates the two nibbles
+            const struct Pixel* first = &format->palette[rle4 ? value >> 4 : value];
+            const struct Pixel* second = &format->palette[rle4 ? value & 0x0F : value];
+            for (int k = 0; k < count && x < width; k++, x++) {
+                pArr[y][x] = (k % 2 == 0) ? *first : *second;
+            }
+        } else if (value == 0) {
+            // end of line
+            x = 0;
+            y = advanceRowsRLEBMP(pArr, format, y, y + 1, done, arg);
+        } else if (value == 1) {
+            // end of bitmap
+            break;
+        } else if (value == 2) {
+            // delta: move right and up
+            if (pos + 1 >= size) {
+                break;
+            }
+            x += data[pos];
+            y = advanceRowsRLEBMP(pArr, format, y, y + data[pos + 1], done, arg);
+            pos += 2;
+        } else {
+            // absolute run of value indices, padded to a 16-bit boundary
+            int bytes = rle4 ? (value + 1) / 2 : value;
+            if (pos + bytes > size) {
+                break;
+            }
+            for (int k = 0; k < value; k++, x++) {
+                int index = rle4 ? (k % 2 == 0 ? data[pos + k / 2] >> 4 : data[pos + k / 2] & 0x0F)
+                                 : data[pos + k];
+                if (x < width && y < height) {
+                    pArr[y][x] = format->palette[index];
+                }
+            }
+            pos += bytes + (bytes & 1);
+        }
+    }
+
+    // rows the stream never reached keep color 0
+    advanceRowsRLEBMP(pArr, format, y, height, done, arg);
+}
+
+/**
+ * Parse the BMP header and the first 40 bytes of the DIB header out of the first 54 bytes of a file.
+ *
+ * @param  p: Start of the file, at least 54 bytes
+ * @param  bmp: Pointer to the destination BMP header
+ * @param  dib: Pointer to the destination DIB header
+ */
+static void unpackHeadersBMP(const unsigned char* p, struct BMP_Header* bmp, struct DIB_Header* dib) {
+    // BMP header: 14 bytes at the start of the file
+    memcpy(&bmp->signature, p, 2);
+    memcpy(&bmp->size, p + 2, sizeof(int));
+    memcpy(&bmp->reserved1, p + 6, sizeof(short));
+    memcpy(&bmp->reserved2, p + 8, sizeof(short));
+    memcpy(&bmp->offset_pixel_array, p + 10, sizeof(int));
+
+    // DIB header: first 40 bytes right after the BMP header
+    p += 14;
+    memcpy(&dib->dib_header, p, sizeof(int));
+    memcpy(&dib->image_width, p + 4, sizeof(int));
+    memcpy(&dib->image_height, p + 8, sizeof(int));
+    memcpy(&dib->planes, p + 12, sizeof(short));
+    memcpy(&dib->bits_per_pixel, p + 14, sizeof(short));
+    memcpy(&dib->compression, p + 16, sizeof(int));
+    memcpy(&dib->image_size, p + 20, sizeof(int));
+    memcpy(&dib->x_pixel_per_meter, p + 24, sizeof(int));
+    memcpy(&dib->y_pixel_per_meter, p + 28, sizeof(int));
+    memcpy(&dib->color_table, p + 32, sizeof(int));
+    memcpy(&dib->important_color_count, p + 36, sizeof(int));
+}
+
+/**
+ * Check that the pixel array offset and size of a BMP fit in the file.
+ *
+ * @param  bmp: BMP header of the file
+ * @param  format: Layout worked out by makeFormatBMP
+ * @param  length: Size of the file in bytes
+ * @return 0 if the file looks complete, -2 otherwise
+ */
+static int checkSizesBMP(const struct BMP_Header* bmp, const struct BMP_Format* format, size_t length) {
+    if (bmp->offset_pixel_array < 54 || (size_t)bmp->offset_pixel_array > length) {
+        return -2;
+    }
+    // the pixel array, padding included, must lie inside the file; compressed data has no fixed size
+    if (format->compression != BI_RLE8 && format->compression != BI_RLE4 &&
+        (size_t)bmp->offset_pixel_array + (size_t)format->row_size * format->height > length) {
+        return -2;
+    }
+    return 0;
+}
+
+/**
+ * Map a BMP file into memory and parse both headers out of the mapping.
+ * The pixel array is not copied; use mapRowBMP or readPixelsMappedBMP to access it.
+ *
+ * @param  filename: Name of the file to map
+ * @param  map: Pointer to the destination mapping
+ * @return 0 on success, -1 if the file can not be opened or mapped, -2 if it is not a supported BMP
+ */
+int mapBMP(const char* filename, struct BMP_Map* map) {
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < 54) {
+        close(fd);
+        return -2;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps its own reference to the file
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    map->data = (const unsigned char*)data;
+    map->length = st.st_size;
+
+    unpackHeadersBMP(map->data, &map->bmp, &map->dib);
+
+    // bit masks and color table lie between the headers and the pixel array
+    int offset = map->bmp.offset_pixel_array;
+    if (map->bmp.signature[0] != 'B' || map->bmp.signature[1] != 'M' ||
+        offset < 54 || (size_t)offset > map->length ||
+        makeFormatBMP(&map->dib, map->data + 54, offset - 54, &map->format) != 0 ||
+        checkSizesBMP(&map->bmp, &map->format, map->length) != 0) {
+        unmapBMP(map);
+        return -2;
+    }
+    map->pixels = map->data + offset;
+
+    // rows are decoded front to back
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+/**
+ * Unmap a BMP file mapped by mapBMP.
+ *
+ * @param  map: The mapping to release
+ */
+void unmapBMP(struct BMP_Map* map) {
+    if (map->data) {
+        munmap((void*)map->data, map->length);
+    }
+    map->data = NULL;
+    map->pixels = NULL;
+    map->length = 0;
+}
+
+/**
+ * Learn the layout of a BMP file from its headers alone, without touching the pixel array.
+ * The headers and any bit masks are fetched with a single pread, the file size with fstat.
+ * The color table is not read, format->palette is cleared even where the fetched bytes reach into it.
+ *
+ * @param  filename: Name of the file to probe
+ * @param  bmp: Pointer to the destination BMP header
+ * @param  dib: Pointer to the destination DIB header
+ * @param  format: Pointer to the destination format
+ * @return 0 on success, -1 if the file can not be opened or read, -2 if it is not a supported BMP
+ */
+int probeBMP(const char* filename, struct BMP_Header* bmp, struct DIB_Header* dib, struct BMP_Format* format) {
+    // headers plus the largest set of separate bit masks
+    unsigned char block[54 + 16];
+    struct stat st;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    ssize_t got = pread(fd, block, sizeof(block), 0);
+    close(fd);
+    if (got < 0) {
+        return -1;
+    }
+    if (got < 54) {
+        return -2;
+    }
+
+    unpackHeadersBMP(block, bmp, dib);
+    if (bmp->signature[0] != 'B' || bmp->signature[1] != 'M' ||
+        makeFormatBMP(dib, block + 54, (int)got - 54, format) != 0) {
+        return -2;
+    }
+    memset(format->palette, 0, sizeof(format->palette));
+    format->palette_size = 0;
+    return checkSizesBMP(bmp, format, st.st_size);
+}
+
+/**
+ * Returns a read-only pointer to the raw bytes of one row of a mapped BMP file.
+ *
+ * @param  map: The mapped file
+ * @param  row: Index of the row, in file order
+ */
+const unsigned char* mapRowBMP(const struct BMP_Map* map, int row) {
+    return map->pixels + (size_t)map->format.row_size * row;
+}
+
+/**
+ * Decode the pixels of a mapped BMP file straight from the mapping.
+ * Rows are stored bottom-up in pArr whatever the row order of the file.
+ *
+ * @param  map: The mapped file
+ * @param  pArr: Pixel array to store the pixels, at least format.width * format.height
+ */
+void readPixelsMappedBMP(const struct BMP_Map* map, struct Pixel** pArr) {
+    const struct BMP_Format* format = &map->format;
+
+    // compressed rows have no fixed position, decode the whole stream
+    if (format->compression == BI_RLE8 || format->compression == BI_RLE4) {
+        decodeRLEBMP(map->pixels, map->length - (map->pixels - map->data), format, pArr, NULL, NULL);
+        return;
+    }
+
+    for (int i = 0; i < format->height; i++) {
+        struct Pixel* dst = format->top_down ? pArr[format->height - 1 - i] : pArr[i];
+        format->unpack(mapRowBMP(map, i), dst, format->width, format);
+    }
+}
+
+/**
+ * Size of one side of an image decoded with readPixelsShrunkMappedBMP.
+ *
+ * @param  length: Width or height of the image in the file
+ * @param  shrink: Factor the image is shrunk by
+ * @return length divided by shrink, rounded up
+ */
+int shrinkSizeBMP(int length, int shrink) {
+    return (length + shrink - 1) / shrink;
+}
+
+/**
+ * Add each run of shrink pixels of a row to its sums, the last run may be shorter.
+ *
+ * @param  src: The full row
+ * @param  sums: Red, green and blue sum of each run, shrinkSizeBMP(width, shrink) * 3 of them
+ * @param  width: Number of pixels in the full row
+ * @param  shrink: Pixels in each run
+ */
+static void sumRunsBMP(const struct Pixel* src, unsigned long long* sums, int width, int shrink) {
+    for (int x = 0; x < width; sums += 3) {
+        int end = width - x < shrink ? width : x + shrink;
+        unsigned int red = 0, green = 0, blue = 0;
+        for (; x < end; x++) {
+            red += src[x].red;
+            green += src[x].green;
+            blue += src[x].blue;
+        }
+        sums[0] += red;
+        sums[1] += green;
+        sums[2] += blue;
+    }
+}
+
+/**
+ * Divide the sums of each run by the pixels that went into it, rounded to nearest, and clear
+ * the sums for the next row of runs.
+ *
+ * @param  sums: Red, green and blue sum of each run, from sumRunsBMP
+ * @param  dst: The shrunk row, shrinkSizeBMP(width, shrink) pixels
+ * @param  width: Number of pixels in the full row
+ * @param  shrink: Pixels in each run
+ * @param  rows: Number of rows added to the sums
+ */
+static void averageRunsBMP(unsigned long long* sums, struct Pixel* dst, int width, int shrink, int rows) {
+    for (int j = 0, x = 0; x < width; j++, x += shrink, sums += 3) {
+        unsigned long long pixels = (unsigned long long)(width - x < shrink ? width - x : shrink) * rows;
+        dst[j].red = (sums[0] + pixels / 2) / pixels;
+        dst[j].green = (sums[1] + pixels / 2) / pixels;
+        dst[j].blue = (sums[2] + pixels / 2) / pixels;
+        sums[0] = sums[1] = sums[2] = 0;
+    }
+}
+
+/**
+ * Rows of a run of shrink rows that are sampled for the shrunk row, the middles of its two
+ * halves so that 2 rows stand in for the whole run whatever its length.
+ *
+ * @param  first: First row of the run
+ * @param  count: Number of rows in the run
+ * @param  rows: Receives the sampled rows, in increasing order
+ * @return number of rows sampled, 1 or 2
+ */
+static int sampleRowsBMP(int first, int count, int rows[2]) {
+    rows[0] = first + count / 4;
+    rows[1] = first + count * 3 / 4;
+    return rows[1] == rows[0] ? 1 : 2;
+}
+
+/* State of an RLE stream decoded into a shrunk image, see shrinkRowDoneBMP. */
+struct BMP_Shrink {
+    const struct Pixel* row;
+    unsigned long long* sums;
+    struct Pixel** pArr;
+    int width;
+    int height;
+    int shrink;
+};
+
+/* Add a finished row of an RLE stream to its run if it is sampled, the last sample averages the run. */
+static void shrinkRowDoneBMP(void* arg, int row) {
+    struct BMP_Shrink* state = (struct BMP_Shrink*)arg;
+    int first = row - row % state->shrink;
+    int count = state->height - first < state->shrink ? state->height - first : state->shrink;
+    int rows[2];
+    int n = sampleRowsBMP(first, count, rows);
+    if (row == rows[0] || row == rows[1]) {
+        sumRunsBMP(state->row, state->sums, state->width, state->shrink);
+    }
+    if (row == rows[n - 1]) {
+        averageRunsBMP(state->sums, state->pArr[row / state->shrink], state->width, state->shrink, n);
+    }
+}
+
+/**
+ * Decode the pixels of a mapped BMP file straight into an image shrink times smaller on each
+ * side. Each run of shrink columns is box-averaged over two rows of its run of shrink rows, the
+ * middles of the run's two halves, and the other rows of the mapping are never touched, so
+ * memory and work follow the size of the shrunk image rather than the file. Blocks on the
+ * right and top edge may be smaller. Compressed files have no fixed row positions, their whole
+ * stream is decoded into one scratch row and only the sampled rows are added to the sums.
+ * Rows are stored bottom-up in pArr whatever the row order of the file.
+ *
+ * @param  map: The mapped file
+ * @param  pArr: Pixel array to store the pixels, shrinkSizeBMP of format.width by format.height
+ * @param  shrink: Factor both sides are divided by, 1 decodes every pixel
+ * @return 0 on success, -1 if the memory can not be allocated
+ */
+int readPixelsShrunkMappedBMP(const struct BMP_Map* map, struct Pixel** pArr, int shrink) {
+    const struct BMP_Format* format = &map->format;
+    int width = format->width;
+    int height = format->height;
+    int shrunk_width = shrinkSizeBMP(width, shrink);
+    int shrunk_height = shrinkSizeBMP(height, shrink);
+
+    if (shrink == 1) {
+        readPixelsMappedBMP(map, pArr);
+        return 0;
+    }
+
+    struct Pixel* row = (struct Pixel*)malloc(sizeof(struct Pixel) * width);
+    unsigned long long* sums = (unsigned long long*)calloc((size_t)3 * shrunk_width, sizeof(unsigned long long));
+    if (row == NULL || sums == NULL) {
+        free(row);
+        free(sums);
+        return -1;
+    }
+
+    if (format->compression == BI_RLE8 || format->compression == BI_RLE4) {
+        // every row of the stream lands in the one scratch row, sampled ones are summed as they finish
+        struct Pixel** rows = (struct Pixel**)malloc(sizeof(struct Pixel*) * height);
+        if (rows == NULL) {
+            free(row);
+            free(sums);
+            return -1;
+        }
+        for (int i = 0; i < height; i++) {
+            rows[i] = row;
+        }
+        struct BMP_Shrink state = {.row = row, .sums = sums, .pArr = pArr,
+                                   .width = width, .height = height, .shrink = shrink};
+        decodeRLEBMP(map->pixels, map->length - (map->pixels - map->data), format, rows,
+                     shrinkRowDoneBMP, &state);
+        free(rows);
+    } else {
+        for (int i = 0; i < shrunk_height; i++) {
+            // sampled rows of the run, bottom-up like pArr
+            int first = i * shrink;
+            int count = height - first < shrink ? height - first : shrink;
+            int rows[2];
+            int n = sampleRowsBMP(first, count, rows);
+            for (int k = 0; k < n; k++) {
+                int source = format->top_down ? height - 1 - rows[k] : rows[k];
+                format->unpack(mapRowBMP(map, source), row, width, format);
+                sumRunsBMP(row, sums, width, shrink);
+            }
+            averageRunsBMP(sums, pArr[i], width, shrink, n);
+        }
+    }
+
+    free(sums);
+    free(row);
+    return 0;
+}
+
+/**
+ * Encode one row of 8-bit palette indices as BI_RLE8, followed by an end of line marker.
+ *
+ * @param  row: Palette index of each pixel of the row
+ * @param  width: Number of pixels in the row
+ * @param  out: Destination, room for at least width * 2 + 2 bytes
+ * @return number of bytes written to out
+ */
+static size_t encodeRowRLE8(const unsigned char* row, int width, unsigned char* out) {
+    size_t n = 0;
+    int j = 0;
+
+    while (j < width) {
+        // length of the run of equal indices starting at j
+        int run = 1;
+        while (j + run < width && run < 255 && row[j + run] == row[j]) {
+            run++;
+        }
+        if (run >= 2) {
+            out[n++] = run;
+            out[n++] = row[j];
+            j += run;
+            continue;
+        }
+
+        // gather literals until the next run of at least 3 starts
+        int literal = 1;
+        while (j + literal < width && literal < 255) {
+            int next = j + literal;
+            if (next + 2 < width && row[next] == row[next + 1] && row[next] == row[next + 2]) {
+                break;
+            }
+            literal++;
+        }
+        if (literal < 3) {
+            // absolute mode needs at least 3 pixels, use runs of 1 instead
+            for (int k = 0; k < literal; k++) {
+                out[n++] = 1;
+                out[n++] = row[j + k];
+            }
+        } else {
+            out[n++] = 0;
+            out[n++] = literal;
+            memcpy(out + n, row + j, literal);
+            n += literal;
+            if (literal & 1) {
+                out[n++] = 0;
+            }
+        }
+        j += literal;
+    }
+
+    // end of line
+    out[n++] = 0;
+    out[n++] = 0;
+    return n;
+}
+
+/**
+ * Write an image as an 8-bit palettized BI_RLE8 BMP file.
+ * Only works for images with at most 256 distinct colors, nothing is written otherwise.
+ *
+ * @param  file: A pointer to the file being written
+ * @param  bmpHeader: BMP header of the output, size and offset are filled in
+ * @param  dibHeader: DIB header of the output, size, depth and compression are filled in
+ * @param  pArr: Pixel array of the image to write to the file
+ * @param  width: Width of the pixel array of this image
+ * @param  height: Height of the pixel array of this image
+ * @return 0 on success, -1 if a write failed, -2 if nothing was written because the image has
+ *         more than 256 colors or there is not enough memory to encode it
+ */
+int writeRLE8BMP(FILE* file, struct BMP_Header* bmpHeader, struct DIB_Header* dibHeader,
+                 struct Pixel** pArr, int width, int height) {
+    // open addressing table from 24-bit color to palette index
+    const int table_size = 1024;
+    int keys[1024];
+    unsigned char values[1024];
+    unsigned char palette[256 * 4];
+    int palette_size = 0;
+    memset(keys, -1, sizeof(keys));
+
+    unsigned char* indices = (unsigned char*)malloc((size_t)width * height);
+    if (indices == NULL) {
+        return -2;
+    }
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            int key = (pArr[i][j].red << 16) | (pArr[i][j].green << 8) | pArr[i][j].blue;
+            int slot = (int)(((unsigned int)key * 2654435761u) >> 22);
+            while (keys[slot] != -1 && keys[slot] != key) {
+                slot = (slot + 1) & (table_size - 1);
+            }
+            if (keys[slot] == -1) {
+                if (palette_size == 256) {
+                    free(indices);
+                    return -2;
+                }
+                keys[slot] = key;
+                values[slot] = palette_size;
+                palette[palette_size * 4] = pArr[i][j].blue;
+                palette[palette_size * 4 + 1] = pArr[i][j].green;
+                palette[palette_size * 4 + 2] = pArr[i][j].red;
+                palette[palette_size * 4 + 3] = 0;
+                palette_size++;
+            }
+            indices[(size_t)i * width + j] = values[slot];
+        }
+    }
+
+    // worst case every pixel is a run of 1, plus the end of line marker
+    unsigned char* encoded = (unsigned char*)malloc(((size_t)width * 2 + 2) * height + 2);
+    if (encoded == NULL) {
+        free(indices);
+        return -2;
+    }
+    size_t encoded_size = 0;
+    for (int i = 0; i < height; i++) {
+        encoded_size += encodeRowRLE8(indices + (size_t)i * width, width, encoded + encoded_size);
+    }
+    // end of bitmap
+    encoded[encoded_size++] = 0;
+    encoded[encoded_size++] = 1;
+
+    makeDIBHeader(dibHeader, width, height);
+    dibHeader->bits_per_pixel = 8;
+    dibHeader->compression = BI_RLE8;
+    dibHeader->image_size = (int)encoded_size;
+    dibHeader->color_table = palette_size;
+    bmpHeader->offset_pixel_array = 54 + palette_size * 4;
+    bmpHeader->size = bmpHeader->offset_pixel_array + (int)encoded_size;
+
+    // a short count from any write means the disk is full or the file went away
+    unsigned char headers[54];
+    packHeadersBMP(bmpHeader, dibHeader, headers);
+    int result = 0;
+    if (fwrite(headers, 1, sizeof(headers), file) != sizeof(headers) ||
+        fwrite(palette, 4, palette_size, file) != (size_t)palette_size ||
+        fwrite(encoded, 1, encoded_size, file) != encoded_size) {
+        result = -1;
+    }
+
+    free(encoded);
+    free(indices);
+    return result;
+}
+
+/**
+ * Serialise the BMP and DIB headers into the 54 bytes that start a BMP file.
+ *
+ * @param  bmpHeader: The BMP header to serialise
+ * @param  dibHeader: The DIB header to serialise
+ * @param  out: Destination, 54 bytes
+ */
+void packHeadersBMP(struct BMP_Header* bmpHeader, struct DIB_Header* dibHeader, unsigned char* out) {
+    // BMP header: 14 bytes
+    memcpy(out, bmpHeader->signature, 2);
+    memcpy(out + 2, &bmpHeader->size, sizeof(int));
+    memcpy(out + 6, &bmpHeader->reserved1, sizeof(short));
+    memcpy(out + 8, &bmpHeader->reserved2, sizeof(short));
+    memcpy(out + 10, &bmpHeader->offset_pixel_array, sizeof(int));
+
+    // DIB header: 40 bytes
+    out += 14;
+    memcpy(out, &dibHeader->dib_header, sizeof(int));
+    memcpy(out + 4, &dibHeader->image_width, sizeof(int));
+    memcpy(out + 8, &dibHeader->image_height, sizeof(int));
+    memcpy(out + 12, &dibHeader->planes, sizeof(short));
+    memcpy(out + 14, &dibHeader->bits_per_pixel, sizeof(short));
+    memcpy(out + 16, &dibHeader->compression, sizeof(int));
+    memcpy(out + 20, &dibHeader->image_size, sizeof(int));
+    memcpy(out + 24, &dibHeader->x_pixel_per_meter, sizeof(int));
+    memcpy(out + 28, &dibHeader->y_pixel_per_meter, sizeof(int));
+    memcpy(out + 32, &dibHeader->color_table, sizeof(int));
+    memcpy(out + 36, &dibHeader->important_color_count, sizeof(int));
+}
+
+/**
+ * writev every byte of an iovec array, retrying after short writes and signals.
+ */
+static int writevFullyBMP(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // drop the fully written entries, trim the partly written one
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reserve the space of a whole output file up front. Not every file system supports it,
+ * failure only means the space is allocated as the file is written.
+ */
+static void preallocateBMP(int fd, struct BMP_Header* bmpHeader, int preallocate) {
+    if (preallocate && bmpHeader->size > 0) {
+        posix_fallocate(fd, 0, bmpHeader->size);
+    }
+}
+
+/**
+ * Write one staged chunk, with the serialised headers in front of it if given.
+ */
+static int flushChunkBMP(int fd, unsigned char* headers, unsigned char* chunk, size_t used) {
+    struct iovec iov[2];
+    int count = 0;
+    if (headers != NULL) {
+        iov[count].iov_base = headers;
+        iov[count++].iov_len = 54;
+    }
+    iov[count].iov_base = chunk;
+    iov[count++].iov_len = used;
+    return writevFullyBMP(fd, iov, count);
+}
+
+/**
+ * Encode one row of pixels as 24-bit BGR, followed by zero padding up to rowSize.
+ *
+ * @param  src: Pixels of the row
+ * @param  dst: Destination, rowSize bytes
+ * @param  width: Number of pixels in the row
+ * @param  rowSize: Padded size of the row in bytes
+ */
+static void packRowBMP(const struct Pixel* src, unsigned char* dst, int width, size_t rowSize) {
+    for (int j = 0; j < width; j++) {
+        dst[j * 3] = src[j].blue;
+        dst[j * 3 + 1] = src[j].green;
+        dst[j * 3 + 2] = src[j].red;
+    }
+    memset(dst + (size_t)width * 3, 0, rowSize - (size_t)width * 3);
+}
+
+/**
+ * Write a whole 24-bit BMP file to a file descriptor. The headers are serialised into one
+ * block and the encoded rows are staged in large chunks, so the file goes out in a few
+ * writev calls that, apart from the last one, end on chunk boundaries of the file. Rows are
+ * encoded straight into the chunk, only a row that straddles a flush goes through a row buffer.
+ *
+ * @param  fd: File descriptor of the file being written, positioned at its start
+ * @param  bmpHeader: BMP header of the file, from makeBMPHeader
+ * @param  dibHeader: DIB header of the file, from makeDIBHeader
+ * @param  pArr: Pixel array of the image to write to the file
+ * @param  width: Width of the pixel array of this image
+ * @param  height: Height of the pixel array of this image
+ * @param  preallocate: 1 to reserve bmpHeader->size bytes with posix_fallocate first
+ * @return 0 on success, -1 if a write fails or the memory can not be allocated
+ */
+int writeBMPFd(int fd, struct BMP_Header* bmpHeader, struct DIB_Header* dibHeader,
+               struct Pixel** pArr, int width, int height, int preallocate) {
+    const size_t chunk_size = 1 << 20;
+    size_t rowSize = (width * 3 + 3) & ~3;
+    unsigned char headers[54];
+    unsigned char* chunk = (unsigned char*)malloc(chunk_size);
+    unsigned char* row = (unsigned char*)malloc(rowSize);
+    int result = 0;
+
+    if (chunk == NULL || row == NULL) {
+        free(row);
+        free(chunk);
+        return -1;
+    }
+
+    preallocateBMP(fd, bmpHeader, preallocate);
+    packHeadersBMP(bmpHeader, dibHeader, headers);
+
+    // the first chunk is short by the header size, so later chunks start on chunk boundaries
+    size_t capacity = chunk_size - sizeof(headers);
+    size_t used = 0;
+    int first = 1;
+
+    for (int i = 0; i < height && result == 0; i++) {
+        size_t done = 0;
+        if (rowSize <= capacity - used) {
+            // encode the row straight into the chunk
+            packRowBMP(pArr[i], chunk + used, width, rowSize);
+            used += rowSize;
+            done = rowSize;
+        } else {
+            // the row straddles a flush, encode it aside and copy it over in pieces
+            packRowBMP(pArr[i], row, width, rowSize);
+        }
+
+        // flush every time the chunk fills up
+        while (result == 0) {
+            if (used == capacity) {
+                result = flushChunkBMP(fd, first ? headers : NULL, chunk, used);
+                first = 0;
+                used = 0;
+                capacity = chunk_size;
+            }
+            if (done == rowSize) {
+                break;
+            }
+            size_t n = rowSize - done < capacity - used ? rowSize - done : capacity - used;
+            memcpy(chunk + used, row + done, n);
+            used += n;
+            done += n;
+        }
+    }
+    if (result == 0 && (used > 0 || first)) {
+        result = flushChunkBMP(fd, first ? headers : NULL, chunk, used);
+    }
+
+    free(row);
+    free(chunk);
+    return result;
+}
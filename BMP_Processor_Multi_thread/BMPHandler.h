@@ -34,6 +34,44 @@ struct DIB_Header{
     int important_color_count;  /* Number of important color 0 = all */
 };
 
+/* Compression types understood by the reader */
+#define BI_RGB            0
+#define BI_RLE8           1
+#define BI_RLE4           2
+#define BI_BITFIELDS      3
+#define BI_ALPHABITFIELDS 6
+
+struct BMP_Format;
+
+/* Unpacks one row of the pixel array into struct Pixel, chosen once per file */
+typedef void (*BMP_Unpack)(const unsigned char* src, struct Pixel* dst, int width, const struct BMP_Format* format);
+
+/* Layout of the pixel array of a BMP file, worked out once per file. */
+struct BMP_Format {
+    int width;                      /* Image's width */
+    int height;                     /* Image's height, always positive */
+    int top_down;                   /* 1 if the first row in the file is the top row */
+    int bits_per_pixel;             /* 1, 4, 8, 16, 24 or 32 */
+    int compression;                /* Compression type, see BI_* above */
+    int row_size;                   /* Size of one row in bytes, padding included */
+    unsigned int masks[4];          /* Red, green, blue and alpha bit masks of 16 and 32 bit pixels */
+    int shifts[4];                  /* Position of the lowest bit of each mask */
+    int bits[4];                    /* Number of bits in each mask */
+    int palette_size;               /* Number of entries in the color table */
+    struct Pixel palette[256];      /* Color table of 1, 4 and 8 bit pixels */
+    BMP_Unpack unpack;              /* Row unpack loop for this layout */
+};
+
+/* Read-only view of a BMP file mapped into memory. */
+struct BMP_Map {
+    const unsigned char* data;      /* Start of the mapped file */
+    size_t length;                  /* Length of the mapping in bytes */
+    struct BMP_Header bmp;          /* BMP header parsed from the mapping */
+    struct DIB_Header dib;          /* DIB header parsed from the mapping */
+    struct BMP_Format format;       /* Layout of the pixel array */
+    const unsigned char* pixels;    /* First row of the pixel array (offset_pixel_array) */
+};
+
 /**
  * Read BMP header of a BMP file.
  *
@@ -91,8 +129,10 @@ void makeDIBHeader(struct DIB_Header* header, int width, int height);
  * @param  pArr: Pixel array to store the pixels being read
  * @param  width: Width of the pixel array of this image
  * @param  height: Height of the pixel array of this image
+ * @return 0 on success, -1 if the file ends early or the memory can not be allocated, rows
+ *         that could not be read are set to 0
  */
-void readPixelsBMP(FILE* file, struct Pixel** pArr, int width, int height);
+int readPixelsBMP(FILE* file, struct Pixel** pArr, int width, int height);
 
 /**
  * Write Pixels from BMP file based on width and height.
@@ -101,7 +141,150 @@ void readPixelsBMP(FILE* file, struct Pixel** pArr, int width, int height);
  * @param  pArr: Pixel array of the image to write to the file
  * @param  width: Width of the pixel array of this image
  * @param  height: Height of the pixel array of this image
+ * @return 0 on success, -1 if a write fails or the memory can not be allocated
+ */
+int writePixelsBMP(FILE* file, struct Pixel** pArr, int width, int height);
+
+/**
+ * Read the bit masks and color table that follow the headers and work out the pixel layout.
+ * The file must be positioned right after readBMPHeader and readDIBHeader.
+ *
+ * @param  file: A pointer to the file being read
+ * @param  bmp: BMP header of the file
+ * @param  dib: DIB header of the file
+ * @param  format: Pointer to the destination format
+ * @return 0 on success, -1 if the file is not a supported BMP
+ */
+int readFormatBMP(FILE* file, struct BMP_Header* bmp, struct DIB_Header* dib, struct BMP_Format* format);
+
+/**
+ * Read a band of rows of any uncompressed layout, rows are numbered bottom-up like pArr.
+ *
+ * @param  file: A pointer to the file being read
+ * @param  bmp: BMP header of the file, for the pixel array offset
+ * @param  format: Layout of the pixel array, from readFormatBMP
+ * @param  pArr: Pixel array to store the rows being read
+ * @param  first_row: Index of the first row to read
+ * @param  rows: Number of rows to read
+ * @return 0 on success, -1 if the file ends early or the memory can not be allocated, rows
+ *         that could not be read are set to 0
+ */
+int readRowsBMP(FILE* file, struct BMP_Header* bmp, const struct BMP_Format* format,
+                struct Pixel** pArr, int first_row, int rows);
+
+/**
+ * Map a BMP file into memory and parse both headers out of the mapping.
+ * The pixel array is not copied; use mapRowBMP or readPixelsMappedBMP to access it.
+ *
+ * @param  filename: Name of the file to map
+ * @param  map: Pointer to the destination mapping
+ * @return 0 on success, -1 if the file can not be opened or mapped, -2 if it is not a supported BMP
+ */
+int mapBMP(const char* filename, struct BMP_Map* map);
+
+/**
+ * Unmap a BMP file mapped by mapBMP.
+ *
+ * @param  map: The mapping to release
+ */
+void unmapBMP(struct BMP_Map* map);
+
+/**
+ * Learn the layout of a BMP file from its headers alone, without touching the pixel array.
+ * The headers and any bit masks are fetched with a single pread, the file size with fstat.
+ * The color table is not read, format->palette is cleared even where the fetched bytes reach into it.
+ *
+ * @param  filename: Name of the file to probe
+ * @param  bmp: Pointer to the destination BMP header
+ * @param  dib: Pointer to the destination DIB header
+ * @param  format: Pointer to the destination format
+ * @return 0 on success, -1 if the file can not be opened or read, -2 if it is not a supported BMP
+ */
+int probeBMP(const char* filename, struct BMP_Header* bmp, struct DIB_Header* dib, struct BMP_Format* format);
+
+/**
+ * Returns a read-only pointer to the raw bytes of one row of a mapped BMP file.
+ *
+ * @param  map: The mapped file
+ * @param  row: Index of the row, in file order
+ */
+const unsigned char* mapRowBMP(const struct BMP_Map* map, int row);
+
+/**
+ * Decode the pixels of a mapped BMP file straight from the mapping.
+ * Rows are stored bottom-up in pArr whatever the row order of the file.
+ *
+ * @param  map: The mapped file
+ * @param  pArr: Pixel array to store the pixels, at least format.width * format.height
+ */
+void readPixelsMappedBMP(const struct BMP_Map* map, struct Pixel** pArr);
+
+/**
+ * Size of one side of an image decoded with readPixelsShrunkMappedBMP.
+ *
+ * @param  length: Width or height of the image in the file
+ * @param  shrink: Factor the image is shrunk by
+ * @return length divided by shrink, rounded up
+ */
+int shrinkSizeBMP(int length, int shrink);
+
+/**
+ * Decode the pixels of a mapped BMP file straight into an image shrink times smaller on each
+ * side. Each run of shrink columns is box-averaged over two rows of its run of shrink rows, the
+ * middles of the run's two halves, and the other rows of the mapping are never touched, so
+ * memory and work follow the size of the shrunk image rather than the file. Blocks on the
+ * right and top edge may be smaller. Compressed files have no fixed row positions, their whole
+ * stream is decoded into one scratch row and only the sampled rows are added to the sums.
+ * Rows are stored bottom-up in pArr whatever the row order of the file.
+ *
+ * @param  map: The mapped file
+ * @param  pArr: Pixel array to store the pixels, shrinkSizeBMP of format.width by format.height
+ * @param  shrink: Factor both sides are divided by, 1 decodes every pixel
+ * @return 0 on success, -1 if the memory can not be allocated
+ */
+int readPixelsShrunkMappedBMP(const struct BMP_Map* map, struct Pixel** pArr, int shrink);
+
+/**
+ * Write an image as an 8-bit palettized BI_RLE8 BMP file.
+ * Only works for images with at most 256 distinct colors, nothing is written otherwise.
+ *
+ * @param  file: A pointer to the file being written
+ * @param  bmpHeader: BMP header of the output, size and offset are filled in
+ * @param  dibHeader: DIB header of the output, size, depth and compression are filled in
+ * @param  pArr: Pixel array of the image to write to the file
+ * @param  width: Width of the pixel array of this image
+ * @param  height: Height of the pixel array of this image
+ * @return 0 on success, -1 if a write failed, -2 if nothing was written because the image has
+ *         more than 256 colors or there is not enough memory to encode it
+ */
+int writeRLE8BMP(FILE* file, struct BMP_Header* bmpHeader, struct DIB_Header* dibHeader,
+                 struct Pixel** pArr, int width, int height);
+
+/**
+ * Serialise the BMP and DIB headers into the 54 bytes that start a BMP file.
+ *
+ * @param  bmpHeader: The BMP header to serialise
+ * @param  dibHeader: The DIB header to serialise
+ * @param  out: Destination, 54 bytes
+ */
+void packHeadersBMP(struct BMP_Header* bmpHeader, struct DIB_Header* dibHeader, unsigned char* out);
+
+/**
+ * Write a whole 24-bit BMP file to a file descriptor. The headers are serialised into one
+ * block and the encoded rows are staged in large chunks, so the file goes out in a few
+ * writev calls that, apart from the last one, end on chunk boundaries of the file. Rows are
+ * encoded straight into the chunk, only a row that straddles a flush goes through a row buffer.
+ *
+ * @param  fd: File descriptor of the file being written, positioned at its start
+ * @param  bmpHeader: BMP header of the file, from makeBMPHeader
+ * @param  dibHeader: DIB header of the file, from makeDIBHeader
+ * @param  pArr: Pixel array of the image to write to the file
+ * @param  width: Width of the pixel array of this image
+ * @param  height: Height of the pixel array of this image
+ * @param  preallocate: 1 to reserve bmpHeader->size bytes with posix_fallocate first
+ * @return 0 on success, -1 if a write fails or the memory can not be allocated
  */
-void writePixelsBMP(FILE* file, struct Pixel** pArr, int width, int height);
+int writeBMPFd(int fd, struct BMP_Header* bmpHeader, struct DIB_Header* dibHeader,
+               struct Pixel** pArr, int width, int height, int preallocate);
 
 #endif //BMP_PROCESSOR_MULTI_THREAD_BMPHANDLER_H
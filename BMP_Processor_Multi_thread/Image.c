@@ -2,15 +2,168 @@
 * Implementation of the image ADT.
 *
 * @author Sheldon Pang
-* @version 1.1
+* @version 1.8
  * 1.1 update notes: Added box blur filter, "void*  image_apply_blur_filter(void* thread_args)"
  *                   Added Swiss Cheese filter, "void* image_apply_swiss_cheese_filter(void* thread_args)"
+ * 1.2 update notes: Box blur of any radius with running sums, "int image_box_blur(const struct Image_View* view, int radius)"
+ * 1.3 update notes: Gaussian blur, "int image_gaussian_blur(const struct Image_View* view, double sigma)"
+ *                   Unsharp mask, "int image_unsharp_mask(const struct Image_View* view, double sigma, double amount, int threshold)"
+ * 1.4 update notes: Tiled convolution with any kernel, "int image_convolve(const struct Image_View* view, const struct Image_Kernel* kernel)"
+ * 1.5 update notes: Every filter splits its work over the shared thread pool, see ThreadPool.h
+ * 1.6 update notes: Any image size splits over any thread count, small images stay on one thread
+ * 1.7 update notes: Vertical blur passes split in bands of rows with halo rows, not column strips
+ * 1.8 update notes: Smaller chunks, threads that finish early steal the rest of them
 */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <math.h>
 #include <time.h>
 #include "Image.h"
+#include "ThreadPool.h"
+
+/** Free pixel buffers kept for reuse, shared by every thread. Sizes are rounded up to one of
+ * four classes per power of two, so a buffer is at most 25% larger than asked for.
+*/
+#define IMAGE_POOL_CLASSES 256
+#define IMAGE_POOL_DEPTH   8    /* buffers kept per size class, more are freed */
+
+static void* image_pool_blocks[IMAGE_POOL_CLASSES][IMAGE_POOL_DEPTH];
+static int image_pool_count[IMAGE_POOL_CLASSES];
+static pthread_mutex_t image_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Returns the size class of a buffer of size bytes.
+*
+ * @param  size: Bytes needed.
+ * @param  capacity: Set to the bytes every buffer of the class holds.
+ * @return Index of the size class.
+*/
+static int image_pool_class(size_t size, size_t* capacity) {
+    if (size < 256) {
+        size = 256;
+    }
+    // size lies in (2^k, 2^(k+1)], split in four steps of 2^(k-2)
+    int k = 63 - __builtin_clzll((unsigned long long)(size - 1));
+    size_t base = (size_t)1 << k;
+    size_t step = base >> 2;
+    size_t sub = (size - base + step - 1) / step;
+    *capacity = base + sub * step;
+    return 4 * k + (int)sub - 1;
+}
+
+/** Takes a 64-byte aligned buffer of at least size bytes from the pool, or allocates one.
+*
+ * @param  size: Bytes needed.
+ * @param  capacity: Set to the bytes the buffer holds, to hand back to image_pool_free.
+ * @return The buffer, NULL if the memory can not be allocated.
+*/
+static void* image_pool_alloc(size_t size, size_t* capacity) {
+    int sizeClass = image_pool_class(size, capacity);
+    void* block = NULL;
+
+    pthread_mutex_lock(&image_pool_lock);
+    if (image_pool_count[sizeClass] > 0) {
+        block = image_pool_blocks[sizeClass][--image_pool_count[sizeClass]];
+    }
+    pthread_mutex_unlock(&image_pool_lock);
+
+    if (block == NULL && posix_memalign(&block, 64, *capacity) != 0) {
+        return NULL;
+    }
+    return block;
+}
+
+/** Hands a buffer from image_pool_alloc back to the pool.
+*
+ * @param  block: The buffer, may be NULL.
+ * @param  capacity: Capacity given by image_pool_alloc.
+*/
+static void image_pool_free(void* block, size_t capacity) {
+    if (block == NULL) {
+        return;
+    }
+    size_t classCapacity;
+    int sizeClass = image_pool_class(capacity, &classCapacity);
+
+    pthread_mutex_lock(&image_pool_lock);
+    if (image_pool_count[sizeClass] < IMAGE_POOL_DEPTH) {
+        image_pool_blocks[sizeClass][image_pool_count[sizeClass]++] = block;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&image_pool_lock);
+
+    free(block);
+}
+
+/** Frees every pixel buffer the pool keeps for reuse. Destroyed images hand their buffers
+ * to the pool so the next image of a similar size needs no allocation; call this once the
+ * last image is done.
+*/
+void image_pool_release(void) {
+    pthread_mutex_lock(&image_pool_lock);
+    for (int c = 0; c < IMAGE_POOL_CLASSES; c++) {
+        while (image_pool_count[c] > 0) {
+            free(image_pool_blocks[c][--image_pool_count[c]]);
+        }
+    }
+    pthread_mutex_unlock(&image_pool_lock);
+}
+
+/** Allocates height rows of width pixels in one 64-byte aligned block, each row padded
+ * to a multiple of 64 bytes, with the row pointer table in front of them. The block comes
+ * from the buffer pool.
+*
+ * @param  width: Width of the rows.
+ * @param  height: Number of rows.
+ * @param  data: Set to the block.
+ * @param  size: Set to the capacity of the block, to hand back to image_pool_free.
+ * @param  stride: Set to the bytes from one row to the next.
+ * @return The row pointer table, NULL if the memory can not be allocated.
+*/
+static struct Pixel** image_alloc_rows(int width, int height, unsigned char** data, size_t* size,
+                                       size_t* stride) {
+    *stride = ((size_t)width * sizeof(struct Pixel) + 63) & ~(size_t)63;
+
+    // the row pointer table sits in front of the rows, in the same pooled block
+    size_t table = (sizeof(struct Pixel*) * height + 63) & ~(size_t)63;
+    unsigned char* block = (unsigned char*)image_pool_alloc(table + *stride * height, size);
+    if (block == NULL) {
+        return NULL;
+    }
+    struct Pixel** rows = (struct Pixel**)block;
+    for (int i = 0; i < height; i++) {
+        rows[i] = (struct Pixel*)(block + table + *stride * i);
+    }
+    *data = block;
+    return rows;
+}
+
+/** Creates a new image that owns its pixels. All rows live in one 64-byte aligned
+ * allocation, each row starts on a 64-byte boundary, stride bytes after the previous one.
+ * The pixels are not initialised.
+*
+ * @param  width: Width of this image.
+ * @param  height: Height of this image.
+ * @return A pointer to a new image, NULL if the memory can not be allocated.
+*/
+Image* image_new(int width, int height) {
+    Image *image = (Image*) malloc(sizeof (Image));
+    if (image == NULL) {
+        return NULL;
+    }
+
+    image->width = width;
+    image->height = height;
+    image->pArr = image_alloc_rows(width, height, &image->data, &image->data_size, &image->stride);
+    if (image->pArr == NULL) {
+        free(image);
+        return NULL;
+    }
+
+    return image;
+}
 
 /** Creates a new image and returns it.
 *
@@ -25,15 +178,20 @@ Image* image_create(struct Pixel** pArr, int width, int height) {
     image->width = width;
     image->height = height;
     image->pArr = pArr;
+    image->data = NULL;
+    image->data_size = 0;
+    image->stride = 0;
 
     return image;
 }
 
-/** Destroys an image. Does not deallocate internal pixel array.
+/** Destroys an image. Pixels the image owns (image_new) go back to the buffer pool,
+ * the pixel array given to image_create is not deallocated.
 *
  * @param  img: the image to destroy.
 */
 void image_destroy(Image** img) {
+    image_pool_free((*img)->data, (*img)->data_size);
     free(*img);
     *img = NULL;
 }
@@ -62,97 +220,937 @@ int image_get_height(Image* img) {
     return img->height;
 }
 
-/** Apply box blur filter to image.
-*   Output pixel is computed as the average of itself and each of its neighbors
+/** Returns a pointer to the first pixel of a row.
 *
  * @param  img: the image.
- * @param  thread_count: the total number of thread.
- * @param  thread_id: the id of the thread
-*/
-void*  image_apply_blur_filter(void* thread_args) {
-
-    int thread_height = ((struct thread_args*)thread_args)->thread_height;
-    int thread_width = ((struct thread_args*)thread_args)->thread_width;
-
-    for (int i = 0; i < thread_height; i++) {
-        for (int j = 0; j < thread_width; j++) {
-            int increment_i = i + 1, decrement_i = i - 1, increment_j = j + 1, decrement_j = j - 1;
-            if (increment_i == thread_height)       /* prevent index out of bounds */
-                increment_i = i;
-            if (decrement_i < 0)                    /* prevent index out of bounds */
-                decrement_i = 0;
-            if (increment_j == thread_width)        /* prevent index out of bounds */
-                increment_j = j;
-            if (decrement_j < 0)                    /* prevent index out of bounds */
-                decrement_j = 0;
-
-            /* The logic of blur filter is sums up all neighbor pixels and divide by 9 include self */
-            ((struct thread_args*)thread_args)->pArr[i][j].red = (
-                    ((struct thread_args*)thread_args)->pArr[decrement_i][decrement_j].red +
-                    ((struct thread_args*)thread_args)->pArr[decrement_i][j].red+
-                    ((struct thread_args*)thread_args)->pArr[decrement_i][increment_j].red +
-                    ((struct thread_args*)thread_args)->pArr[i][decrement_j].red +
-                    ((struct thread_args*)thread_args)->pArr[i][increment_j].red +
-                    ((struct thread_args*)thread_args)->pArr[increment_i][decrement_j].red +
-                    ((struct thread_args*)thread_args)->pArr[increment_i][j].red +
-                    ((struct thread_args*)thread_args)->pArr[increment_i][increment_j].red
-                            ) / 9;
-
-            ((struct thread_args*)thread_args)->pArr[i][j].green = (
-                    ((struct thread_args*)thread_args)->pArr[decrement_i][decrement_j].green +
-                    ((struct thread_args*)thread_args)->pArr[decrement_i][j].green +
-                    ((struct thread_args*)thread_args)->pArr[decrement_i][increment_j].green +
-                    ((struct thread_args*)thread_args)->pArr[i][decrement_j].red +
-                    ((struct thread_args*)thread_args)->pArr[i][increment_j].green +
-                    ((struct thread_args*)thread_args)->pArr[increment_i][decrement_j].green +
-                    ((struct thread_args*)thread_args)->pArr[increment_i][j].green +
-                    ((struct thread_args*)thread_args)->pArr[increment_i][increment_j].green
-                            ) / 9;
-
-            ((struct thread_args*)thread_args)->pArr[i][j].blue = (
-                    ((struct thread_args*)thread_args)->pArr[decrement_i][decrement_j].blue +
-                    ((struct thread_args*)thread_args)->pArr[decrement_i][j].blue +
-                    ((struct thread_args*)thread_args)->pArr[decrement_i][increment_j].blue +
-                    ((struct thread_args*)thread_args)->pArr[i][decrement_j].blue +
-                    ((struct thread_args*)thread_args)->pArr[i][increment_j].blue +
-                    ((struct thread_args*)thread_args)->pArr[increment_i][decrement_j].blue +
-                    ((struct thread_args*)thread_args)->pArr[increment_i][j].blue +
-                    ((struct thread_args*)thread_args)->pArr[increment_i][increment_j].blue
-                            ) / 9;
+ * @param  row: index of the row.
+*/
+struct Pixel* image_get_row(Image* img, int row) {
+    return img->pArr[row];
+}
+
+/** Returns the number of bytes from the start of one row to the next,
+ * 0 if the rows were given to image_create and are not evenly spaced.
+*
+ * @param  img: the image.
+*/
+size_t image_get_stride(Image* img) {
+    return img->stride;
+}
+
+/** Returns a view of a rectangle of an image. The image must own its pixels (image_new)
+ * and the rectangle must lie inside it.
+*
+ * @param  img: the image.
+ * @param  x: first column of the rectangle.
+ * @param  y: first row of the rectangle.
+ * @param  width: width of the rectangle.
+ * @param  height: height of the rectangle.
+*/
+struct Image_View image_get_view(Image* img, int x, int y, int width, int height) {
+    struct Image_View view;
+    view.origin = img->pArr[y] + x;
+    view.width = width;
+    view.height = height;
+    view.stride = img->stride;
+    return view;
+}
+
+/** Returns a view of a rectangle of another view, which must lie inside it.
+*
+ * @param  view: the view.
+ * @param  x: first column of the rectangle.
+ * @param  y: first row of the rectangle.
+ * @param  width: width of the rectangle.
+ * @param  height: height of the rectangle.
+*/
+struct Image_View image_view_sub(const struct Image_View* view, int x, int y, int width, int height) {
+    struct Image_View sub;
+    sub.origin = image_view_row(view, y) + x;
+    sub.width = width;
+    sub.height = height;
+    sub.stride = view->stride;
+    return sub;
+}
+
+/** Returns a pointer to the first pixel of a row of a view.
+*
+ * @param  view: the view.
+ * @param  row: index of the row.
+*/
+struct Pixel* image_view_row(const struct Image_View* view, int row) {
+    return (struct Pixel*)((unsigned char*)view->origin + view->stride * row);
+}
+
+/** Largest radius image_box_blur takes, the divisor 2 * radius + 1 stays below 4096 so the
+ * rounded division by it can be done with a 32-bit reciprocal.
+*/
+#define IMAGE_BLUR_MAX_RADIUS 2047
+#define IMAGE_PARALLEL_ROWS   16    /* fewest rows a thread is handed at once */
+#define IMAGE_PARALLEL_PIXELS 32768 /* fewest pixels worth waking another thread for */
+
+/** Below this sigma three box blurs are a poor Gaussian, image_gaussian_blur convolves with
+ * the sampled Gaussian instead, out to 3 sigma.
+*/
+#define IMAGE_GAUSSIAN_KERNEL_SIGMA  2.0
+#define IMAGE_GAUSSIAN_KERNEL_RADIUS 6
+#define IMAGE_GAUSSIAN_SHIFT         14     /* kernel weights are in 1/2^14 */
+
+/* A blur pass, shared by the threads working on it: each band of rows of dst is computed
+ * from src, which no thread writes while the pass runs. */
+struct Image_Blur_Pass {
+    struct Image_View src;
+    struct Image_View dst;
+    int radius;
+    unsigned long long reciprocal;  /* 2^32 / (2 * radius + 1), rounded up */
+    int weights[2 * IMAGE_GAUSSIAN_KERNEL_RADIUS + 1];  /* sampled Gaussian, 2 * radius + 1 taps */
+    int amount;                     /* unsharp mask gain in 1/256 */
+    int threshold;                  /* unsharp mask leaves smaller differences alone */
+};
+
+/** Returns sum / (2 * radius + 1) rounded to nearest, exact for every sum of up to
+ * 2 * radius + 1 channel values.
+*/
+static inline unsigned char image_blur_divide(const struct Image_Blur_Pass* pass, int sum) {
+    return (unsigned char)(((unsigned long long)(sum + pass->radius) * pass->reciprocal) >> 32);
+}
+
+/** Horizontal pass: a running sum of the 2 * radius + 1 pixels around each pixel of a row,
+ * one pixel enters and one leaves per step whatever the radius. Columns outside the row
+ * repeat its first or last pixel.
+*/
+static int image_box_blur_rows(void* arg, int first, int last) {
+    struct Image_Blur_Pass* pass = (struct Image_Blur_Pass*)arg;
+    int radius = pass->radius;
+    int edge = pass->src.width - 1;
+
+    for (int i = first; i < last; i++) {
+        const unsigned char* in = (const unsigned char*)image_view_row(&pass->src, i);
+        unsigned char* out = (unsigned char*)image_view_row(&pass->dst, i);
+
+        int sum[3] = {0, 0, 0};
+        for (int k = -radius; k <= radius; k++) {
+            int x = k < 0 ? 0 : (k > edge ? edge : k);
+            sum[0] += in[3 * x];
+            sum[1] += in[3 * x + 1];
+            sum[2] += in[3 * x + 2];
+        }
+
+        for (int j = 0; j <= edge; j++) {
+            int enter = j + radius + 1 > edge ? edge : j + radius + 1;
+            int leave = j - radius < 0 ? 0 : j - radius;
+            for (int c = 0; c < 3; c++) {
+                out[3 * j + c] = image_blur_divide(pass, sum[c]);
+                sum[c] += in[3 * enter + c] - in[3 * leave + c];
+            }
+        }
+    }
+    return 0;
+}
+
+/** Vertical pass over a band of rows [first, last) of dst: a running sum per channel of
+ * every column, one source row enters and one leaves per output row. The band reads radius
+ * halo rows above and below it from src and writes only its own rows of dst, so bands give
+ * the same result however the rows are split, and every access runs along a row.
+ * Rows outside the source repeat its first or last row.
+*/
+static int image_box_blur_columns(void* arg, int first, int last) {
+    struct Image_Blur_Pass* pass = (struct Image_Blur_Pass*)arg;
+    int radius = pass->radius;
+    int edge = pass->src.height - 1;
+    int channels = 3 * pass->src.width;
+
+    int* sum = (int*)calloc(channels, sizeof(int));
+    if (sum == NULL) {
+        return -1;
+    }
+
+    for (int k = first - radius; k <= first + radius; k++) {
+        const unsigned char* in = (const unsigned char*)image_view_row(&pass->src, k < 0 ? 0 : (k > edge ? edge : k));
+        for (int c = 0; c < channels; c++) {
+            sum[c] += in[c];
+        }
+    }
+
+    for (int i = first; i < last; i++) {
+        int enter = i + radius + 1 > edge ? edge : i + radius + 1;
+        int leave = i - radius < 0 ? 0 : i - radius;
+        const unsigned char* in = (const unsigned char*)image_view_row(&pass->src, enter);
+        const unsigned char* out_of = (const unsigned char*)image_view_row(&pass->src, leave);
+        unsigned char* out = (unsigned char*)image_view_row(&pass->dst, i);
+        for (int c = 0; c < channels; c++) {
+            out[c] = image_blur_divide(pass, sum[c]);
+            sum[c] += in[c] - out_of[c];
+        }
+    }
+
+    free(sum);
+    return 0;
+}
+
+/** Returns how many rows or columns to hand a thread at once so the pool gets eight chunks per
+ * thread, none smaller than min_grain rows or columns or 32768 pixels. Images too small to
+ * fill two such chunks are filtered on the calling thread alone, the last chunk takes the
+ * remainder however the extent divides.
+*
+ * @param  extent: number of rows or columns to split.
+ * @param  span: pixels in each row or column.
+ * @param  min_grain: fewest rows or columns worth a chunk.
+ * @return rows or columns per chunk, at least 1.
+*/
+int image_parallel_grain(int extent, int span, int min_grain) {
+    int pixel_grain = span > 0 ? (IMAGE_PARALLEL_PIXELS + span - 1) / span : 1;
+    return parallelGrain(extent, 8, pixel_grain > min_grain ? pixel_grain : min_grain);
+}
+
+/** Runs a pass over all of pass->dst on the thread pool, in bands of whole rows.
+*
+ * @param  worker: the pass to run on a band.
+ * @param  pass: settings shared by every band.
+ * @param  min_grain: fewest rows worth a band.
+ * @return 0 on success, -1 if a worker ran out of memory.
+*/
+static int image_blur_run(Parallel_Body worker, struct Image_Blur_Pass* pass, int min_grain) {
+    int rows = pass->dst.height;
+    return parallelFor(rows, image_parallel_grain(rows, pass->dst.width, min_grain), worker, pass);
+}
+
+/** Runs one box blur pass over all of dst, split in bands of rows across the thread pool.
+ * A vertical band sums 2 * radius rows of halo before its first output row, its bands are
+ * kept at least that tall so the halo never costs more than the band.
+*
+ * @return 0 on success, -1 if a worker ran out of memory.
+*/
+static int image_box_blur_pass(Parallel_Body worker, const struct Image_View* src,
+                               const struct Image_View* dst, int radius) {
+    struct Image_Blur_Pass pass;
+    pass.src = *src;
+    pass.dst = *dst;
+    pass.radius = radius;
+    pass.reciprocal = (1ULL << 32) / (2 * radius + 1) + 1;
+    pass.amount = 0;
+    pass.threshold = 0;
+    if (worker == image_box_blur_columns && 2 * radius + 1 > IMAGE_PARALLEL_ROWS)
+        return image_blur_run(worker, &pass, 2 * radius + 1);
+    return image_blur_run(worker, &pass, IMAGE_PARALLEL_ROWS);
+}
+
+/** Blurs a view in place with a chain of box blurs, first along every row for each radius,
+ * then along every column for each radius. The passes go back and forth between the view
+ * and one scratch image, an even number of them ends back in the view.
+*
+ * @param  view: the pixels to blur.
+ * @param  radii: radius of each box blur, radii below 1 are skipped.
+ * @param  count: number of box blurs.
+ * @return 0 on success, -1 if the memory can not be allocated.
+*/
+static int image_box_blur_chain(const struct Image_View* view, const int* radii, int count) {
+    if (view->width < 1 || view->height < 1)
+        return 0;
+
+    Image* scratch = image_new(view->width, view->height);
+    if (scratch == NULL) {
+        return -1;
+    }
+    struct Image_View buffers[2];
+    buffers[0] = *view;
+    buffers[1] = image_get_view(scratch, 0, 0, view->width, view->height);
+
+    int current = 0, result = 0;
+    for (int direction = 0; direction < 2 && result == 0; direction++) {
+        for (int i = 0; i < count && result == 0; i++) {
+            int radius = radii[i] > IMAGE_BLUR_MAX_RADIUS ? IMAGE_BLUR_MAX_RADIUS : radii[i];
+            if (radius < 1)
+                continue;
+            result = image_box_blur_pass(direction == 0 ? image_box_blur_rows : image_box_blur_columns,
+                                         &buffers[current], &buffers[1 - current], radius);
+            current = 1 - current;
+        }
+    }
+
+    image_destroy(&scratch);
+    return result;
+}
+
+/** Apply box blur filter to a view of an image, in place.
+*   Output pixel is the average of the (2 * radius + 1) x (2 * radius + 1) square around it.
+*   Pixels outside the view are never read, edges repeat the closest pixel of the view.
+*   The square is summed as a row pass into a scratch image and a column pass back, each
+*   with a running sum, so the cost per pixel does not depend on the radius.
+*
+ * @param  view: the pixels to blur.
+ * @param  radius: pixels on each side of the center, 1 for a 3x3 blur, at most 2047.
+ * @return 0 on success, -1 if the memory can not be allocated.
+*/
+int image_box_blur(const struct Image_View* view, int radius) {
+    return image_box_blur_chain(view, &radius, 1);
+}
+
+/** Picks the radii of three box blurs that in a row come closest to a Gaussian of sigma:
+ * widths w and w + 2 around the ideal sqrt(4 * sigma^2 + 1), as many of each as make the
+ * variances add up to sigma^2.
+*
+ * @param  sigma: standard deviation of the Gaussian in pixels.
+ * @param  radii: set to the three radii, 0 where no blur is needed.
+*/
+static void image_gaussian_radii(double sigma, int radii[IMAGE_GAUSSIAN_BOXES]) {
+    int n = IMAGE_GAUSSIAN_BOXES;
+    double variance = sigma * sigma;
+    int lower = (int)sqrt(12 * variance / n + 1);
+    if (lower % 2 == 0)
+        lower--;
+    if (lower < 1)
+        lower = 1;
+    /* number of boxes of the lower width, the others are two pixels wider */
+    int m = (int)lround((12 * variance - n * lower * lower - 4 * n * lower - 3 * n) / (-4.0 * lower - 4));
+    for (int i = 0; i < n; i++) {
+        radii[i] = ((i < m ? lower : lower + 2) - 1) / 2;
+        if (radii[i] > IMAGE_BLUR_MAX_RADIUS)
+            radii[i] = IMAGE_BLUR_MAX_RADIUS;
+    }
+}
+
+/** Returns the radius of the sampled Gaussian for a small sigma, 3 sigma rounded up. */
+static int image_gaussian_kernel_radius(double sigma) {
+    int radius = (int)ceil(3 * sigma);
+    return radius > IMAGE_GAUSSIAN_KERNEL_RADIUS ? IMAGE_GAUSSIAN_KERNEL_RADIUS : radius;
+}
+
+/** Horizontal pass of the sampled Gaussian over rows [first, last). Columns outside the row
+ * repeat its first or last pixel.
+*/
+static int image_gaussian_kernel_rows(void* arg, int first, int last) {
+    struct Image_Blur_Pass* pass = (struct Image_Blur_Pass*)arg;
+    int radius = pass->radius;
+    int edge = pass->src.width - 1;
+    const int* weights = pass->weights + radius;
+
+    for (int i = first; i < last; i++) {
+        const unsigned char* in = (const unsigned char*)image_view_row(&pass->src, i);
+        unsigned char* out = (unsigned char*)image_view_row(&pass->dst, i);
+        for (int j = 0; j <= edge; j++) {
+            int sum[3] = {1 << (IMAGE_GAUSSIAN_SHIFT - 1), 1 << (IMAGE_GAUSSIAN_SHIFT - 1),
+                          1 << (IMAGE_GAUSSIAN_SHIFT - 1)};
+            if (j >= radius && j + radius <= edge) {
+                /* away from the ends no tap needs clamping */
+                const unsigned char* center = in + 3 * j;
+                for (int k = -radius; k <= radius; k++) {
+                    sum[0] += weights[k] * center[3 * k];
+                    sum[1] += weights[k] * center[3 * k + 1];
+                    sum[2] += weights[k] * center[3 * k + 2];
+                }
+            } else {
+                for (int k = -radius; k <= radius; k++) {
+                    int x = j + k < 0 ? 0 : (j + k > edge ? edge : j + k);
+                    sum[0] += weights[k] * in[3 * x];
+                    sum[1] += weights[k] * in[3 * x + 1];
+                    sum[2] += weights[k] * in[3 * x + 2];
+                }
+            }
+            out[3 * j] = (unsigned char)(sum[0] >> IMAGE_GAUSSIAN_SHIFT);
+            out[3 * j + 1] = (unsigned char)(sum[1] >> IMAGE_GAUSSIAN_SHIFT);
+            out[3 * j + 2] = (unsigned char)(sum[2] >> IMAGE_GAUSSIAN_SHIFT);
+        }
+    }
+    return 0;
+}
+
+/** Vertical pass of the sampled Gaussian over a band of rows [first, last) of dst, reading
+ * radius halo rows above and below the band from src. Rows outside the source repeat its
+ * first or last row.
+*/
+static int image_gaussian_kernel_columns(void* arg, int first, int last) {
+    struct Image_Blur_Pass* pass = (struct Image_Blur_Pass*)arg;
+    int radius = pass->radius;
+    int edge = pass->src.height - 1;
+    int channels = 3 * pass->src.width;
+
+    int* sum = (int*)malloc(sizeof(int) * channels);
+    if (sum == NULL) {
+        return -1;
+    }
+
+    /* one source row at a time into the sums, so the inner loop runs along the row */
+    for (int i = first; i < last; i++) {
+        for (int c = 0; c < channels; c++) {
+            sum[c] = 1 << (IMAGE_GAUSSIAN_SHIFT - 1);
+        }
+        for (int k = -radius; k <= radius; k++) {
+            int y = i + k < 0 ? 0 : (i + k > edge ? edge : i + k);
+            const unsigned char* in = (const unsigned char*)image_view_row(&pass->src, y);
+            int weight = pass->weights[k + radius];
+            for (int c = 0; c < channels; c++) {
+                sum[c] += weight * in[c];
+            }
+        }
+        unsigned char* out = (unsigned char*)image_view_row(&pass->dst, i);
+        for (int c = 0; c < channels; c++) {
+            out[c] = (unsigned char)(sum[c] >> IMAGE_GAUSSIAN_SHIFT);
+        }
+    }
+
+    free(sum);
+    return 0;
+}
+
+/** Blurs a view in place with the sampled Gaussian of a small sigma, a row pass into a
+ * scratch image and a column pass back. The weights add up to exactly 1.
+*
+ * @param  view: the pixels to blur.
+ * @param  sigma: standard deviation of the Gaussian in pixels, below IMAGE_GAUSSIAN_KERNEL_SIGMA.
+ * @return 0 on success, -1 if the memory can not be allocated.
+*/
+static int image_gaussian_kernel_blur(const struct Image_View* view, double sigma) {
+    int radius = image_gaussian_kernel_radius(sigma);
+    if (radius < 1 || view->width < 1 || view->height < 1)
+        return 0;
+
+    struct Image_Blur_Pass pass;
+    pass.radius = radius;
+    pass.reciprocal = 0;
+    pass.amount = 0;
+    pass.threshold = 0;
+
+    /* round each weight, then put what rounding lost or gained back on the center tap */
+    double samples[2 * IMAGE_GAUSSIAN_KERNEL_RADIUS + 1], total = 0;
+    for (int k = -radius; k <= radius; k++) {
+        samples[k + radius] = exp(-k * k / (2 * sigma * sigma));
+        total += samples[k + radius];
+    }
+    int remainder = 1 << IMAGE_GAUSSIAN_SHIFT;
+    for (int k = 0; k <= 2 * radius; k++) {
+        pass.weights[k] = (int)lround(samples[k] / total * (1 << IMAGE_GAUSSIAN_SHIFT));
+        remainder -= pass.weights[k];
+    }
+    pass.weights[radius] += remainder;
+
+    Image* scratch = image_new(view->width, view->height);
+    if (scratch == NULL) {
+        return -1;
+    }
+    struct Image_View rows = image_get_view(scratch, 0, 0, view->width, view->height);
+
+    pass.src = *view;
+    pass.dst = rows;
+    int result = image_blur_run(image_gaussian_kernel_rows, &pass, IMAGE_PARALLEL_ROWS);
+    if (result == 0) {
+        pass.src = rows;
+        pass.dst = *view;
+        result = image_blur_run(image_gaussian_kernel_columns, &pass, IMAGE_PARALLEL_ROWS);
+    }
+
+    image_destroy(&scratch);
+    return result;
+}
+
+/** Returns how many pixels on each side of a pixel image_gaussian_blur reads, the rows a
+ * band of a larger image needs above and below it.
+*
+ * @param  sigma: standard deviation of the Gaussian in pixels.
+*/
+int image_gaussian_reach(double sigma) {
+    int radii[IMAGE_GAUSSIAN_BOXES];
+    int reach = 0;
+    if (sigma < IMAGE_GAUSSIAN_KERNEL_SIGMA)
+        return image_gaussian_kernel_radius(sigma);
+    image_gaussian_radii(sigma, radii);
+    for (int i = 0; i < IMAGE_GAUSSIAN_BOXES; i++) {
+        reach += radii[i];
+    }
+    return reach;
+}
+
+/** Apply Gaussian blur filter to a view of an image, in place.
+*   The Gaussian is approximated by three box blurs in a row, each a running sum, so the cost
+*   per pixel does not depend on sigma. Sigmas below 2 use the sampled Gaussian, at most 13
+*   taps. Edges repeat the closest pixel of the view.
+*
+ * @param  view: the pixels to blur.
+ * @param  sigma: standard deviation of the Gaussian in pixels.
+ * @return 0 on success, -1 if the memory can not be allocated.
+*/
+int image_gaussian_blur(const struct Image_View* view, double sigma) {
+    int radii[IMAGE_GAUSSIAN_BOXES];
+    if (sigma < IMAGE_GAUSSIAN_KERNEL_SIGMA)
+        return image_gaussian_kernel_blur(view, sigma);
+    image_gaussian_radii(sigma, radii);
+    return image_box_blur_chain(view, radii, IMAGE_GAUSSIAN_BOXES);
+}
+
+/** Unsharp mask pass: pushes each channel of rows [first, last) of dst away from the
+ * blurred copy in src by amount times their difference.
+*/
+static int image_unsharp_rows(void* arg, int first, int last) {
+    struct Image_Blur_Pass* pass = (struct Image_Blur_Pass*)arg;
+    int channels = 3 * pass->dst.width;
+
+    for (int i = first; i < last; i++) {
+        const unsigned char* blurred = (const unsigned char*)image_view_row(&pass->src, i);
+        unsigned char* out = (unsigned char*)image_view_row(&pass->dst, i);
+        for (int c = 0; c < channels; c++) {
+            int difference = out[c] - blurred[c];
+            if (difference < pass->threshold && difference > -pass->threshold)
+                continue;
+            int value = out[c] + (difference * pass->amount + (difference < 0 ? -128 : 128)) / 256;
+            out[c] = value < 0 ? 0 : (value > 255 ? 255 : value);
+        }
+    }
+    return 0;
+}
+
+/** Apply unsharp mask filter to a view of an image, in place.
+*   Each channel moves away from a Gaussian blurred copy of the view by amount times its
+*   difference to it, which sharpens edges of about sigma pixels.
+*
+ * @param  view: the pixels to sharpen.
+ * @param  sigma: standard deviation of the Gaussian blur in pixels.
+ * @param  amount: strength, 1 adds the full difference once.
+ * @param  threshold: differences smaller than this are left alone, 0 sharpens everything.
+ * @return 0 on success, -1 if the memory can not be allocated.
+*/
+int image_unsharp_mask(const struct Image_View* view, double sigma, double amount, int threshold) {
+    if (view->width < 1 || view->height < 1)
+        return 0;
 
+    Image* blurred = image_new(view->width, view->height);
+    if (blurred == NULL) {
+        return -1;
+    }
+    struct Image_View copy = image_get_view(blurred, 0, 0, view->width, view->height);
+    for (int i = 0; i < view->height; i++) {
+        memcpy(image_view_row(&copy, i), image_view_row(view, i), sizeof(struct Pixel) * view->width);
+    }
+
+    int result = image_gaussian_blur(&copy, sigma);
+    if (result == 0) {
+        struct Image_Blur_Pass pass;
+        pass.src = copy;
+        pass.dst = *view;
+        pass.radius = 0;
+        pass.reciprocal = 0;
+        pass.amount = (int)lround(amount * 256);
+        pass.threshold = threshold;
+        result = image_blur_run(image_unsharp_rows, &pass, IMAGE_PARALLEL_ROWS);
+    }
+
+    image_destroy(&blurred);
+    return result;
+}
+
+/** Output tiles of image_convolve: 128 pixels by 32 rows, so a tile's rows of float sums
+ * and its halo stay in the second level cache while its kernel is applied.
+*/
+#define IMAGE_TILE_WIDTH  128
+#define IMAGE_TILE_HEIGHT 32
+
+/* Named kernels for image_kernel_named, weights row by row before dividing by divisor. */
+struct Image_Named_Kernel {
+    const char* name;
+    int size;
+    int weights[25];
+    int divisor;
+    int bias;
+    int absolute;
+};
+
+static const struct Image_Named_Kernel image_named_kernels[] = {
+    {"sharpen", 3, { 0, -1,  0,
+                    -1,  5, -1,
+                     0, -1,  0}, 1, 0, 0},
+    {"emboss", 3, {-2, -1,  0,
+                   -1,  1,  1,
+                    0,  1,  2}, 1, 0, 0},
+    {"sobel-x", 3, {-1,  0,  1,
+                    -2,  0,  2,
+                    -1,  0,  1}, 1, 0, 1},
+    {"sobel-y", 3, {-1, -2, -1,
+                     0,  0,  0,
+                     1,  2,  1}, 1, 0, 1},
+    {"scharr-x", 3, { -3,  0,  3,
+                     -10,  0, 10,
+                      -3,  0,  3}, 4, 0, 1},
+    {"scharr-y", 3, {-3, -10, -3,
+                      0,   0,  0,
+                      3,  10,  3}, 4, 0, 1},
+    {"laplacian", 3, {0,  1,  0,
+                      1, -4,  1,
+                      0,  1,  0}, 1, 0, 1},
+    {"edges", 3, {-1, -1, -1,
+                  -1,  8, -1,
+                  -1, -1, -1}, 1, 0, 1},
+    {"gaussian5", 5, {1,  4,  6,  4, 1,
+                      4, 16, 24, 16, 4,
+                      6, 24, 36, 24, 6,
+                      4, 16, 24, 16, 4,
+                      1,  4,  6,  4, 1}, 256, 0, 0},
+    {"box5", 5, {1, 1, 1, 1, 1,
+                 1, 1, 1, 1, 1,
+                 1, 1, 1, 1, 1,
+                 1, 1, 1, 1, 1,
+                 1, 1, 1, 1, 1}, 25, 0, 0},
+};
+
+/** Fills a kernel from its weights.
+*
+ * @param  kernel: the kernel to fill.
+ * @param  size: side of the kernel, odd and at most IMAGE_KERNEL_MAX.
+ * @param  weights: size x size weights, row by row.
+ * @param  bias: added to every result.
+ * @param  absolute: 1 to keep the magnitude of negative results, for edge detection.
+ * @return 0 on success, -1 if the size is not supported.
+*/
+int image_kernel_init(struct Image_Kernel* kernel, int size, const float* weights, float bias, int absolute) {
+    if (size < 1 || size > IMAGE_KERNEL_MAX || size % 2 == 0)
+        return -1;
+    kernel->size = size;
+    for (int i = 0; i < size * size; i++) {
+        kernel->weights[i] = weights[i];
+    }
+    kernel->bias = bias;
+    kernel->absolute = absolute;
+    return 0;
+}
+
+/** Fills a kernel with one of the built in kernels: sharpen, emboss, sobel-x, sobel-y,
+ * scharr-x, scharr-y, laplacian, edges, gaussian5, box5.
+*
+ * @param  kernel: the kernel to fill.
+ * @param  name: name of the kernel.
+ * @return 0 on success, -1 if there is no kernel of that name.
+*/
+int image_kernel_named(struct Image_Kernel* kernel, const char* name) {
+    for (size_t k = 0; k < sizeof(image_named_kernels) / sizeof(image_named_kernels[0]); k++) {
+        const struct Image_Named_Kernel* named = &image_named_kernels[k];
+        if (strcmp(named->name, name) != 0)
+            continue;
+        float weights[25];
+        for (int i = 0; i < named->size * named->size; i++) {
+            weights[i] = (float)named->weights[i] / named->divisor;
         }
+        return image_kernel_init(kernel, named->size, weights, (float)named->bias, named->absolute);
     }
+    return -1;
+}
+
+/** Splits a kernel into a column and a row vector whose product is the kernel, if it has
+ * rank 1. Sobel, Scharr, box and Gaussian kernels do.
+*
+ * @param  kernel: the kernel.
+ * @param  column: set to the weights down a column.
+ * @param  row: set to the weights along a row.
+ * @return 1 if the kernel was split, 0 if it is not the product of two vectors.
+*/
+static int image_kernel_split(const struct Image_Kernel* kernel, float* column, float* row) {
+    int n = kernel->size;
+    const float* k = kernel->weights;
+
+    /* the largest weight fixes the scale of both vectors */
+    int pivot = 0;
+    for (int i = 1; i < n * n; i++) {
+        if (fabsf(k[i]) > fabsf(k[pivot]))
+            pivot = i;
+    }
+    if (k[pivot] == 0)
+        return 0;
+    int pivot_row = pivot / n, pivot_column = pivot % n;
+    for (int i = 0; i < n; i++) {
+        column[i] = k[i * n + pivot_column];
+        row[i] = k[pivot_row * n + i] / k[pivot];
+    }
+
+    float tolerance = fabsf(k[pivot]) * 1e-5f;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            if (fabsf(column[i] * row[j] - k[i * n + j]) > tolerance)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* sums[c] += weight * in[c] for count channels, from bytes or from floats */
+static void image_convolve_bytes_scalar(float* sums, const unsigned char* in, float weight, int count) {
+    for (int c = 0; c < count; c++) {
+        sums[c] += weight * in[c];
+    }
+}
+
+static void image_convolve_floats_scalar(float* sums, const float* in, float weight, int count) {
+    for (int c = 0; c < count; c++) {
+        sums[c] += weight * in[c];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* 16 channels a step: bytes widened to 32-bit lanes, then converted to floats. */
+__attribute__((target("sse2")))
+static void image_convolve_bytes_sse2(float* sums, const unsigned char* in, float weight, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 w = _mm_set1_ps(weight);
+    int c = 0;
+    for (; c + 16 <= count; c += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(in + c));
+        __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+        __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+        __m128 f0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+        __m128 f1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+        __m128 f2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+        __m128 f3 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+        _mm_storeu_ps(sums + c, _mm_add_ps(_mm_loadu_ps(sums + c), _mm_mul_ps(w, f0)));
+        _mm_storeu_ps(sums + c + 4, _mm_add_ps(_mm_loadu_ps(sums + c + 4), _mm_mul_ps(w, f1)));
+        _mm_storeu_ps(sums + c + 8, _mm_add_ps(_mm_loadu_ps(sums + c + 8), _mm_mul_ps(w, f2)));
+        _mm_storeu_ps(sums + c + 12, _mm_add_ps(_mm_loadu_ps(sums + c + 12), _mm_mul_ps(w, f3)));
+    }
+    image_convolve_bytes_scalar(sums + c, in + c, weight, count - c);
+}
+
+__attribute__((target("sse2")))
+static void image_convolve_floats_sse2(float* sums, const float* in, float weight, int count) {
+    const __m128 w = _mm_set1_ps(weight);
+    int c = 0;
+    for (; c + 4 <= count; c += 4) {
+        _mm_storeu_ps(sums + c, _mm_add_ps(_mm_loadu_ps(sums + c), _mm_mul_ps(w, _mm_loadu_ps(in + c))));
+    }
+    image_convolve_floats_scalar(sums + c, in + c, weight, count - c);
+}
+
+/* 16 channels a step, each half of 8 bytes widened straight to 8 x 32-bit lanes. */
+__attribute__((target("avx2")))
+static void image_convolve_bytes_avx2(float* sums, const unsigned char* in, float weight, int count) {
+    const __m256 w = _mm256_set1_ps(weight);
+    int c = 0;
+    for (; c + 16 <= count; c += 16) {
+        __m256 f0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in + c))));
+        __m256 f1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in + c + 8))));
+        _mm256_storeu_ps(sums + c, _mm256_add_ps(_mm256_loadu_ps(sums + c), _mm256_mul_ps(w, f0)));
+        _mm256_storeu_ps(sums + c + 8, _mm256_add_ps(_mm256_loadu_ps(sums + c + 8), _mm256_mul_ps(w, f1)));
+    }
+    image_convolve_bytes_scalar(sums + c, in + c, weight, count - c);
+}
+
+__attribute__((target("avx2")))
+static void image_convolve_floats_avx2(float* sums, const float* in, float weight, int count) {
+    const __m256 w = _mm256_set1_ps(weight);
+    int c = 0;
+    for (; c + 8 <= count; c += 8) {
+        _mm256_storeu_ps(sums + c, _mm256_add_ps(_mm256_loadu_ps(sums + c),
+                                                 _mm256_mul_ps(w, _mm256_loadu_ps(in + c))));
+    }
+    image_convolve_floats_scalar(sums + c, in + c, weight, count - c);
+}
+#endif
+
+/* Kernels picked once for this CPU, the scalar ones until then. */
+static void (*image_convolve_bytes)(float*, const unsigned char*, float, int) = image_convolve_bytes_scalar;
+static void (*image_convolve_floats)(float*, const float*, float, int) = image_convolve_floats_scalar;
+static pthread_once_t image_convolve_once = PTHREAD_ONCE_INIT;
+
+/* Picks the widest kernels the CPU supports. */
+static void image_convolve_select(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        image_convolve_bytes = image_convolve_bytes_sse2;
+        image_convolve_floats = image_convolve_floats_sse2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        image_convolve_bytes = image_convolve_bytes_avx2;
+        image_convolve_floats = image_convolve_floats_avx2;
+    }
+#endif
+}
+
+/* A convolution in progress, shared by the threads working on it. Tiles are numbered row by row. */
+struct Image_Convolution {
+    const struct Image_Kernel* kernel;
+    int separable;
+    const float* column;            /* weights down a column when separable */
+    const float* row;               /* weights along a row when separable */
+    Image* source;                  /* copy of the view, radius columns of repeated edge on each side */
+    struct Image_View dst;
+    int tiles_across;
+};
+
+/* Rounds the sums of one row of a tile into pixels. */
+static void image_convolve_store(unsigned char* out, const float* sums, int count, float bias, int absolute) {
+    for (int c = 0; c < count; c++) {
+        float value = sums[c] + bias;
+        if (absolute && value < 0)
+            value = -value;
+        out[c] = value <= 0 ? 0 : (value >= 255 ? 255 : (unsigned char)(value + 0.5f));
+    }
+}
+
+/** Convolves tiles [first, last) of the view. A separable kernel runs along the rows of the tile and
+ * its halo rows into float sums, then down the columns of those sums; any other kernel adds
+ * up all its weights straight from the source.
+*/
+static int image_convolve_tiles(void* arg, int first, int last) {
+    struct Image_Convolution* work = (struct Image_Convolution*)arg;
+    const struct Image_Kernel* kernel = work->kernel;
+    int size = kernel->size, radius = size / 2;
+    int last_row = work->dst.height - 1;
+    int channels = 3 * IMAGE_TILE_WIDTH;
+
+    /* one row of sums, and for a separable kernel the row pass of the tile and its halo */
+    float* sums = (float*)malloc(sizeof(float) * channels * (1 + (IMAGE_TILE_HEIGHT + 2 * radius)));
+    if (sums == NULL) {
+        return -1;
+    }
+    float* rows = sums + channels;
+
+    for (int tile = first; tile < last; tile++) {
+        int x0 = (tile % work->tiles_across) * IMAGE_TILE_WIDTH;
+        int y0 = (tile / work->tiles_across) * IMAGE_TILE_HEIGHT;
+        int width = work->dst.width - x0 < IMAGE_TILE_WIDTH ? work->dst.width - x0 : IMAGE_TILE_WIDTH;
+        int height = work->dst.height - y0 < IMAGE_TILE_HEIGHT ? work->dst.height - y0 : IMAGE_TILE_HEIGHT;
+        int count = 3 * width;
+
+        if (work->separable) {
+            for (int i = -radius; i < height + radius; i++) {
+                int y = y0 + i < 0 ? 0 : (y0 + i > last_row ? last_row : y0 + i);
+                const unsigned char* in = (const unsigned char*)work->source->pArr[y] + 3 * x0;
+                float* out = rows + channels * (i + radius);
+                memset(out, 0, sizeof(float) * count);
+                for (int k = 0; k < size; k++) {
+                    if (work->row[k] != 0)
+                        image_convolve_bytes(out, in + 3 * k, work->row[k], count);
+                }
+            }
+            for (int i = 0; i < height; i++) {
+                memset(sums, 0, sizeof(float) * count);
+                for (int k = 0; k < size; k++) {
+                    if (work->column[k] != 0)
+                        image_convolve_floats(sums, rows + channels * (i + k), work->column[k], count);
+                }
+                image_convolve_store((unsigned char*)image_view_row(&work->dst, y0 + i) + 3 * x0,
+                                     sums, count, kernel->bias, kernel->absolute);
+            }
+        } else {
+            for (int i = 0; i < height; i++) {
+                memset(sums, 0, sizeof(float) * count);
+                for (int ky = 0; ky < size; ky++) {
+                    int y = y0 + i + ky - radius;
+                    y = y < 0 ? 0 : (y > last_row ? last_row : y);
+                    const unsigned char* in = (const unsigned char*)work->source->pArr[y] + 3 * x0;
+                    for (int kx = 0; kx < size; kx++) {
+                        float weight = kernel->weights[ky * size + kx];
+                        if (weight != 0)
+                            image_convolve_bytes(sums, in + 3 * kx, weight, count);
+                    }
+                }
+                image_convolve_store((unsigned char*)image_view_row(&work->dst, y0 + i) + 3 * x0,
+                                     sums, count, kernel->bias, kernel->absolute);
+            }
+        }
+    }
+
+    free(sums);
+    return 0;
+}
+
+/** Convolve a view of an image with a kernel, in place.
+*   Each output pixel is the sum of the kernel's weights times the pixels under it, plus the
+*   bias, rounded and clamped to 0..255. Pixels outside the view repeat the closest pixel of
+*   the view. Kernels that are the product of a column and a row are applied as two 1-D
+*   passes. The view is cut into cache sized tiles that are shared out across the thread pool.
+*
+ * @param  view: the pixels to filter.
+ * @param  kernel: the kernel, see image_kernel_named and image_kernel_init.
+ * @return 0 on success, -1 if the memory can not be allocated.
+*/
+int image_convolve(const struct Image_View* view, const struct Image_Kernel* kernel) {
+    if (view->width < 1 || view->height < 1)
+        return 0;
+    pthread_once(&image_convolve_once, image_convolve_select);
+
+    int radius = kernel->size / 2;
+    float column[IMAGE_KERNEL_MAX], row[IMAGE_KERNEL_MAX];
+    int separable = image_kernel_split(kernel, column, row);
+
+    /* the tiles read the original pixels from a copy, padded so no column needs clamping */
+    Image* source = image_new(view->width + 2 * radius, view->height);
+    if (source == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < view->height; i++) {
+        const struct Pixel* in = image_view_row(view, i);
+        struct Pixel* out = source->pArr[i];
+        memcpy(out + radius, in, sizeof(struct Pixel) * view->width);
+        for (int j = 0; j < radius; j++) {
+            out[j] = in[0];
+            out[radius + view->width + j] = in[view->width - 1];
+        }
+    }
+
+    int tiles_across = (view->width + IMAGE_TILE_WIDTH - 1) / IMAGE_TILE_WIDTH;
+    int tiles = tiles_across * ((view->height + IMAGE_TILE_HEIGHT - 1) / IMAGE_TILE_HEIGHT);
+    struct Image_Convolution work;
+    work.kernel = kernel;
+    work.separable = separable;
+    work.column = column;
+    work.row = row;
+    work.source = source;
+    work.dst = *view;
+    work.tiles_across = tiles_across;
+    int result = parallelFor(tiles, image_parallel_grain(tiles, IMAGE_TILE_WIDTH * IMAGE_TILE_HEIGHT, 1),
+                             image_convolve_tiles, &work);
+
+    image_destroy(&source);
+    return result;
 }
 
 /** Apply Swiss Cheese filter to image.
 *   Tint the image (at the pixel level) towards being slightly yellow.
 *
- * @param  img: the image.
- * @param  thread_height: height of image.
- * @param  thread_width: width of image.
+ * @param  thread_args: the view of the image to tint, in a struct thread_args.
 */
 void* image_apply_swiss_cheese_filter(void* thread_args) {
-    int height = ((struct thread_args*)thread_args)->thread_height;
-    int width = ((struct thread_args*)thread_args)->thread_width;
+    struct Image_View* view = &((struct thread_args*)thread_args)->view;
     /* color shift image to slightly yellow */
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            int afterShift = ((struct thread_args*)thread_args)->pArr[i][j].blue - 100;
+    for (int i = 0; i < view->height; i++) {
+        struct Pixel* row = image_view_row(view, i);
+        for (int j = 0; j < view->width; j++) {
+            int afterShift = row[j].blue - 100;
             if (afterShift < 0) {
-                ((struct thread_args*)thread_args)->pArr[i][j].blue = 0;
+                row[j].blue = 0;
             } else {
-                ((struct thread_args*)thread_args)->pArr[i][j].blue = afterShift;
+                row[j].blue = afterShift;
             }
         }
     }
+    return NULL;
 }
 
 /** equation of a circle: (x - a)^2 + (y - b)^2 = r^2
  * a & b are the center point coordinates
  * All x & y points that satisfy this equation are part of the circle
  * */
-/* logic for adding holes as circles of black pixels */
-void image_apply_holes(Image* img, int average_radius_holes) {
+/* logic for adding holes as circles of black pixels, -1 if the holes can not be allocated */
+int image_apply_holes(Image* img, int average_radius_holes) {
+    struct Hole* holes;
+    int number_of_holes = image_make_holes(img->width, img->height, average_radius_holes, &holes);
+    if (number_of_holes < 0) {
+        return -1;
+    }
+
+    image_draw_holes(img, 0, holes, number_of_holes);
+    free(holes);
+    return 0;
+}
+
+/** Pick the random center points and radius of the swiss cheese holes.
+*   The holes are picked up front so the same set can be drawn band by band.
+*
+ * @param  width: width of the whole image.
+ * @param  height: height of the whole image.
+ * @param  average_radius_holes: the average radius and the number of holes.
+ * @param  holes: receives the malloc'd array of holes, free it when done.
+ * @return the number of holes in the array, -1 if it can not be allocated.
+*/
+int image_make_holes(int width, int height, int average_radius_holes, struct Hole** holes) {
     /* initialize random number generator */
     time_t t;
     srand((unsigned) time(&t));
@@ -167,37 +1165,112 @@ void image_apply_holes(Image* img, int average_radius_holes) {
     int number_of_small_sized_holes = average_radius_holes * 0.25;
     int number_of_large_sized_holes = average_radius_holes * 0.25;
 
-    /* evenly distribute center point among number of threads */
-//    int number_of_holes_per_thread = 0;
-//    if (THREAD_COUNT > number_of_average_sized_holes) {
-//        number_of_average_sized_holes = 1; /* if too much thread each gets one holes to compute */
-//    } else {
-//        number_of_holes_per_thread = average_radius_holes / THREAD_COUNT;
-//    }
+    int count = 0;
+    *holes = (struct Hole*)malloc(sizeof(struct Hole) *
+            (number_of_average_sized_holes + number_of_small_sized_holes + number_of_large_sized_holes + 1));
+    if (*holes == NULL) {
+        return -1;
+    }
 
-    for (int i = 0; i < number_of_average_sized_holes; i++)
-        compute_holes(img, rand() % img->width, rand() % img->height, average_radius);
-    for (int j = 0; j < number_of_small_sized_holes; j++)
-        compute_holes(img, rand() % img->width, rand() % img->height, small_radius);
-    for (int k = 0; k < number_of_large_sized_holes; k++)
-        compute_holes(img, rand() % img->width, rand() % img->height, large_radius);
+    for (int i = 0; i < number_of_average_sized_holes; i++, count++) {
+        (*holes)[count].x = rand() % width;
+        (*holes)[count].y = rand() % height;
+        (*holes)[count].r = average_radius;
+    }
+    for (int j = 0; j < number_of_small_sized_holes; j++, count++) {
+        (*holes)[count].x = rand() % width;
+        (*holes)[count].y = rand() % height;
+        (*holes)[count].r = small_radius;
+    }
+    for (int k = 0; k < number_of_large_sized_holes; k++, count++) {
+        (*holes)[count].x = rand() % width;
+        (*holes)[count].y = rand() % height;
+        (*holes)[count].r = large_radius;
+    }
 
+    return count;
 }
 
-void compute_holes (Image* img, int x, int y, int r) {
-    /* logic for adding holes as circles of black pixels */
-    int center_x = x, center_y = y;   /* center point of circle */
-    int radius = r;                     /* circle radius */
-    int radius_squared = radius * radius;
-    for (int i = 0; i < img->height; i++) {
-        for (int j = 0; j < img->width; j++) {
-            int calculate_circle = ((j - center_x) * (j - center_x)) + ((i - center_y) * (i - center_y));
-            if (calculate_circle <=  radius_squared) { /* <= means include the points that lie inside the circle */
-                img->pArr[i][j].red = 0;
-                img->pArr[i][j].green = 0;
-                img->pArr[i][j].blue = 0;
-            }
+/* Holes being drawn, shared by the threads drawing them a chunk of rows each. */
+struct Image_Hole_Band {
+    Image* img;
+    int y_offset;
+    const struct Hole* holes;
+    int number_of_holes;
+};
+
+/** Fill the rows [first, last) of a circle with black, one horizontal span per row.
+*   The span of a row dy away from the center reaches the largest dx with dx^2 + dy^2 <= r^2.
+*
+ * @param  img: the image to draw on.
+ * @param  x: center point column.
+ * @param  y: center point row, in rows of img.
+ * @param  r: radius.
+ * @param  first: first row of img to draw on.
+ * @param  last: row after the last row of img to draw on.
+*/
+static void image_fill_hole_rows(Image* img, int x, int y, int r, int first, int last) {
+    if (r < 0 || x + r < 0 || x - r >= img->width)
+        return;
+    if (first < y - r)
+        first = y - r;
+    if (last > y + r + 1)
+        last = y + r + 1;
+
+    for (int i = first; i < last; i++) {
+        long long reach = (long long)r * r - (long long)(i - y) * (i - y);
+        long long half = (long long)sqrt((double)reach);
+        while (half * half > reach)     /* sqrt of a double can be off by one either way */
+            half--;
+        while ((half + 1) * (half + 1) <= reach)
+            half++;
+
+        long long left = x - half < 0 ? 0 : x - half;
+        long long right = x + half >= img->width ? img->width - 1 : x + half;
+        if (left <= right) {
+            memset(&img->pArr[i][left], 0, sizeof(struct Pixel) * (size_t)(right - left + 1));
         }
     }
 }
 
+/* Draws the part of every hole that reaches into rows [first, last). */
+static int image_draw_hole_band(void* arg, int first, int last) {
+    struct Image_Hole_Band* band = (struct Image_Hole_Band*)arg;
+    for (int i = 0; i < band->number_of_holes; i++) {
+        const struct Hole* hole = &band->holes[i];
+        image_fill_hole_rows(band->img, hole->x, hole->y - band->y_offset, hole->r, first, last);
+    }
+    return 0;
+}
+
+/** Draw swiss cheese holes onto an image or onto a band of rows of a larger image.
+*   Each hole only visits the rows of its bounding box and fills one span per row. The rows
+*   are split in chunks across the thread pool, every thread draws the parts of the holes in
+*   its chunk, so no two threads write the same pixel.
+*
+ * @param  img: the image or band to draw on.
+ * @param  y_offset: row of the larger image that row 0 of img corresponds to.
+ * @param  holes: the holes, in coordinates of the larger image.
+ * @param  number_of_holes: the number of holes.
+*/
+void image_draw_holes(Image* img, int y_offset, const struct Hole* holes, int number_of_holes) {
+    struct Image_Hole_Band band;
+    band.img = img;
+    band.y_offset = y_offset;
+    band.holes = holes;
+    band.number_of_holes = number_of_holes;
+    /* holes cluster, small chunks keep every thread busy */
+    parallelFor(img->height, image_parallel_grain(img->height, img->width, IMAGE_PARALLEL_ROWS),
+                image_draw_hole_band, &band);
+}
+
+/** Draw one swiss cheese hole onto an image.
+*
+ * @param  img: the image to draw on.
+ * @param  x: center point column.
+ * @param  y: center point row.
+ * @param  r: radius.
+*/
+void compute_holes (Image* img, int x, int y, int r) {
+    image_fill_hole_rows(img, x, y, r, 0, img->height);
+}
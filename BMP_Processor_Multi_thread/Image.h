@@ -2,9 +2,15 @@
 * Header file for the image ADT.
 *
 * @author Sheldon Pang
-* @version 1.1
+* @version 1.7
  * 1.1 update notes: Added box blur filter, "void  image_apply_blur_filter(Image* img)"
  *                   Added structure for thread infos
+ * 1.2 update notes: Box blur of any radius, "int image_box_blur(const struct Image_View* view, int radius)"
+ * 1.3 update notes: Gaussian blur and unsharp mask built on stacked box blurs
+ * 1.4 update notes: Convolution engine with named kernels
+ * 1.5 update notes: Filters split their work over the shared thread pool
+ * 1.6 update notes: Any image size splits over any thread count, "int image_parallel_grain(int extent, int span, int min_grain)"
+ * 1.7 update notes: Blur passes split in bands of rows that read halo rows from a separate source
 */
 
 #ifndef BMP_PROCESSOR_MULTI_THREAD_IMAGE_H
@@ -19,6 +25,9 @@ struct Image {
     struct Pixel** pArr;
     int width;
     int height;
+    unsigned char* data;    /* row pointers and rows in one pooled 64-byte aligned block, NULL if pArr is borrowed */
+    size_t data_size;       /* bytes allocated for data */
+    size_t stride;          /* bytes from the start of one row to the next in data */
 };
 
 struct Pixel{
@@ -27,10 +36,35 @@ struct Pixel{
     unsigned char blue;
 };
 
+struct Hole {
+    int x;      /* center point column */
+    int y;      /* center point row */
+    int r;      /* radius */
+};
+
+/* A rectangle of an image's pixels that shares the image's memory, for cropping and tiling
+ * without copies. Only valid while the image is alive and holds packed RGB pixels.
+*/
+struct Image_View {
+    struct Pixel* origin;   /* top-left pixel of the view, row 0 */
+    int width;
+    int height;
+    size_t stride;          /* bytes from the start of one row to the next */
+};
+
+#define IMAGE_GAUSSIAN_BOXES 3   /* box blurs image_gaussian_blur stacks */
+#define IMAGE_KERNEL_MAX     15  /* largest side of a convolution kernel */
+
+/* A square convolution kernel for image_convolve. */
+struct Image_Kernel {
+    int size;                                           /* odd side of the kernel */
+    float weights[IMAGE_KERNEL_MAX * IMAGE_KERNEL_MAX]; /* size x size weights, row by row */
+    float bias;                                         /* added to every result */
+    int absolute;                                       /* 1 to keep the magnitude of negative results */
+};
+
 struct thread_args {
-    int thread_height;
-    int thread_width;
-    struct Pixel** pArr;
+    struct Image_View view;     /* part of the shared image this thread filters in place */
 };
 
 /** Creates a new image and returns it.
@@ -42,13 +76,30 @@ struct thread_args {
 */
 Image* image_create(struct Pixel** pArr, int width, int height);
 
+/** Creates a new image that owns its pixels. All rows live in one 64-byte aligned
+ * allocation, each row starts on a 64-byte boundary, stride bytes after the previous one.
+ * The pixels are not initialised.
+*
+ * @param  width: Width of this image.
+ * @param  height: Height of this image.
+ * @return A pointer to a new image, NULL if the memory can not be allocated.
+*/
+Image* image_new(int width, int height);
+
 
-/** Destroys an image. Does not deallocate internal pixel array.
+/** Destroys an image. Pixels the image owns (image_new) go back to the buffer pool,
+ * the pixel array given to image_create is not deallocated.
 *
  * @param  img: the image to destroy.
 */
 void image_destroy(Image** img);
 
+/** Frees every pixel buffer the pool keeps for reuse. Destroyed images hand their buffers
+ * to the pool so the next image of a similar size needs no allocation; call this once the
+ * last image is done.
+*/
+void image_pool_release(void);
+
 /** Returns a double pointer to the pixel array.
 *
  * @param  img: the image.
@@ -67,24 +118,172 @@ int image_get_width(Image* img);
 */
 int image_get_height(Image* img);
 
-/** Apply box blur filter to image.
-*   Output pixel is computed as the average of itself and each of its neighbors
+/** Returns a pointer to the first pixel of a row.
+*
+ * @param  img: the image.
+ * @param  row: index of the row.
+*/
+struct Pixel* image_get_row(Image* img, int row);
+
+/** Returns the number of bytes from the start of one row to the next,
+ * 0 if the rows were given to image_create and are not evenly spaced.
+*
+ * @param  img: the image.
+*/
+size_t image_get_stride(Image* img);
+
+/** Returns a view of a rectangle of an image. The image must own its pixels (image_new)
+ * and the rectangle must lie inside it.
 *
  * @param  img: the image.
- * @param  thread_count: the total number of thread.
- * @param  thread_id: the id of the thread
+ * @param  x: first column of the rectangle.
+ * @param  y: first row of the rectangle.
+ * @param  width: width of the rectangle.
+ * @param  height: height of the rectangle.
+*/
+struct Image_View image_get_view(Image* img, int x, int y, int width, int height);
+
+/** Returns a view of a rectangle of another view, which must lie inside it.
+*
+ * @param  view: the view.
+ * @param  x: first column of the rectangle.
+ * @param  y: first row of the rectangle.
+ * @param  width: width of the rectangle.
+ * @param  height: height of the rectangle.
+*/
+struct Image_View image_view_sub(const struct Image_View* view, int x, int y, int width, int height);
+
+/** Returns a pointer to the first pixel of a row of a view.
+*
+ * @param  view: the view.
+ * @param  row: index of the row.
+*/
+struct Pixel* image_view_row(const struct Image_View* view, int row);
+
+/** Returns how many rows or columns to hand a thread at once so the pool gets eight chunks per
+ * thread, none smaller than min_grain rows or columns or 32768 pixels. Images too small to
+ * fill two such chunks are filtered on the calling thread alone, the last chunk takes the
+ * remainder however the extent divides.
+*
+ * @param  extent: number of rows or columns to split.
+ * @param  span: pixels in each row or column.
+ * @param  min_grain: fewest rows or columns worth a chunk.
+ * @return rows or columns per chunk, at least 1.
+*/
+int image_parallel_grain(int extent, int span, int min_grain);
+
+/** Apply box blur filter to a view of an image, in place.
+*   Output pixel is the average of the (2 * radius + 1) x (2 * radius + 1) square around it.
+*   Pixels outside the view are never read, edges repeat the closest pixel of the view.
+*   The square is summed as a row pass into a scratch image and a column pass back, each
+*   with a running sum, so the cost per pixel does not depend on the radius.
+*
+ * @param  view: the pixels to blur.
+ * @param  radius: pixels on each side of the center, 1 for a 3x3 blur, at most 2047.
+ * @return 0 on success, -1 if the memory can not be allocated.
+*/
+int image_box_blur(const struct Image_View* view, int radius);
+
+/** Apply Gaussian blur filter to a view of an image, in place.
+*   The Gaussian is approximated by three box blurs in a row, each a running sum, so the cost
+*   per pixel does not depend on sigma. Sigmas below 2 use the sampled Gaussian, at most 13
+*   taps. Edges repeat the closest pixel of the view.
+*
+ * @param  view: the pixels to blur.
+ * @param  sigma: standard deviation of the Gaussian in pixels.
+ * @return 0 on success, -1 if the memory can not be allocated.
+*/
+int image_gaussian_blur(const struct Image_View* view, double sigma);
+
+/** Returns how many pixels on each side of a pixel image_gaussian_blur reads, the rows a
+ * band of a larger image needs above and below it.
+*
+ * @param  sigma: standard deviation of the Gaussian in pixels.
+*/
+int image_gaussian_reach(double sigma);
+
+/** Apply unsharp mask filter to a view of an image, in place.
+*   Each channel moves away from a Gaussian blurred copy of the view by amount times its
+*   difference to it, which sharpens edges of about sigma pixels.
+*
+ * @param  view: the pixels to sharpen.
+ * @param  sigma: standard deviation of the Gaussian blur in pixels.
+ * @param  amount: strength, 1 adds the full difference once.
+ * @param  threshold: differences smaller than this are left alone, 0 sharpens everything.
+ * @return 0 on success, -1 if the memory can not be allocated.
+*/
+int image_unsharp_mask(const struct Image_View* view, double sigma, double amount, int threshold);
+
+/** Fills a kernel from its weights.
+*
+ * @param  kernel: the kernel to fill.
+ * @param  size: side of the kernel, odd and at most IMAGE_KERNEL_MAX.
+ * @param  weights: size x size weights, row by row.
+ * @param  bias: added to every result.
+ * @param  absolute: 1 to keep the magnitude of negative results, for edge detection.
+ * @return 0 on success, -1 if the size is not supported.
 */
-void*  image_apply_blur_filter(void* arguments);
+int image_kernel_init(struct Image_Kernel* kernel, int size, const float* weights, float bias, int absolute);
+
+/** Fills a kernel with one of the built in kernels: sharpen, emboss, sobel-x, sobel-y,
+ * scharr-x, scharr-y, laplacian, edges, gaussian5, box5.
+*
+ * @param  kernel: the kernel to fill.
+ * @param  name: name of the kernel.
+ * @return 0 on success, -1 if there is no kernel of that name.
+*/
+int image_kernel_named(struct Image_Kernel* kernel, const char* name);
+
+/** Convolve a view of an image with a kernel, in place.
+*   Each output pixel is the sum of the kernel's weights times the pixels under it, plus the
+*   bias, rounded and clamped to 0..255. Pixels outside the view repeat the closest pixel of
+*   the view. Kernels that are the product of a column and a row are applied as two 1-D
+*   passes. The view is cut into cache sized tiles that are shared out across the thread pool.
+*
+ * @param  view: the pixels to filter.
+ * @param  kernel: the kernel, see image_kernel_named and image_kernel_init.
+ * @return 0 on success, -1 if the memory can not be allocated.
+*/
+int image_convolve(const struct Image_View* view, const struct Image_Kernel* kernel);
 
 /** Apply Swiss Cheese filter to image.
 *   Tint the image (at the pixel level) towards being slightly yellow.
 *
- * @param  img: the image.
- * @param  thread_count: the total number of thread.
- * @param  thread_id: the id of the thread
+ * @param  thread_args: the view of the image to tint, in a struct thread_args.
 */
 void* image_apply_swiss_cheese_filter(void* thread_args);
-void image_apply_holes(Image* img, int average_radius_holes);
+int image_apply_holes(Image* img, int average_radius_holes);
+
+/** Pick the random center points and radius of the swiss cheese holes.
+*   The holes are picked up front so the same set can be drawn band by band.
+*
+ * @param  width: width of the whole image.
+ * @param  height: height of the whole image.
+ * @param  average_radius_holes: the average radius and the number of holes.
+ * @param  holes: receives the malloc'd array of holes, free it when done.
+ * @return the number of holes in the array, -1 if it can not be allocated.
+*/
+int image_make_holes(int width, int height, int average_radius_holes, struct Hole** holes);
+
+/** Draw swiss cheese holes onto an image or onto a band of rows of a larger image.
+*   Each hole only visits the rows of its bounding box and fills one span per row. The rows
+*   are split in chunks across the thread pool, every thread draws the parts of the holes in
+*   its chunk, so no two threads write the same pixel.
+*
+ * @param  img: the image or band to draw on.
+ * @param  y_offset: row of the larger image that row 0 of img corresponds to.
+ * @param  holes: the holes, in coordinates of the larger image.
+ * @param  number_of_holes: the number of holes.
+*/
+void image_draw_holes(Image* img, int y_offset, const struct Hole* holes, int number_of_holes);
+
+/** Draw one swiss cheese hole onto an image.
+*
+ * @param  img: the image to draw on.
+ * @param  x: center point column.
+ * @param  y: center point row.
+ * @param  r: radius.
+*/
 void compute_holes (Image* img, int x, int y, int r);
 
 #endif //BMP_PROCESSOR_MULTI_THREAD_IMAGE_H
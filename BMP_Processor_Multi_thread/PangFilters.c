@@ -2,58 +2,131 @@
 * (multi thread BMP processing with box blur and cheese filter)
 *
 * @author Sheldon Pang
-* @version 1.0
+* @version 1.2
+ * 1.1 update notes: -j picks the number of threads, any image width works
+ * 1.2 update notes: threads steal rows and tiles from each other, -T prints each thread's busy time
  *
  * Note: command to compile in gcc
- * 'gcc -c Image.c BMPHandler.c -lm -pthread'
- * 'gcc PangFilters.c Image.o BMPHandler.o -o PangFilters'
- * './PangFilters -f filename.bmp -o blurry_cheese_out.bmp -b -c'
+ * 'gcc -c Image.c BMPHandler.c ThreadPool.c -lm -pthread'
+ * 'gcc PangFilters.c Image.o BMPHandler.o ThreadPool.o -o PangFilters -lm -pthread'
+ * './PangFilters -f filename.bmp -o blurry_cheese_out.bmp -b -c -j 8'
  *
 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <ctype.h>
-#include <pthread.h>
 #include "BMPHandler.h"
 #include "Image.h"
-
-#define THREAD_COUNT 4 /* image width must divisible by thread count */
-/* Also, the thread count can not exceed the width of the image */
+#include "ThreadPool.h"
+
+/* filters picked on the command line */
+struct Filter_Options {
+    int blur;                   /* 1 to apply the box blur */
+    int blur_radius;            /* pixels on each side the box blur averages */
+    double gaussian_sigma;      /* 0 means no Gaussian blur */
+    double unsharp_amount;      /* 0 means no unsharp mask */
+    double unsharp_sigma;       /* Gaussian the unsharp mask compares against */
+    int unsharp_threshold;      /* unsharp mask leaves smaller differences alone */
+    char* kernel_name;          /* NULL means no convolution */
+    struct Image_Kernel kernel; /* the kernel named by kernel_name */
+    int cheese;                 /* 1 to apply the swiss cheese filter */
+};
 
 /** The average radius and number of holes
  * should be 8% of the smallest side of the input image  */
 int compute_average_radius_holes(int width, int height);
 
+/** Tint rows [first, last) of a view, one chunk of the swiss cheese tint. */
+int tint_rows(void* arg, int first, int last);
+
+/** Run the per-thread filters (swiss cheese tint, blurs, unsharp mask, convolution) on an image. */
+int apply_thread_filters(struct Image_View* view, const struct Filter_Options* options);
+
+/** Rows of context the per-thread filters read above and below a band. */
+int filter_halo(const struct Filter_Options* options);
+
+/** Process the image a band of rows at a time, so only one band is held in memory. */
+int process_bands(char* input_filename, char* output_filename, int band_rows,
+                  const struct Filter_Options* options);
+
 void usage(void);
 void process_args(int ac, char *av[], char **output_filename,
-                  int *blur_filter, int *swiss_cheese_filter, char **input_file);
+                  int *blur_filter, int *blur_radius, double *gaussian_sigma,
+                  double *unsharp_amount, double *unsharp_sigma, int *unsharp_threshold,
+                  char **kernel_name, int *swiss_cheese_filter, char **input_file, int *band_rows,
+                  int *thread_count, int *thread_stats);
+
+/** Print how long each thread of the pool ran filter chunks. */
+void print_thread_stats(void);
 
 int main(int argc, char* argv[]) {
 
-    int blur_filter_trigger = 0;
-    int cheese_filter_trigger = 0;
+    struct Filter_Options options;
+    options.blur = 0;
+    options.blur_radius = 1; // 3x3 box blur unless -r asks for a larger one
+    options.gaussian_sigma = 0;
+    options.unsharp_amount = 0;
+    options.unsharp_sigma = 2;
+    options.unsharp_threshold = 0;
+    options.kernel_name = NULL;
+    options.cheese = 0;
     char *input_filename = NULL;
     char *output_filename = "default_output.bmp"; // default output filename if not specified by user
+    int band_rows = 0; // 0 means the whole image is loaded at once
+    int thread_count = 0; // 0 means one thread per CPU
+    int thread_stats = 0; // 1 prints each thread's busy time at the end
 
     // call function to parse command line option
     process_args(argc,argv,
                  &output_filename,
-                 &blur_filter_trigger,
-                 &cheese_filter_trigger,
-                 &input_filename);
+                 &options.blur,
+                 &options.blur_radius,
+                 &options.gaussian_sigma,
+                 &options.unsharp_amount,
+                 &options.unsharp_sigma,
+                 &options.unsharp_threshold,
+                 &options.kernel_name,
+                 &options.cheese,
+                 &input_filename,
+                 &band_rows,
+                 &thread_count,
+                 &thread_stats);
+    setThreadPoolSize(thread_count);
+
+    // look up the kernel named by -k
+    if (options.kernel_name != NULL && image_kernel_named(&options.kernel, options.kernel_name) != 0) {
+        fprintf(stderr, "\nError: unknown kernel -k %s\n", options.kernel_name);
+        usage();
+        exit(1);
+    }
 
     // printout user options
     if (input_filename) {
         printf("\nInput filename is: %s\n", input_filename);
     }
-    if (blur_filter_trigger == 1) {
-        printf("----------Apply box blue filter----------\n");
+    if (options.blur == 1) {
+        printf("----------Apply box blue filter, radius %d----------\n", options.blur_radius);
+    }
+    if (options.gaussian_sigma > 0) {
+        printf("----------Apply gaussian blur filter, sigma %g----------\n", options.gaussian_sigma);
+    }
+    if (options.unsharp_amount != 0) {
+        printf("----------Apply unsharp mask, amount %g sigma %g threshold %d----------\n",
+               options.unsharp_amount, options.unsharp_sigma, options.unsharp_threshold);
     }
-    if (cheese_filter_trigger == 1) {
+    if (options.kernel_name != NULL) {
+        printf("----------Apply %s kernel----------\n", options.kernel_name);
+    }
+    if (options.cheese == 1) {
         printf("----------Apply swiss cheese filter----------\n");
     }
+    if (band_rows > 0) {
+        printf("----------Stream %d rows at a time----------\n", band_rows);
+    }
+    printf("----------Use up to %d threads----------\n", getThreadPoolSize());
 
 /////////////////////////////////////////////////////////////////////////////////////
 //---------------------------------Reading Image-----------------------------------//
@@ -62,180 +135,113 @@ int main(int argc, char* argv[]) {
     struct BMP_Header BMP;
     struct DIB_Header DIB;
 
-    FILE* file_input;
+    struct BMP_Map map;
 
-    // check if file exists
-    if ((file_input = fopen(input_filename, "rb"))) {
-        fclose(file_input);
-    } else {
+    // map the file and parse both headers straight out of the mapping
+    int map_result = mapBMP(input_filename, &map);
+    if (map_result == -1) {
         printf("----------------------------------------------------------------\n");
         printf("   File %s does not exist or not within the current folder.\n", input_filename);
         printf("----------------------------------------------------------------\n\n");
         exit(1);
+    } else if (map_result != 0) {
+        printf("----------------------------------------------------------------\n");
+        printf("   File %s is not a supported BMP image.\n", input_filename);
+        printf("----------------------------------------------------------------\n\n");
+        exit(1);
     }
 
-    file_input = fopen(input_filename, "rb");
+    BMP = map.bmp;
+    DIB = map.dib;
+    DIB.image_height = map.format.height; /* rows are stored bottom-up in pixels, keep the height positive */
 
+    printf("The image height is: %d width is: %d\n", DIB.image_height, DIB.image_width);
 
-    readBMPHeader(file_input, &BMP);
-    readDIBHeader(file_input, &DIB);
-
-    // allocate memory for multi array
-    struct Pixel** pixels = (struct Pixel**)malloc(sizeof(struct Pixel*) * DIB.image_height);
-    for (int p = 0; p < DIB.image_height; p++) {
-        pixels[p] = (struct Pixel*)malloc(sizeof(struct Pixel) * DIB.image_width);
+    // streaming mode only needs the headers from the mapping, compressed rows can not be read band by band
+    if (band_rows > 0 && (map.format.compression == BI_RLE8 || map.format.compression == BI_RLE4)) {
+        printf("Compressed input needs the whole image, ignoring -l\n");
+    } else if (band_rows > 0) {
+        unmapBMP(&map);
+        int band_result = process_bands(input_filename, output_filename, band_rows, &options);
+        image_pool_release();
+        if (thread_stats == 1)
+            print_thread_stats();
+        stopThreadPool();
+        if (band_result == -2) {
+            printf("----------------------------------------------------------------\n");
+            printf("   File %s is not a supported BMP image.\n", input_filename);
+            printf("----------------------------------------------------------------\n\n");
+            return 1;
+        } else if (band_result != 0) {
+            printf("Could not read %s or write %s\n", input_filename, output_filename);
+            return 1;
+        }
+        printf("----------------------------------\n");
+        printf("   Image processed successfully\n");
+        printf("----------------------------------\n\n");
+        return 0;
     }
 
-    printf("The image height is: %d width is: %d\n", DIB.image_height, DIB.image_width);
-
-    if (THREAD_COUNT > DIB.image_width) {
-        printf("Thread count too large, please pick a smaller value.");
-        exit(1);
-    } else if (DIB.image_width % THREAD_COUNT != 0) {
-        printf("image width not divisible by thread count %d, please fix.", THREAD_COUNT);
+    /* create image, all rows in one contiguous block */
+    Image* img = image_new(DIB.image_width, DIB.image_height);
+    if (img == NULL) {
+        printf("Not enough memory for the image.\n");
         exit(1);
     }
 
-    // store pixels info into array pixels
-    readPixelsBMP(file_input, pixels, DIB.image_width, DIB.image_height);
-
-    // finished reading image and close file
-    fclose(file_input);
-
-    /* create image */
-    Image* img = image_create(pixels, DIB.image_width, DIB.image_height);
-
-    /* allocate memory for each threads */
-    struct Pixel** pixels_thread[THREAD_COUNT];
-    for (int each_thread_id = 0; each_thread_id < THREAD_COUNT; each_thread_id++) {
+    // store pixels info into the image, straight from the mapping
+    readPixelsMappedBMP(&map, image_get_pixels(img));
 
-        /* divide image vertically base on number of the thread count */
-        int divided_width = (img->width / THREAD_COUNT);
-
-        /* each thread will have their own piece of data to process based on their unique id */
-        int thread_width_start = divided_width * each_thread_id;
-
-        /* allocate memory for each threads of a minimal size based on the divided_width */
-        pixels_thread[each_thread_id] = (struct Pixel**)malloc(sizeof(struct Pixel*) * DIB.image_height);
-        for (int p = 0; p < DIB.image_height; p++) {
-            pixels_thread[each_thread_id][p] = (struct Pixel*)malloc(sizeof(struct Pixel) * divided_width);
-        }
-
-        /* copy image data to individual pixels_thread[each_thread_id] */
-        for (int height = 0; height < img->height; height++) {
-            /* every outer loop will reset this value */
-            int pixels_start = divided_width * each_thread_id;
-            for (int width = 0; width < divided_width; width++) {
-                pixels_thread[each_thread_id][height][width].red = pixels[height][pixels_start].red;
-                pixels_thread[each_thread_id][height][width].green = pixels[height][pixels_start].green;
-                pixels_thread[each_thread_id][height][width].blue = pixels[height][pixels_start].blue;
-                pixels_start++;
-            }
-        }
-    }
+    // finished reading image and release the mapping
+    unmapBMP(&map);
 
 /////////////////////////////////////////////////////////////////////////////////////
 //-------------------------------Image Manipulation--------------------------------//
 /////////////////////////////////////////////////////////////////////////////////////
-    /* Pthread */
-    pthread_t th_blur[THREAD_COUNT], th_swiss[THREAD_COUNT];
-
     /* swiss cheese filter */
     int average_radius_holes = compute_average_radius_holes(DIB.image_width, DIB.image_height);
 
-    if (cheese_filter_trigger == 1) {
+    if (options.cheese == 1) {
         printf("Average radius: %d, number of holes: %d\n", average_radius_holes, average_radius_holes);
-
-        struct thread_args* swiss_cheese_thread_args[THREAD_COUNT];
-
-        for (int i = 0; i < THREAD_COUNT; i++) {
-            swiss_cheese_thread_args[i] = (struct thread_args*)malloc(sizeof(struct thread_args));
-            swiss_cheese_thread_args[i]->pArr = pixels_thread[i];
-            swiss_cheese_thread_args[i]->thread_height = img->height;
-            swiss_cheese_thread_args[i]->thread_width = img->width / THREAD_COUNT;
-            /* create thread */
-            if (pthread_create(&th_swiss[i], NULL, &image_apply_swiss_cheese_filter, (void*)swiss_cheese_thread_args[i]) != 0) { /* The if statement will make sure the thread is created successfully */
-                perror("Failed to create thread");
-                return 1;
-            }
-        }
-        for (int i = 0; i < THREAD_COUNT; i++) {
-            /* wait thread to finish */
-            if (pthread_join(th_swiss[i], NULL) != 0) {
-                perror("Failed to join thread");
-                return 1;
-            }
-        }
     }
 
-
-    /* box blur filter */
-    if (blur_filter_trigger == 1) {
-        struct thread_args* box_blur_thread_args[THREAD_COUNT];
-
-        for (int i = 0; i < THREAD_COUNT; i++) {
-            box_blur_thread_args[i] = (struct thread_args*)malloc(sizeof(struct thread_args));
-            box_blur_thread_args[i]->pArr = pixels_thread[i];
-            box_blur_thread_args[i]->thread_height = img->height;
-            box_blur_thread_args[i]->thread_width = (img->width / THREAD_COUNT); /* extra width is for box blur algorithm */
-            /* create thread */
-            if (pthread_create(&th_blur[i], NULL, &image_apply_blur_filter, (void*)box_blur_thread_args[i]) != 0) { /* The if statement will make sure the thread is created successfully */
-                perror("Failed to create thread");
-                return 1;
-            }
-        }
-        for (int i = 0; i < THREAD_COUNT; i++) {
-            /* wait thread to finish */
-            if (pthread_join(th_blur[i], NULL) != 0) {
-                perror("Failed to join thread");
-                return 1;
-            }
-        }
+    struct Image_View view = image_get_view(img, 0, 0, img->width, img->height);
+    if (apply_thread_filters(&view, &options) != 0) {
+        return 1;
     }
 
-    /* Combine each thread back to img */
-    for (int each_thread_id = 0; each_thread_id < THREAD_COUNT; each_thread_id++) {
-
-        /* divide image vertically base on number of the thread count */
-        int divided_width = img->width / THREAD_COUNT;
-
-        /* copy image data to individual pixels_thread[each_thread_id] */
-        for (int height = 0; height < img->height; height++) {
-            /* every outer loop will reset this value */
-            int pixels_start = divided_width * each_thread_id;
-            for (int width = 0; width < divided_width; width++) {
-                pixels[height][pixels_start].red = pixels_thread[each_thread_id][height][width].red;
-                pixels[height][pixels_start].green = pixels_thread[each_thread_id][height][width].green;
-                pixels[height][pixels_start].blue = pixels_thread[each_thread_id][height][width].blue;
-                pixels_start++;
-            }
-        }
+    if (options.cheese == 1 && image_apply_holes(img, average_radius_holes) != 0) {
+        printf("Not enough memory for the holes.\n");
+        image_destroy(&img);
+        return 1;
     }
 
-    if (cheese_filter_trigger == 1) {
-        image_apply_holes(img, average_radius_holes);
+    int fd_output = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_output == -1) {
+        printf("Could not write %s\n", output_filename);
+        image_destroy(&img);
+        return 1;
     }
 
-    FILE* file_output = fopen(output_filename, "wb");
-
     // update header and dib info
     makeBMPHeader(&BMP, img->width, img->height);
     makeDIBHeader(&DIB, img->width, img->height);
 
-    // write update header and dib info
-    writeBMPHeader(file_output, &BMP);
-    writeDIBHeader(file_output, &DIB);
-
-    // write pixels info into new files
-    writePixelsBMP(file_output, image_get_pixels(img), image_get_width(img), image_get_height(img));
+    // write header, dib info and pixels in a few large writes, space reserved up front
+    if (writeBMPFd(fd_output, &BMP, &DIB, image_get_pixels(img),
+                   image_get_width(img), image_get_height(img), 1) != 0) {
+        printf("Could not write %s\n", output_filename);
+    }
 
     // finished writing and close file
-    fclose(file_output);
+    close(fd_output);
 
-    // free memory
+    // free memory, nothing else will reuse the pooled buffers
     image_destroy(&img);
-    free(pixels);
-    pixels = NULL;
+    image_pool_release();
+    if (thread_stats == 1)
+        print_thread_stats();
+    stopThreadPool();
 
     printf("----------------------------------\n");
     printf("   Image processed successfully\n");
@@ -258,15 +264,248 @@ int compute_average_radius_holes(int width, int height) {
     return average_radius;
 };
 
+/** Tint rows [first, last) of a view, one chunk of the swiss cheese tint.
+ *
+ * @param  arg: the view, a struct Image_View.
+ * @param  first: first row to tint.
+ * @param  last: row after the last row to tint.
+ * @return 0, the tint can not fail.
+*/
+int tint_rows(void* arg, int first, int last) {
+    struct Image_View* view = (struct Image_View*)arg;
+    struct thread_args args;
+    args.view = image_view_sub(view, 0, first, view->width, last - first);
+    image_apply_swiss_cheese_filter(&args);
+    return 0;
+}
+
+/** Run the per-thread filters (swiss cheese tint, blurs, unsharp mask, convolution) on an image.
+ * Each filter splits its bands of rows or tiles over the shared thread pool.
+ *
+ * @param  view: the pixels to filter.
+ * @param  options: the filters to apply.
+ * @return 0 on success, -1 if memory ran out.
+*/
+int apply_thread_filters(struct Image_View* view, const struct Filter_Options* options) {
+    /* swiss cheese filter */
+    if (options->cheese == 1) {
+        parallelFor(view->height, image_parallel_grain(view->height, view->width, 16), tint_rows, view);
+    }
+
+    /* box blur filter */
+    if (options->blur == 1) {
+        if (image_box_blur(view, options->blur_radius) != 0) {
+            printf("Not enough memory for the box blur.\n");
+            return -1;
+        }
+    }
+
+    /* gaussian blur filter */
+    if (options->gaussian_sigma > 0) {
+        if (image_gaussian_blur(view, options->gaussian_sigma) != 0) {
+            printf("Not enough memory for the gaussian blur.\n");
+            return -1;
+        }
+    }
+
+    /* unsharp mask */
+    if (options->unsharp_amount != 0) {
+        if (image_unsharp_mask(view, options->unsharp_sigma, options->unsharp_amount,
+                               options->unsharp_threshold) != 0) {
+            printf("Not enough memory for the unsharp mask.\n");
+            return -1;
+        }
+    }
+
+    /* convolution with a named kernel */
+    if (options->kernel_name != NULL) {
+        if (image_convolve(view, &options->kernel) != 0) {
+            printf("Not enough memory for the %s kernel.\n", options->kernel_name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/** Rows of context the per-thread filters read above and below a band, each filter reads
+ * as far past the output of the one before it as its own radius.
+ *
+ * @param  options: the filters to apply.
+ * @return number of halo rows on each side.
+*/
+int filter_halo(const struct Filter_Options* options) {
+    int halo = 0;
+    if (options->blur == 1)
+        halo += options->blur_radius;
+    if (options->gaussian_sigma > 0)
+        halo += image_gaussian_reach(options->gaussian_sigma);
+    if (options->unsharp_amount != 0)
+        halo += image_gaussian_reach(options->unsharp_sigma);
+    if (options->kernel_name != NULL)
+        halo += options->kernel.size / 2;
+    return halo;
+}
+
+/** Process the image a band of rows at a time, so only one band is held in memory.
+ * Each band is read together with filter_halo rows above and below it for the blurs,
+ * the halo rows are dropped again before the band is written.
+ *
+ * @param  input_filename: the BMP file to read.
+ * @param  output_filename: the BMP file to write.
+ * @param  band_rows: number of rows per band.
+ * @param  options: the filters to apply.
+ * @return 0 on success, -1 if a file can not be opened, the input ends early, the output can
+ *         not be written or a filter runs out of memory, -2 if the input is not a supported BMP
+ *         or is compressed, which can not be read band by band. The output is only opened
+ *         once the input is known to be good.
+*/
+int process_bands(char* input_filename, char* output_filename, int band_rows,
+                  const struct Filter_Options* options) {
+    struct BMP_Header BMP;
+    struct DIB_Header DIB;
+
+    FILE* file_input = fopen(input_filename, "rb");
+    if (file_input == NULL) {
+        return -1;
+    }
+
+    struct BMP_Format format;
+    readBMPHeader(file_input, &BMP);
+    readDIBHeader(file_input, &DIB);
+    if (readFormatBMP(file_input, &BMP, &DIB, &format) != 0 ||
+        format.compression == BI_RLE8 || format.compression == BI_RLE4) {
+        fclose(file_input);
+        return -2;
+    }
+
+    /* a bad input must not clobber an existing output, open it only now */
+    FILE* file_output = fopen(output_filename, "wb");
+    if (file_output == NULL) {
+        fclose(file_input);
+        return -1;
+    }
+    int width = format.width;
+    int height = format.height;
+
+    /* holes are picked for the whole image up front and drawn band by band */
+    struct Hole* holes = NULL;
+    int number_of_holes = 0;
+    if (options->cheese == 1) {
+        int average_radius_holes = compute_average_radius_holes(width, height);
+        printf("Average radius: %d, number of holes: %d\n", average_radius_holes, average_radius_holes);
+        number_of_holes = image_make_holes(width, height, average_radius_holes, &holes);
+        if (number_of_holes < 0) {
+            fclose(file_input);
+            fclose(file_output);
+            return -1;
+        }
+    }
+
+    /* blurs need rows of context above and below each band */
+    int halo = filter_halo(options);
+    if (halo > height)
+        halo = height;
+
+    /* allocate memory for one band plus its halo rows */
+    Image* buffer = image_new(width, band_rows + 2 * halo);
+    if (buffer == NULL) {
+        free(holes);
+        fclose(file_input);
+        fclose(file_output);
+        return -1;
+    }
+    struct Pixel** pixels = image_get_pixels(buffer);
+
+    struct BMP_Header out_BMP = BMP;
+    struct DIB_Header out_DIB = DIB;
+    makeBMPHeader(&out_BMP, width, height);
+    makeDIBHeader(&out_DIB, width, height);
+    writeBMPHeader(file_output, &out_BMP);
+    writeDIBHeader(file_output, &out_DIB);
+
+    int result = 0;
+    for (int band_start = 0; band_start < height; band_start += band_rows) {
+        int rows = band_rows;
+        if (band_start + rows > height)
+            rows = height - band_start;
+
+        /* rows actually read: the band and the halo rows that exist */
+        int first = band_start - halo < 0 ? 0 : band_start - halo;
+        int last = band_start + rows + halo > height ? height : band_start + rows + halo;
+
+        /* a truncated input fails the whole image */
+        if (readRowsBMP(file_input, &BMP, &format, pixels, first, last - first) != 0) {
+            result = -1;
+            break;
+        }
+
+        struct Image_View view = image_get_view(buffer, 0, 0, width, last - first);
+        if (apply_thread_filters(&view, options) != 0) {
+            result = -1;
+            break;
+        }
+
+        /* drop the halo rows before drawing holes and writing */
+        Image* band = image_create(pixels + (band_start - first), width, rows);
+        image_draw_holes(band, band_start, holes, number_of_holes);
+        if (writePixelsBMP(file_output, image_get_pixels(band), width, rows) != 0)
+            result = -1;
+        image_destroy(&band);
+        if (result != 0)
+            break;
+    }
+
+    image_destroy(&buffer);
+    free(holes);
+    fclose(file_input);
+    /* buffered header and pixel writes only fail for sure once the file is closed */
+    if (ferror(file_output))
+        result = -1;
+    if (fclose(file_output) != 0)
+        result = -1;
+
+    return result;
+}
+
+/** Print how long each thread of the pool ran filter chunks. Busy times far apart mean the
+ * work was split unevenly, thread 0 is the main thread.
+*/
+void print_thread_stats(void) {
+    struct Thread_Pool_Stats stats;
+    getThreadPoolStats(&stats);
+
+    double busy = 0;
+    printf("----------Thread busy time----------\n");
+    printf("thread   busy ms   share   chunks   steals\n");
+    for (int t = 0; t < stats.threads; t++) {
+        double share = stats.job_ms > 0 ? 100 * stats.busy_ms[t] / stats.job_ms : 0;
+        printf("%6d %9.1f %6.0f%% %8ld %8ld\n", t, stats.busy_ms[t], share, stats.chunks[t], stats.steals[t]);
+        busy += stats.busy_ms[t];
+    }
+    printf("parallel filters took %.1f ms, the threads were busy %.0f%% of it\n\n", stats.job_ms,
+           stats.job_ms > 0 ? 100 * busy / (stats.job_ms * stats.threads) : 0);
+}
+
 // prints out error message when user tries to run with bad command line args or
 // when user runs with the -h command line arg
 void usage(void){
     fprintf(stderr,
             " usage:\n"
-            "    ./PangFilters -i filename [-b] [-c] [-o filename]\n"
+            "    ./PangFilters -i filename [-b [-r radius]] [-g sigma] [-u amount [-s sigma] [-t threshold]] [-k kernel] [-c] [-l rows] [-j threads] [-T] [-o filename]\n"
             "       -f  filename:    must have a input file name  to run\n"
             "       -b               apply box blur filter\n"
+            "       -r  radius:      box blur radius in pixels, 1 (3x3) by default\n"
+            "       -g  sigma:       apply gaussian blur filter of sigma pixels\n"
+            "       -u  amount:      apply unsharp mask, 1 adds the full difference to the blur\n"
+            "       -s  sigma:       blur sigma of the unsharp mask in pixels, 2 by default\n"
+            "       -t  threshold:   unsharp mask leaves channel differences below this alone\n"
+            "       -k  kernel:      convolve with sharpen, emboss, sobel-x, sobel-y, scharr-x,\n"
+            "                        scharr-y, laplacian, edges, gaussian5 or box5\n"
             "       -c               apply swiss cheese filter\n"
+            "       -l  rows:        stream the image this many rows at a time (low memory)\n"
+            "       -j  threads:     number of threads, one per CPU by default\n"
+            "       -T               print how long each thread was busy filtering\n"
             "       -o  filename:    optional to customize output filename\n"
             "       -h:              print out this help message\n"
             "\n");
@@ -274,13 +513,16 @@ void usage(void){
 
 // parse command line arguments using getopt.
 void process_args(int ac, char *av[], char **output_filename,
-                  int *blur_filter, int *swiss_cheese_filter, char **input_file)
+                  int *blur_filter, int *blur_radius, double *gaussian_sigma,
+                  double *unsharp_amount, double *unsharp_sigma, int *unsharp_threshold,
+                  char **kernel_name, int *swiss_cheese_filter, char **input_file, int *band_rows,
+                  int *thread_count, int *thread_stats)
 {
 
     int command, f = 0;
 
     while(1){
-        command = getopt(ac, av, "f: b c o: h");
+        command = getopt(ac, av, "f: b r: g: u: s: t: k: c l: j: T o: h");
 
         if( command == -1) {
             break; // nothing left to parse in the command line
@@ -293,8 +535,46 @@ void process_args(int ac, char *av[], char **output_filename,
                 break;
             case 'b': *blur_filter = 1;
                 break;
+            case 'r': *blur_radius = atoi(optarg);
+                if (*blur_radius <= 0) {
+                    fprintf(stderr, "\nError: blur radius -r %s must be a positive number of pixels\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'g': *gaussian_sigma = atof(optarg);
+                if (!(*gaussian_sigma > 0)) {
+                    fprintf(stderr, "\nError: gaussian sigma -g %s must be a positive number of pixels\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'u': *unsharp_amount = atof(optarg);
+                break;
+            case 's': *unsharp_sigma = atof(optarg);
+                if (!(*unsharp_sigma > 0)) {
+                    fprintf(stderr, "\nError: unsharp sigma -s %s must be a positive number of pixels\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 't': *unsharp_threshold = atoi(optarg);
+                break;
+            case 'k': *kernel_name = optarg;
+                break;
             case 'c': *swiss_cheese_filter = 1;
                 break;
+            case 'l': *band_rows = atoi(optarg);
+                if (*band_rows <= 0) {
+                    fprintf(stderr, "\nError: band size -l %s must be a positive number of rows\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'j': *thread_count = atoi(optarg);
+                if (*thread_count <= 0) {
+                    fprintf(stderr, "\nError: thread count -j %s must be a positive number\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'T': *thread_stats = 1;
+                break;
             case 'o': *output_filename = optarg;
                 break;
             case ':': fprintf(stderr, "\n Error -%c missing arg\n", optopt);
@@ -311,4 +591,4 @@ void process_args(int ac, char *av[], char **output_filename,
         usage();
         exit(1);
     }
-}
\ No newline at end of file
+}
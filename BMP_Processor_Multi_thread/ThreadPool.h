@@ -0,0 +1,89 @@
+/**
+* Header file for the thread pool shared by the filters.
+* The worker threads are started the first time work is handed out and wait for the next
+* filter in between, so a filter pays for a wake up instead of a pthread_create per thread.
+* Each thread has a deque of chunks and steals from the others when its own runs out.
+*
+* @author Sheldon Pang
+* @version 1.1
+* 1.1 update notes: Work stealing deques, "void getThreadPoolStats(struct Thread_Pool_Stats* stats)"
+*/
+
+#ifndef BMP_PROCESSOR_MULTI_THREAD_THREADPOOL_H
+#define BMP_PROCESSOR_MULTI_THREAD_THREADPOOL_H
+
+#define THREAD_POOL_MAX 256     /* most threads the pool starts */
+
+/* Work of one chunk of a parallelFor, items [first, last). Returns 0 on success, -1 on failure. */
+typedef int (*Parallel_Body)(void* arg, int first, int last);
+
+/* How busy each thread has been, see getThreadPoolStats. */
+struct Thread_Pool_Stats {
+    int threads;                        /* entries filled in below, thread 0 is the caller */
+    double job_ms;                      /* time from handing out each job to its last chunk */
+    double busy_ms[THREAD_POOL_MAX];    /* time each thread spent running chunks */
+    long chunks[THREAD_POOL_MAX];       /* chunks each thread ran */
+    long steals[THREAD_POOL_MAX];       /* times each thread took chunks from another */
+};
+
+
+/**
+ * Set the number of threads work is split over, the calling thread included. Stops the
+ * workers if they are running, they are started again at the new size when next needed.
+ *
+ * @param  threads: Number of threads, 0 for one per CPU
+ */
+void setThreadPoolSize(int threads);
+
+/**
+ * Get the number of threads work is split over, the calling thread included.
+ *
+ * @return The number of threads, at least 1
+ */
+int getThreadPoolSize(void);
+
+/**
+ * Run body over the items [0, count) in chunks of grain items, on the pool's threads and the
+ * calling thread, and wait for all of them. Every thread starts on an equal run of chunks and
+ * steals from the others once its own run is done, so uneven chunks still keep all of them
+ * busy. Called from inside a body, or with a single chunk, it runs on the calling thread.
+ *
+ * @param  count: Number of items, such as rows or tiles
+ * @param  grain: Items per chunk, at least 1
+ * @param  body: Work of one chunk
+ * @param  arg: Passed to body
+ * @return 0 on success, -1 if body failed for a chunk
+ */
+int parallelFor(int count, int grain, Parallel_Body body, void* arg);
+
+/**
+ * Returns how many items each chunk should get so every thread gets about chunks_per_thread
+ * chunks, never fewer than min_grain items.
+ *
+ * @param  count: Number of items
+ * @param  chunks_per_thread: Chunks to aim for per thread, more balances uneven work better
+ * @param  min_grain: Fewest items worth a chunk
+ * @return Items per chunk, at least 1
+ */
+int parallelGrain(int count, int chunks_per_thread, int min_grain);
+
+/**
+ * Stop the worker threads and free them, for the end of the program.
+ */
+void stopThreadPool(void);
+
+/**
+ * Get how busy each thread of the pool has been since the program started or the stats were
+ * last cleared. Thread 0 is the calling thread. Time a thread spends waiting while the others
+ * finish their chunks is not busy, so uneven busy times show the work was split unevenly.
+ *
+ * @param  stats: Filled in, one entry per thread up to the pool size
+ */
+void getThreadPoolStats(struct Thread_Pool_Stats* stats);
+
+/**
+ * Clear the counters getThreadPoolStats reports.
+ */
+void clearThreadPoolStats(void);
+
+#endif //BMP_PROCESSOR_MULTI_THREAD_THREADPOOL_H
@@ -9,11 +9,160 @@
 // Include Files
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
 #include "Image.h"
+#include "ThreadPool.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //Function Declarations
 
+/* Free pixel buffers kept for reuse, shared by every thread. Sizes are rounded up to one of
+ * four classes per power of two, so a buffer is at most 25% larger than asked for.
+*/
+#define IMAGE_POOL_CLASSES 256
+#define IMAGE_POOL_DEPTH   8    /* buffers kept per size class, more are freed */
+
+static void* image_pool_blocks[IMAGE_POOL_CLASSES][IMAGE_POOL_DEPTH];
+static int image_pool_count[IMAGE_POOL_CLASSES];
+static pthread_mutex_t image_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the size class of a buffer of size bytes.
+*
+ * @param  size: Bytes needed.
+ * @param  capacity: Set to the bytes every buffer of the class holds.
+ * @return Index of the size class.
+*/
+static int image_pool_class(size_t size, size_t* capacity) {
+    if (size < 256) {
+        size = 256;
+    }
+    // size lies in (2^k, 2^(k+1)], split in four steps of 2^(k-2)
+    int k = 63 - __builtin_clzll((unsigned long long)(size - 1));
+    size_t base = (size_t)1 << k;
+    size_t step = base >> 2;
+    size_t sub = (size - base + step - 1) / step;
+    *capacity = base + sub * step;
+    return 4 * k + (int)sub - 1;
+}
+
+/* Takes a 64-byte aligned buffer of at least size bytes from the pool, or allocates one.
+*
+ * @param  size: Bytes needed.
+ * @param  capacity: Set to the bytes the buffer holds, to hand back to image_pool_free.
+ * @return The buffer, NULL if the memory can not be allocated.
+*/
+static void* image_pool_alloc(size_t size, size_t* capacity) {
+    int sizeClass = image_pool_class(size, capacity);
+    void* block = NULL;
+
+    pthread_mutex_lock(&image_pool_lock);
+    if (image_pool_count[sizeClass] > 0) {
+        block = image_pool_blocks[sizeClass][--image_pool_count[sizeClass]];
+    }
+    pthread_mutex_unlock(&image_pool_lock);
+
+    if (block == NULL && posix_memalign(&block, 64, *capacity) != 0) {
+        return NULL;
+    }
+    return block;
+}
+
+/* Hands a buffer from image_pool_alloc back to the pool.
+*
+ * @param  block: The buffer, may be NULL.
+ * @param  capacity: Capacity given by image_pool_alloc.
+*/
+static void image_pool_free(void* block, size_t capacity) {
+    if (block == NULL) {
+        return;
+    }
+    size_t classCapacity;
+    int sizeClass = image_pool_class(capacity, &classCapacity);
+
+    pthread_mutex_lock(&image_pool_lock);
+    if (image_pool_count[sizeClass] < IMAGE_POOL_DEPTH) {
+        image_pool_blocks[sizeClass][image_pool_count[sizeClass]++] = block;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&image_pool_lock);
+
+    free(block);
+}
+
+/* Frees every pixel buffer the pool keeps for reuse. Destroyed images hand their buffers
+ * to the pool so the next image of a similar size needs no allocation; call this once the
+ * last image is done.
+*/
+void image_pool_release(void) {
+    pthread_mutex_lock(&image_pool_lock);
+    for (int c = 0; c < IMAGE_POOL_CLASSES; c++) {
+        while (image_pool_count[c] > 0) {
+            free(image_pool_blocks[c][--image_pool_count[c]]);
+        }
+    }
+    pthread_mutex_unlock(&image_pool_lock);
+}
+
+/* Allocates height rows of width pixels in one 64-byte aligned block, each row padded
+ * to a multiple of 64 bytes, with the row pointer table in front of them. The block comes
+ * from the buffer pool.
+*
+ * @param  width: Width of the rows.
+ * @param  height: Number of rows.
+ * @param  data: Set to the block.
+ * @param  size: Set to the capacity of the block, to hand back to image_pool_free.
+ * @param  stride: Set to the bytes from one row to the next.
+ * @return The row pointer table, NULL if the memory can not be allocated.
+*/
+static struct Pixel** image_alloc_rows(int width, int height, unsigned char** data, size_t* size,
+                                       size_t* stride) {
+    *stride = ((size_t)width * sizeof(struct Pixel) + 63) & ~(size_t)63;
+
+    // the row pointer table sits in front of the rows, in the same pooled block
+    size_t table = (sizeof(struct Pixel*) * height + 63) & ~(size_t)63;
+    unsigned char* block = (unsigned char*)image_pool_alloc(table + *stride * height, size);
+    if (block == NULL) {
+        return NULL;
+    }
+    struct Pixel** rows = (struct Pixel**)block;
+    for (int i = 0; i < height; i++) {
+        rows[i] = (struct Pixel*)(block + table + *stride * i);
+    }
+    *data = block;
+    return rows;
+}
+
+/* Creates a new image that owns its pixels. All rows live in one 64-byte aligned
+ * allocation, each row starts on a 64-byte boundary, stride bytes after the previous one.
+ * The pixels are not initialised.
+*
+ * @param  width: Width of this image.
+ * @param  height: Height of this image.
+ * @return A pointer to a new image, NULL if the memory can not be allocated.
+*/
+Image* image_new(int width, int height) {
+    Image *image = (Image*) malloc(sizeof (Image));
+    if (image == NULL) {
+        return NULL;
+    }
+
+    image->width = width;
+    image->height = height;
+    image->pArr = image_alloc_rows(width, height, &image->data, &image->data_size, &image->stride);
+    image->layout = IMAGE_LAYOUT_RGB;
+    image->alt = NULL;
+    image->alt_size = 0;
+    image->alt_stride = 0;
+    if (image->pArr == NULL) {
+        free(image);
+        return NULL;
+    }
+
+    return image;
+}
+
 /* Creates a new image and returns it.
 *
  * @param  pArr: Pixel array of this image.
@@ -27,16 +176,26 @@ Image* image_create(struct Pixel** pArr, int width, int height) {
     image->width = width;
     image->height = height;
     image->pArr = pArr;
+    image->data = NULL;
+    image->data_size = 0;
+    image->stride = 0;
+    image->layout = IMAGE_LAYOUT_RGB;
+    image->alt = NULL;
+    image->alt_size = 0;
+    image->alt_stride = 0;
 
     return image;
 }
 
 
-/* Destroys an image. Does not deallocate internal pixel array.
+/* Destroys an image. Pixels the image owns (image_new) go back to the buffer pool,
+ * the pixel array given to image_create is not deallocated.
 *
  * @param  img: the image to destroy.
 */
 void image_destroy(Image** img) {
+    image_pool_free((*img)->data, (*img)->data_size);
+    image_pool_free((*img)->alt, (*img)->alt_size);
     free(*img);
     *img = NULL;
 }
@@ -65,131 +224,1538 @@ int image_get_height(Image* img) {
     return img->height;
 }
 
-/* Converts the image to grayscale.
+/* Returns a pointer to the first pixel of a row.
 *
  * @param  img: the image.
+ * @param  row: index of the row.
 */
-void image_apply_bw(Image* img) {
+struct Pixel* image_get_row(Image* img, int row) {
+    return img->pArr[row];
+}
+
+/* Returns the number of bytes from the start of one row to the next,
+ * 0 if the rows were given to image_create and are not evenly spaced.
+*
+ * @param  img: the image.
+*/
+size_t image_get_stride(Image* img) {
+    return img->stride;
+}
+
+/* Returns a view of a rectangle of an image. The image must own its pixels (image_new)
+ * and the rectangle must lie inside it.
+*
+ * @param  img: the image.
+ * @param  x: first column of the rectangle.
+ * @param  y: first row of the rectangle.
+ * @param  width: width of the rectangle.
+ * @param  height: height of the rectangle.
+*/
+struct Image_View image_get_view(Image* img, int x, int y, int width, int height) {
+    struct Image_View view;
+    view.origin = img->pArr[y] + x;
+    view.width = width;
+    view.height = height;
+    view.stride = img->stride;
+    return view;
+}
+
+/* Returns a view of a rectangle of another view, which must lie inside it.
+*
+ * @param  view: the view.
+ * @param  x: first column of the rectangle.
+ * @param  y: first row of the rectangle.
+ * @param  width: width of the rectangle.
+ * @param  height: height of the rectangle.
+*/
+struct Image_View image_view_sub(const struct Image_View* view, int x, int y, int width, int height) {
+    struct Image_View sub;
+    sub.origin = image_view_row(view, y) + x;
+    sub.width = width;
+    sub.height = height;
+    sub.stride = view->stride;
+    return sub;
+}
+
+/* Returns a pointer to the first pixel of a row of a view.
+*
+ * @param  view: the view.
+ * @param  row: index of the row.
+*/
+struct Pixel* image_view_row(const struct Image_View* view, int row) {
+    return (struct Pixel*)((unsigned char*)view->origin + view->stride * row);
+}
+
+/* Returns the layout the pixel values are currently held in, one of IMAGE_LAYOUT_*.
+*
+ * @param  img: the image.
+*/
+int image_get_layout(Image* img) {
+    return img->layout;
+}
+
+/* Returns the first byte of a channel in a row and the distance to the same channel of the
+ * next pixel, for whatever layout the image is in.
+*
+ * @param  img: the image.
+ * @param  channel: IMAGE_RED, IMAGE_GREEN or IMAGE_BLUE.
+ * @param  row: index of the row.
+ * @param  step: set to the bytes from one pixel to the next.
+*/
+static unsigned char* image_channel_row(Image* img, int channel, int row, int* step) {
+    switch (img->layout) {
+        case IMAGE_LAYOUT_PLANAR:
+            *step = 1;
+            return img->alt + ((size_t)channel * img->height + row) * img->alt_stride;
+        case IMAGE_LAYOUT_BGRX:
+            *step = 4;
+            return img->alt + (size_t)row * img->alt_stride + (IMAGE_BLUE - channel);
+        default:
+            // struct Pixel is red, green, blue
+            *step = 3;
+            return (unsigned char*)img->pArr[row] + channel;
+    }
+}
+
+/* Copies one channel of a row between two layouts.
+*
+ * @param  dst: first byte of the channel in the destination row.
+ * @param  dstStep: bytes from one pixel to the next in the destination.
+ * @param  src: first byte of the channel in the source row.
+ * @param  srcStep: bytes from one pixel to the next in the source.
+ * @param  width: number of pixels.
+*/
+static void image_copy_channel(unsigned char* dst, int dstStep, const unsigned char* src, int srcStep, int width) {
+    for (int j = 0; j < width; j++) {
+        dst[j * dstStep] = src[j * srcStep];
+    }
+}
+
+/* Converts the pixel values to another layout. Converting back to IMAGE_LAYOUT_RGB
+ * writes them into the pixel array again, which must be done before the image is written.
+*
+ * @param  img: the image.
+ * @param  layout: one of IMAGE_LAYOUT_*.
+ * @return 0 on success, -1 if the memory for the layout can not be allocated.
+*/
+int image_set_layout(Image* img, int layout) {
+    if (layout == img->layout) {
+        return 0;
+    }
+
+    // the alternate buffer holds the values of any non-RGB layout
+    unsigned char* alt = img->alt;
+    size_t altStride = img->alt_stride;
+    size_t altCapacity = img->alt_size;
+    if (layout != IMAGE_LAYOUT_RGB) {
+        altStride = layout == IMAGE_LAYOUT_PLANAR ? ((size_t)img->width + 63) & ~(size_t)63
+                                                  : ((size_t)img->width * 4 + 63) & ~(size_t)63;
+        size_t size = altStride * img->height * (layout == IMAGE_LAYOUT_PLANAR ? 3 : 1);
+        if (img->layout != IMAGE_LAYOUT_RGB || size > img->alt_size) {
+            // the current values may live in the old buffer, keep it until they are copied
+            alt = (unsigned char*)image_pool_alloc(size, &altCapacity);
+            if (alt == NULL) {
+                return -1;
+            }
+        }
+    }
+
     for (int i = 0; i < img->height; i++) {
-        for (int j = 0; j < img->width; j++) {
-            // calculate grayscale
-            int grayscale =
-                    0.114 * (img->pArr[i][j].blue) +
-                    0.587 * (img->pArr[i][j].green) +
-                    0.299 * (img->pArr[i][j].red);
-            // convert to grayscale
-            img->pArr[i][j].blue = grayscale;
-            img->pArr[i][j].green = grayscale;
-            img->pArr[i][j].red = grayscale;
+        for (int channel = IMAGE_RED; channel <= IMAGE_BLUE; channel++) {
+            int srcStep, dstStep;
+            const unsigned char* src = image_channel_row(img, channel, i, &srcStep);
+            unsigned char* dst;
+            if (layout == IMAGE_LAYOUT_PLANAR) {
+                dstStep = 1;
+                dst = alt + ((size_t)channel * img->height + i) * altStride;
+            } else if (layout == IMAGE_LAYOUT_BGRX) {
+                dstStep = 4;
+                dst = alt + (size_t)i * altStride + (IMAGE_BLUE - channel);
+            } else {
+                dstStep = 3;
+                dst = (unsigned char*)img->pArr[i] + channel;
+            }
+            image_copy_channel(dst, dstStep, src, srcStep, img->width);
+        }
+    }
+
+    if (alt != img->alt) {
+        image_pool_free(img->alt, img->alt_size);
+        img->alt = alt;
+        img->alt_size = altCapacity;
+    }
+    if (layout != IMAGE_LAYOUT_RGB) {
+        img->alt_stride = altStride;
+    }
+    img->layout = layout;
+    return 0;
+}
+
+/* Returns the bytes of one channel of one row of an image in IMAGE_LAYOUT_PLANAR.
+*
+ * @param  img: the image.
+ * @param  channel: IMAGE_RED, IMAGE_GREEN or IMAGE_BLUE.
+ * @param  row: index of the row.
+*/
+unsigned char* image_get_plane_row(Image* img, int channel, int row) {
+    return img->alt + ((size_t)channel * img->height + row) * img->alt_stride;
+}
+
+/* Returns the first byte of one row of an image in IMAGE_LAYOUT_BGRX.
+*
+ * @param  img: the image.
+ * @param  row: index of the row.
+*/
+unsigned char* image_get_bgrx_row(Image* img, int row) {
+    return img->alt + (size_t)row * img->alt_stride;
+}
+
+/* Grayscale weights of red, green and blue in 2.14 fixed point: 0.299, 0.587 and 0.114
+ * rounded so they add up to exactly 1.0, which keeps gray pixels unchanged.
+*/
+#define IMAGE_BW_RED   4899
+#define IMAGE_BW_GREEN 9617
+#define IMAGE_BW_BLUE  1868
+#define IMAGE_BW_SHIFT 14
+
+/* Converts one row to grayscale, channels step bytes apart from one pixel to the next.
+ * This is the reference every vector version matches bit for bit. The fixed point weights
+ * give the same result as the 0.114 / 0.587 / 0.299 floating point formula used before, or one
+ * more for 0.18% of all colors, where rounding errors of the doubles pushed it under an integer.
+*
+ * @param  red: first red byte of the row.
+ * @param  green: first green byte of the row.
+ * @param  blue: first blue byte of the row.
+ * @param  width: number of pixels.
+ * @param  step: bytes from one pixel to the next.
+*/
+static inline void image_bw_row(unsigned char* red, unsigned char* green, unsigned char* blue,
+                                int width, int step) {
+    for (int j = 0; j < width; j++) {
+        // calculate grayscale
+        int grayscale = (IMAGE_BW_BLUE * blue[j * step] +
+                         IMAGE_BW_GREEN * green[j * step] +
+                         IMAGE_BW_RED * red[j * step]) >> IMAGE_BW_SHIFT;
+        // convert to grayscale
+        blue[j * step] = grayscale;
+        green[j * step] = grayscale;
+        red[j * step] = grayscale;
+    }
+}
+
+/* Scalar grayscale of a row of planes, of a packed RGB row and of a BGRX row. */
+static void image_bw_planes_scalar(unsigned char* red, unsigned char* green, unsigned char* blue, int width) {
+    image_bw_row(red, green, blue, width, 1);
+}
+
+static void image_bw_rgb_scalar(unsigned char* row, int width) {
+    image_bw_row(row, row + 1, row + 2, width, 3);
+}
+
+static void image_bw_bgrx_scalar(unsigned char* row, int width) {
+    image_bw_row(row + 2, row + 1, row, width, 4);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* Grayscale of 8 pixels held in three 8 x 16-bit vectors. Red and green are paired for one
+ * multiply-add, blue is paired with zero for the other.
+*/
+__attribute__((target("sse2")))
+static inline __m128i image_bw_sse2_half(__m128i r, __m128i g, __m128i b) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weightsRG = _mm_set1_epi32(IMAGE_BW_RED | (IMAGE_BW_GREEN << 16));
+    const __m128i weightsB = _mm_set1_epi32(IMAGE_BW_BLUE);
+    __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r, g), weightsRG),
+                               _mm_madd_epi16(_mm_unpacklo_epi16(b, zero), weightsB));
+    __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r, g), weightsRG),
+                               _mm_madd_epi16(_mm_unpackhi_epi16(b, zero), weightsB));
+    return _mm_packs_epi32(_mm_srli_epi32(lo, IMAGE_BW_SHIFT), _mm_srli_epi32(hi, IMAGE_BW_SHIFT));
+}
+
+/* Grayscale of 16 pixels held in three vectors of bytes. */
+__attribute__((target("sse2")))
+static inline __m128i image_bw_sse2_gray(__m128i r, __m128i g, __m128i b) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = image_bw_sse2_half(_mm_unpacklo_epi8(r, zero), _mm_unpacklo_epi8(g, zero),
+                                    _mm_unpacklo_epi8(b, zero));
+    __m128i hi = image_bw_sse2_half(_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero),
+                                    _mm_unpackhi_epi8(b, zero));
+    return _mm_packus_epi16(lo, hi);
+}
+
+/* Converts one row of planes to grayscale, 16 pixels at a time with SSE2. */
+__attribute__((target("sse2")))
+static void image_bw_planes_sse2(unsigned char* red, unsigned char* green, unsigned char* blue, int width) {
+    int j = 0;
+    for (; j + 16 <= width; j += 16) {
+        __m128i gray = image_bw_sse2_gray(_mm_loadu_si128((const __m128i*)(red + j)),
+                                          _mm_loadu_si128((const __m128i*)(green + j)),
+                                          _mm_loadu_si128((const __m128i*)(blue + j)));
+        _mm_storeu_si128((__m128i*)(red + j), gray);
+        _mm_storeu_si128((__m128i*)(green + j), gray);
+        _mm_storeu_si128((__m128i*)(blue + j), gray);
+    }
+    image_bw_row(red + j, green + j, blue + j, width - j, 1);
+}
+
+/* Converts one BGRX row to grayscale, 4 pixels per vector with SSE2. Each pixel is one 32-bit
+ * lane: blue and red form one pair of 16-bit words, green and the unused byte the other.
+*/
+__attribute__((target("sse2")))
+static void image_bw_bgrx_sse2(unsigned char* row, int width) {
+    const __m128i lowBytes = _mm_set1_epi32(0x00FF00FF);
+    const __m128i unused = _mm_set1_epi32((int)0xFF000000);
+    const __m128i weightsBR = _mm_set1_epi32(IMAGE_BW_BLUE | (IMAGE_BW_RED << 16));
+    const __m128i weightsG = _mm_set1_epi32(IMAGE_BW_GREEN);
+    int j = 0;
+    for (; j + 4 <= width; j += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(row + j * 4));
+        __m128i sum = _mm_add_epi32(_mm_madd_epi16(_mm_and_si128(v, lowBytes), weightsBR),
+                                    _mm_madd_epi16(_mm_and_si128(_mm_srli_epi32(v, 8), lowBytes), weightsG));
+        __m128i gray = _mm_srli_epi32(sum, IMAGE_BW_SHIFT);
+        gray = _mm_or_si128(gray, _mm_or_si128(_mm_slli_epi32(gray, 8), _mm_slli_epi32(gray, 16)));
+        _mm_storeu_si128((__m128i*)(row + j * 4), _mm_or_si128(gray, _mm_and_si128(v, unused)));
+    }
+    image_bw_bgrx_scalar(row + j * 4, width - j);
+}
+
+/* Converts one packed RGB row to grayscale, 16 pixels (48 bytes) at a time. SSE2 has no byte
+ * shuffle, so this needs SSSE3: the three vectors are split into red, green and blue with
+ * pshufb, and each gray byte is repeated three times on the way back.
+*/
+__attribute__((target("ssse3")))
+static void image_bw_rgb_ssse3(unsigned char* row, int width) {
+    const char z = -128; // pshufb index that yields a zero byte
+    const __m128i r0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, z, z, z, z, z, z, z, z, z, z);
+    const __m128i r1 = _mm_setr_epi8(z, z, z, z, z, z, 2, 5, 8, 11, 14, z, z, z, z, z);
+    const __m128i r2 = _mm_setr_epi8(z, z, z, z, z, z, z, z, z, z, z, 1, 4, 7, 10, 13);
+    const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, z, z, z, z, z, z, z, z, z, z, z);
+    const __m128i g1 = _mm_setr_epi8(z, z, z, z, z, 0, 3, 6, 9, 12, 15, z, z, z, z, z);
+    const __m128i g2 = _mm_setr_epi8(z, z, z, z, z, z, z, z, z, z, z, 2, 5, 8, 11, 14);
+    const __m128i b0 = _mm_setr_epi8(2, 5, 8, 11, 14, z, z, z, z, z, z, z, z, z, z, z);
+    const __m128i b1 = _mm_setr_epi8(z, z, z, z, z, 1, 4, 7, 10, 13, z, z, z, z, z, z);
+    const __m128i b2 = _mm_setr_epi8(z, z, z, z, z, z, z, z, z, z, 0, 3, 6, 9, 12, 15);
+    const __m128i out0 = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+    const __m128i out1 = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+    const __m128i out2 = _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+    int j = 0;
+    for (; j + 16 <= width; j += 16) {
+        unsigned char* p = row + j * 3;
+        __m128i v0 = _mm_loadu_si128((const __m128i*)p);
+        __m128i v1 = _mm_loadu_si128((const __m128i*)(p + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i*)(p + 32));
+        __m128i r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, r0), _mm_shuffle_epi8(v1, r1)),
+                                 _mm_shuffle_epi8(v2, r2));
+        __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, g0), _mm_shuffle_epi8(v1, g1)),
+                                 _mm_shuffle_epi8(v2, g2));
+        __m128i b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, b0), _mm_shuffle_epi8(v1, b1)),
+                                 _mm_shuffle_epi8(v2, b2));
+        __m128i gray = image_bw_sse2_gray(r, g, b);
+        _mm_storeu_si128((__m128i*)p, _mm_shuffle_epi8(gray, out0));
+        _mm_storeu_si128((__m128i*)(p + 16), _mm_shuffle_epi8(gray, out1));
+        _mm_storeu_si128((__m128i*)(p + 32), _mm_shuffle_epi8(gray, out2));
+    }
+    image_bw_rgb_scalar(row + j * 3, width - j);
+}
+
+/* Grayscale of 32 pixels held in three vectors of bytes. Unpacking and packing both work
+ * within 128-bit lanes, so the pixels come out in the order they went in.
+*/
+__attribute__((target("avx2")))
+static inline __m256i image_bw_avx2_gray(__m256i r, __m256i g, __m256i b) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i weightsRG = _mm256_set1_epi32(IMAGE_BW_RED | (IMAGE_BW_GREEN << 16));
+    const __m256i weightsB = _mm256_set1_epi32(IMAGE_BW_BLUE);
+    __m256i half[2];
+    for (int h = 0; h < 2; h++) {
+        __m256i r16 = h == 0 ? _mm256_unpacklo_epi8(r, zero) : _mm256_unpackhi_epi8(r, zero);
+        __m256i g16 = h == 0 ? _mm256_unpacklo_epi8(g, zero) : _mm256_unpackhi_epi8(g, zero);
+        __m256i b16 = h == 0 ? _mm256_unpacklo_epi8(b, zero) : _mm256_unpackhi_epi8(b, zero);
+        __m256i lo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(r16, g16), weightsRG),
+                                      _mm256_madd_epi16(_mm256_unpacklo_epi16(b16, zero), weightsB));
+        __m256i hi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(r16, g16), weightsRG),
+                                      _mm256_madd_epi16(_mm256_unpackhi_epi16(b16, zero), weightsB));
+        half[h] = _mm256_packs_epi32(_mm256_srli_epi32(lo, IMAGE_BW_SHIFT), _mm256_srli_epi32(hi, IMAGE_BW_SHIFT));
+    }
+    return _mm256_packus_epi16(half[0], half[1]);
+}
+
+/* Converts one row of planes to grayscale, 32 pixels at a time with AVX2. */
+__attribute__((target("avx2")))
+static void image_bw_planes_avx2(unsigned char* red, unsigned char* green, unsigned char* blue, int width) {
+    int j = 0;
+    for (; j + 32 <= width; j += 32) {
+        __m256i gray = image_bw_avx2_gray(_mm256_loadu_si256((const __m256i*)(red + j)),
+                                          _mm256_loadu_si256((const __m256i*)(green + j)),
+                                          _mm256_loadu_si256((const __m256i*)(blue + j)));
+        _mm256_storeu_si256((__m256i*)(red + j), gray);
+        _mm256_storeu_si256((__m256i*)(green + j), gray);
+        _mm256_storeu_si256((__m256i*)(blue + j), gray);
+    }
+    image_bw_planes_sse2(red + j, green + j, blue + j, width - j);
+}
+
+/* Converts one BGRX row to grayscale, 8 pixels per vector with AVX2, as in SSE2. */
+__attribute__((target("avx2")))
+static void image_bw_bgrx_avx2(unsigned char* row, int width) {
+    const __m256i lowBytes = _mm256_set1_epi32(0x00FF00FF);
+    const __m256i unused = _mm256_set1_epi32((int)0xFF000000);
+    const __m256i weightsBR = _mm256_set1_epi32(IMAGE_BW_BLUE | (IMAGE_BW_RED << 16));
+    const __m256i weightsG = _mm256_set1_epi32(IMAGE_BW_GREEN);
+    int j = 0;
+    for (; j + 8 <= width; j += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(row + j * 4));
+        __m256i sum = _mm256_add_epi32(_mm256_madd_epi16(_mm256_and_si256(v, lowBytes), weightsBR),
+                                       _mm256_madd_epi16(_mm256_and_si256(_mm256_srli_epi32(v, 8), lowBytes),
+                                                         weightsG));
+        __m256i gray = _mm256_srli_epi32(sum, IMAGE_BW_SHIFT);
+        gray = _mm256_or_si256(gray, _mm256_or_si256(_mm256_slli_epi32(gray, 8), _mm256_slli_epi32(gray, 16)));
+        _mm256_storeu_si256((__m256i*)(row + j * 4), _mm256_or_si256(gray, _mm256_and_si256(v, unused)));
+    }
+    image_bw_bgrx_sse2(row + j * 4, width - j);
+}
+
+/* Converts one row of planes to grayscale, 64 pixels at a time with AVX-512BW. */
+__attribute__((target("avx512bw")))
+static void image_bw_planes_avx512(unsigned char* red, unsigned char* green, unsigned char* blue, int width) {
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i weightsRG = _mm512_set1_epi32(IMAGE_BW_RED | (IMAGE_BW_GREEN << 16));
+    const __m512i weightsB = _mm512_set1_epi32(IMAGE_BW_BLUE);
+    int j = 0;
+    for (; j + 64 <= width; j += 64) {
+        __m512i r = _mm512_loadu_si512((const void*)(red + j));
+        __m512i g = _mm512_loadu_si512((const void*)(green + j));
+        __m512i b = _mm512_loadu_si512((const void*)(blue + j));
+        __m512i half[2];
+        for (int h = 0; h < 2; h++) {
+            __m512i r16 = h == 0 ? _mm512_unpacklo_epi8(r, zero) : _mm512_unpackhi_epi8(r, zero);
+            __m512i g16 = h == 0 ? _mm512_unpacklo_epi8(g, zero) : _mm512_unpackhi_epi8(g, zero);
+            __m512i b16 = h == 0 ? _mm512_unpacklo_epi8(b, zero) : _mm512_unpackhi_epi8(b, zero);
+            __m512i lo = _mm512_add_epi32(_mm512_madd_epi16(_mm512_unpacklo_epi16(r16, g16), weightsRG),
+                                          _mm512_madd_epi16(_mm512_unpacklo_epi16(b16, zero), weightsB));
+            __m512i hi = _mm512_add_epi32(_mm512_madd_epi16(_mm512_unpackhi_epi16(r16, g16), weightsRG),
+                                          _mm512_madd_epi16(_mm512_unpackhi_epi16(b16, zero), weightsB));
+            half[h] = _mm512_packs_epi32(_mm512_srli_epi32(lo, IMAGE_BW_SHIFT), _mm512_srli_epi32(hi, IMAGE_BW_SHIFT));
         }
+        __m512i gray = _mm512_packus_epi16(half[0], half[1]);
+        _mm512_storeu_si512((void*)(red + j), gray);
+        _mm512_storeu_si512((void*)(green + j), gray);
+        _mm512_storeu_si512((void*)(blue + j), gray);
+    }
+    image_bw_planes_avx2(red + j, green + j, blue + j, width - j);
+}
+
+/* Converts one BGRX row to grayscale, 16 pixels per vector with AVX-512BW, as in SSE2. */
+__attribute__((target("avx512bw")))
+static void image_bw_bgrx_avx512(unsigned char* row, int width) {
+    const __m512i lowBytes = _mm512_set1_epi32(0x00FF00FF);
+    const __m512i unused = _mm512_set1_epi32((int)0xFF000000);
+    const __m512i weightsBR = _mm512_set1_epi32(IMAGE_BW_BLUE | (IMAGE_BW_RED << 16));
+    const __m512i weightsG = _mm512_set1_epi32(IMAGE_BW_GREEN);
+    int j = 0;
+    for (; j + 16 <= width; j += 16) {
+        __m512i v = _mm512_loadu_si512((const void*)(row + j * 4));
+        __m512i sum = _mm512_add_epi32(_mm512_madd_epi16(_mm512_and_si512(v, lowBytes), weightsBR),
+                                       _mm512_madd_epi16(_mm512_and_si512(_mm512_srli_epi32(v, 8), lowBytes),
+                                                         weightsG));
+        __m512i gray = _mm512_srli_epi32(sum, IMAGE_BW_SHIFT);
+        gray = _mm512_or_si512(gray, _mm512_or_si512(_mm512_slli_epi32(gray, 8), _mm512_slli_epi32(gray, 16)));
+        _mm512_storeu_si512((void*)(row + j * 4), _mm512_or_si512(gray, _mm512_and_si512(v, unused)));
     }
+    image_bw_bgrx_avx2(row + j * 4, width - j);
+}
+#endif
+
+/* Bytes to add and to subtract at each position of a row for a color shift, one of the two
+ * always 0. 48 bytes hold a whole number of 1, 3 and 4 byte pixels and of 16 byte vectors,
+ * so the pattern lines up with every layout.
+*/
+struct Image_Shift {
+    unsigned char add[48];
+    unsigned char sub[48];
+};
+
+/* Fills a shift pattern from the shifts of one pixel, clamped to what a byte can move.
+*
+ * @param  pattern: the pattern to fill.
+ * @param  shifts: shift of each byte of one pixel.
+ * @param  period: bytes per pixel, 1, 3 or 4.
+*/
+static void image_shift_pattern(struct Image_Shift* pattern, const int* shifts, int period) {
+    for (int k = 0; k < 48; k++) {
+        int shift = shifts[k % period];
+        pattern->add[k] = shift > 0 ? (shift > 255 ? 255 : shift) : 0;
+        pattern->sub[k] = shift < 0 ? (shift < -255 ? 255 : -shift) : 0;
+    }
+}
+
+/* Adds a shift pattern to the bytes of one row, clamped to 0..255. This is the reference
+ * the vector version matches.
+*
+ * @param  row: first byte of the row.
+ * @param  bytes: number of bytes in the row.
+ * @param  pattern: the shift pattern, starting at the first byte.
+*/
+static void image_shift_row_scalar(unsigned char* row, size_t bytes, const struct Image_Shift* pattern) {
+    for (size_t k = 0; k < bytes; k += 48) {
+        size_t count = bytes - k < 48 ? bytes - k : 48;
+        for (size_t m = 0; m < count; m++) {
+            int afterShift = row[k + m] + pattern->add[m] - pattern->sub[m];
+
+            if (afterShift < 0) {
+                row[k + m] = 0;
+            } else if (afterShift > 255) {
+                row[k + m] = 255;
+            } else {
+                row[k + m] = afterShift;
+            }
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Adds a shift pattern to the bytes of one row with saturating byte adds and subtracts,
+ * 48 bytes at a time with SSE2.
+*/
+__attribute__((target("sse2")))
+static void image_shift_row_sse2(unsigned char* row, size_t bytes, const struct Image_Shift* pattern) {
+    __m128i add[3], sub[3];
+    for (int v = 0; v < 3; v++) {
+        add[v] = _mm_loadu_si128((const __m128i*)(pattern->add + v * 16));
+        sub[v] = _mm_loadu_si128((const __m128i*)(pattern->sub + v * 16));
+    }
+    size_t k = 0;
+    for (; k + 48 <= bytes; k += 48) {
+        for (int v = 0; v < 3; v++) {
+            __m128i* p = (__m128i*)(row + k + v * 16);
+            _mm_storeu_si128(p, _mm_subs_epu8(_mm_adds_epu8(_mm_loadu_si128(p), add[v]), sub[v]));
+        }
+    }
+    image_shift_row_scalar(row + k, bytes - k, pattern);
+}
+#endif
+
+/* Grayscale and color shift kernels, picked once for the CPU the program runs on. */
+static void (*image_bw_planes)(unsigned char*, unsigned char*, unsigned char*, int) = image_bw_planes_scalar;
+static void (*image_bw_rgb)(unsigned char*, int) = image_bw_rgb_scalar;
+static void (*image_bw_bgrx)(unsigned char*, int) = image_bw_bgrx_scalar;
+static void (*image_shift_row)(unsigned char*, size_t, const struct Image_Shift*) = image_shift_row_scalar;
+static pthread_once_t image_kernels_once = PTHREAD_ONCE_INIT;
+
+/* Picks the widest kernels the CPU supports. */
+static void image_kernels_select(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        image_bw_planes = image_bw_planes_sse2;
+        image_bw_bgrx = image_bw_bgrx_sse2;
+        image_shift_row = image_shift_row_sse2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        image_bw_rgb = image_bw_rgb_ssse3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        image_bw_planes = image_bw_planes_avx2;
+        image_bw_bgrx = image_bw_bgrx_avx2;
+    }
+    if (__builtin_cpu_supports("avx512bw")) {
+        image_bw_planes = image_bw_planes_avx512;
+        image_bw_bgrx = image_bw_bgrx_avx512;
+    }
+#endif
+}
+
+/* Converts one row of the image to grayscale with the kernel for its layout.
+*
+ * @param  img: the image.
+ * @param  row: index of the row.
+*/
+static void image_bw_image_row(Image* img, int row) {
+    switch (img->layout) {
+        case IMAGE_LAYOUT_PLANAR:
+            image_bw_planes(image_get_plane_row(img, IMAGE_RED, row), image_get_plane_row(img, IMAGE_GREEN, row),
+                            image_get_plane_row(img, IMAGE_BLUE, row), img->width);
+            break;
+        case IMAGE_LAYOUT_BGRX:
+            image_bw_bgrx(image_get_bgrx_row(img, row), img->width);
+            break;
+        default:
+            image_bw_rgb((unsigned char*)img->pArr[row], img->width);
+    }
+}
+
+/* Fills the shift patterns for the layout of the image: one per plane, or one for the
+ * interleaved channels of a packed row.
+*
+ * @param  img: the image.
+ * @param  shifts: shift of red, green and blue.
+ * @param  patterns: the three patterns to fill.
+*/
+static void image_shift_patterns(Image* img, const int* shifts, struct Image_Shift* patterns) {
+    if (img->layout == IMAGE_LAYOUT_PLANAR) {
+        for (int c = 0; c < 3; c++) {
+            image_shift_pattern(&patterns[c], &shifts[c], 1);
+        }
+    } else if (img->layout == IMAGE_LAYOUT_BGRX) {
+        int bgrx[4] = {shifts[IMAGE_BLUE], shifts[IMAGE_GREEN], shifts[IMAGE_RED], 0};
+        image_shift_pattern(&patterns[0], bgrx, 4);
+    } else {
+        image_shift_pattern(&patterns[0], shifts, 3);
+    }
+}
+
+/* Shifts one row of the image with the patterns from image_shift_patterns.
+*
+ * @param  img: the image.
+ * @param  row: index of the row.
+ * @param  patterns: the patterns for the layout of the image.
+*/
+static void image_shift_image_row(Image* img, int row, const struct Image_Shift* patterns) {
+    switch (img->layout) {
+        case IMAGE_LAYOUT_PLANAR:
+            for (int c = 0; c < 3; c++) {
+                image_shift_row(image_get_plane_row(img, c, row), img->width, &patterns[c]);
+            }
+            break;
+        case IMAGE_LAYOUT_BGRX:
+            image_shift_row(image_get_bgrx_row(img, row), (size_t)img->width * 4, &patterns[0]);
+            break;
+        default:
+            image_shift_row((unsigned char*)img->pArr[row], (size_t)img->width * 3, &patterns[0]);
+    }
+}
+
+/* Fewest rows a thread is handed at once by the row filters. */
+#define IMAGE_PARALLEL_ROWS 16
+
+/* Converts rows [first, last) of the image to grayscale, one chunk of image_apply_bw. */
+static int image_bw_rows(void* arg, int first, int last) {
+    Image* img = (Image*)arg;
+    for (int i = first; i < last; i++) {
+        image_bw_image_row(img, i);
+    }
+    return 0;
+}
+
+/* Converts the image to grayscale, the rows split over the thread pool.
+*
+ * @param  img: the image.
+*/
+void image_apply_bw(Image* img) {
+    pthread_once(&image_kernels_once, image_kernels_select);
+
+    parallelFor(img->height, parallelGrain(img->height, 4, IMAGE_PARALLEL_ROWS), image_bw_rows, img);
+}
+
+/* A color shift in progress, shared by the threads working on it. */
+struct Image_Colorshift {
+    Image* img;
+    int grayscale;
+    struct Image_Shift patterns[3];
+};
+
+/* Shifts rows [first, last) of the image, one chunk of image_apply_colorshift. */
+static int image_colorshift_rows(void* arg, int first, int last) {
+    struct Image_Colorshift* shift = (struct Image_Colorshift*)arg;
+    for (int i = first; i < last; i++) {
+        if (shift->grayscale) {
+            image_bw_image_row(shift->img, i);
+        }
+        image_shift_image_row(shift->img, i, shift->patterns);
+    }
+    return 0;
 }
 
 /**
  * Shift color of the internal Pixel array. The dimension of the array is width * height.
  * The shift value of RGB is rShift, gShift，bShift. Useful for color shift.
+ * Each row is converted to grayscale first if asked, then shifted while it is still in cache,
+ * so the image is read and written once. The rows are split over the thread pool.
+ * Works in any layout, fastest in IMAGE_COLORSHIFT_LAYOUT.
  *
  * @param  img: the image.
  * @param  rShift: the shift value of color r shift
  * @param  gShift: the shift value of color g shift
  * @param  bShift: the shift value of color b shift
+ * @param  grayscale: 1 to convert to grayscale before shifting, 0 to shift the colors as they are
  */
-void image_apply_colorshift(Image* img, int rShift, int gShift, int bShift) {
-    // apply Grayscale filter
-    image_apply_bw(img);
+void image_apply_colorshift(Image* img, int rShift, int gShift, int bShift, int grayscale) {
+    pthread_once(&image_kernels_once, image_kernels_select);
 
-    for (int i = 0; i < img->height; i++) {
-        for (int j = 0; j < img->width; j++) {
-            // blue color shift
-            int afterShift = img->pArr[i][j].blue + bShift;
+    int shifts[3] = {rShift, gShift, bShift};
+    struct Image_Colorshift shift;
+    shift.img = img;
+    shift.grayscale = grayscale;
+    image_shift_patterns(img, shifts, shift.patterns);
 
-            if (afterShift < 0) {
-                img->pArr[i][j].blue = 0;
-            } else if (afterShift > 255) {
-                img->pArr[i][j].blue = 255;
-            } else {
-                img->pArr[i][j].blue = afterShift;
-            }
+    parallelFor(img->height, parallelGrain(img->height, 4, IMAGE_PARALLEL_ROWS), image_colorshift_rows, &shift);
+}
+
+/* Returns 1 if a table leaves every value as it is. */
+static int image_table_is_identity(const unsigned char* table) {
+    for (int v = 0; v < 256; v++) {
+        if (table[v] != v) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-            // green color shift
-            afterShift = img->pArr[i][j].green + gShift;
+/* Returns 1 if a table adds a constant to every value, clamped to 0..255, and sets the shift.
+ * Such tables run through the vector shift kernel instead of a lookup per byte.
+*
+ * @param  table: the table.
+ * @param  shift: set to the constant added.
+*/
+static int image_table_is_shift(const unsigned char* table, int* shift) {
+    *shift = table[0] > 0 ? table[0] : table[255] - 255;
+    for (int v = 0; v < 256; v++) {
+        int afterShift = v + *shift;
+        if (table[v] != (afterShift < 0 ? 0 : afterShift > 255 ? 255 : afterShift)) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-            if (afterShift < 0) {
-                img->pArr[i][j].green = 0;
-            } else if (afterShift > 255) {
-                img->pArr[i][j].green = 255;
-            } else {
-                img->pArr[i][j].green = afterShift;
+/* Sets a table of each channel to leave every value as it is. */
+static void image_tables_identity(unsigned char tables[3][256]) {
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++) {
+            tables[c][v] = v;
+        }
+    }
+}
+
+/* Returns 1 if the tables of all three channels leave every value as it is. */
+static int image_tables_are_identity(const unsigned char tables[3][256]) {
+    return image_table_is_identity(tables[0]) && image_table_is_identity(tables[1]) &&
+           image_table_is_identity(tables[2]);
+}
+
+/* Returns 1 if a matrix is the grayscale conversion, which has vector kernels. */
+static int image_matrix_is_bw(const int matrix[3][3]) {
+    for (int c = 0; c < 3; c++) {
+        if (matrix[c][0] != IMAGE_BW_RED || matrix[c][1] != IMAGE_BW_GREEN || matrix[c][2] != IMAGE_BW_BLUE) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Starts a new stage that changes nothing. Returns it, NULL if the chain is full. */
+static struct Image_Stage* image_ops_new_stage(struct Image_Ops* ops) {
+    if (ops->count == IMAGE_OPS_STAGES) {
+        return NULL;
+    }
+    struct Image_Stage* stage = &ops->stage[ops->count++];
+    image_tables_identity(stage->pre);
+    image_tables_identity(stage->post);
+    stage->mix = 0;
+    return stage;
+}
+
+/**
+ * Empties a chain of point operations.
+ *
+ * @param  ops: the chain.
+ */
+void image_ops_init(struct Image_Ops* ops) {
+    ops->count = 0;
+}
+
+/**
+ * Appends a table per channel to a chain of point operations. The tables are folded into the
+ * last table of the chain, so any number of them costs one lookup per byte.
+ *
+ * @param  ops: the chain.
+ * @param  tables: new value of each value of red, green and blue.
+ * @return 0 on success, -1 if the chain has no room for another stage.
+ */
+int image_ops_table(struct Image_Ops* ops, const unsigned char tables[3][256]) {
+    struct Image_Stage* stage = ops->count > 0 ? &ops->stage[ops->count - 1] : image_ops_new_stage(ops);
+    if (stage == NULL) {
+        return -1;
+    }
+    unsigned char (*last)[256] = stage->mix ? stage->post : stage->pre;
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++) {
+            last[c][v] = tables[c][last[c][v]];
+        }
+    }
+    return 0;
+}
+
+/**
+ * Appends a 3x3 matrix mixing the channels to a chain of point operations. Output channel c is
+ * the sum of matrix[c][k] times input channel k, in 2.14 fixed point, clamped to 0..255.
+ *
+ * @param  ops: the chain.
+ * @param  matrix: weights of red, green and blue in each output channel.
+ * @return 0 on success, -1 if the chain has no room for another stage.
+ */
+int image_ops_matrix(struct Image_Ops* ops, const int matrix[3][3]) {
+    struct Image_Stage* stage = ops->count > 0 ? &ops->stage[ops->count - 1] : NULL;
+    if (stage != NULL && stage->mix && image_tables_are_identity(stage->post) &&
+        image_matrix_is_bw(stage->matrix) && image_matrix_is_bw(matrix)) {
+        // the grayscale of a gray pixel is the same pixel
+        return 0;
+    }
+    if (stage == NULL || stage->mix) {
+        stage = image_ops_new_stage(ops);
+        if (stage == NULL) {
+            return -1;
+        }
+    }
+    stage->mix = 1;
+    memcpy(stage->matrix, matrix, sizeof(stage->matrix));
+    return 0;
+}
+
+/**
+ * Appends a grayscale conversion to a chain of point operations, the same as image_apply_bw.
+ *
+ * @param  ops: the chain.
+ * @return 0 on success, -1 if the chain has no room for another stage.
+ */
+int image_ops_grayscale(struct Image_Ops* ops) {
+    const int matrix[3][3] = {{IMAGE_BW_RED, IMAGE_BW_GREEN, IMAGE_BW_BLUE},
+                              {IMAGE_BW_RED, IMAGE_BW_GREEN, IMAGE_BW_BLUE},
+                              {IMAGE_BW_RED, IMAGE_BW_GREEN, IMAGE_BW_BLUE}};
+    return image_ops_matrix(ops, matrix);
+}
+
+/**
+ * Appends a color shift to a chain of point operations, the same as image_apply_colorshift
+ * without grayscale. The swiss cheese tint is a shift of blue by -100.
+ *
+ * @param  ops: the chain.
+ * @param  rShift: the shift value of color r shift
+ * @param  gShift: the shift value of color g shift
+ * @param  bShift: the shift value of color b shift
+ * @return 0 on success, -1 if the chain has no room for another stage.
+ */
+int image_ops_shift(struct Image_Ops* ops, int rShift, int gShift, int bShift) {
+    int shifts[3] = {rShift, gShift, bShift};
+    unsigned char tables[3][256];
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++) {
+            int afterShift = v + shifts[c];
+            tables[c][v] = afterShift < 0 ? 0 : afterShift > 255 ? 255 : afterShift;
+        }
+    }
+    return image_ops_table(ops, tables);
+}
+
+/**
+ * Appends a gamma correction to a chain of point operations. Each value v becomes
+ * 255 * (v / 255)^(1 / gamma), so a gamma above 1 brightens the image.
+ *
+ * @param  ops: the chain.
+ * @param  gamma: the gamma, greater than 0.
+ * @return 0 on success, -1 if the chain has no room for another stage.
+ */
+int image_ops_gamma(struct Image_Ops* ops, double gamma) {
+    unsigned char tables[3][256];
+    for (int v = 0; v < 256; v++) {
+        int value = (int)(255.0 * pow(v / 255.0, 1.0 / gamma) + 0.5);
+        tables[0][v] = tables[1][v] = tables[2][v] = value > 255 ? 255 : value;
+    }
+    return image_ops_table(ops, tables);
+}
+
+/**
+ * Appends an inversion of every channel to a chain of point operations.
+ *
+ * @param  ops: the chain.
+ * @return 0 on success, -1 if the chain has no room for another stage.
+ */
+int image_ops_invert(struct Image_Ops* ops) {
+    unsigned char tables[3][256];
+    for (int v = 0; v < 256; v++) {
+        tables[0][v] = tables[1][v] = tables[2][v] = 255 - v;
+    }
+    return image_ops_table(ops, tables);
+}
+
+/**
+ * Appends a threshold to a chain of point operations. Pixels whose grayscale value is at least
+ * level become white, all others black.
+ *
+ * @param  ops: the chain.
+ * @param  level: the threshold, 0..255.
+ * @return 0 on success, -1 if the chain has no room for another stage.
+ */
+int image_ops_threshold(struct Image_Ops* ops, int level) {
+    unsigned char tables[3][256];
+    for (int v = 0; v < 256; v++) {
+        tables[0][v] = tables[1][v] = tables[2][v] = v >= level ? 255 : 0;
+    }
+    if (image_ops_grayscale(ops) != 0) {
+        return -1;
+    }
+    return image_ops_table(ops, tables);
+}
+
+/* How one set of tables of a stage runs: skipped, as a shift or as lookups. */
+#define IMAGE_TABLES_SKIP   0
+#define IMAGE_TABLES_SHIFT  1
+#define IMAGE_TABLES_LOOKUP 2
+
+/* Picks how a set of tables runs on the image, filling the shift patterns if they are shifts. */
+static int image_tables_kind(Image* img, const unsigned char tables[3][256], struct Image_Shift* patterns) {
+    int shifts[3];
+    for (int c = 0; c < 3; c++) {
+        if (!image_table_is_shift(tables[c], &shifts[c])) {
+            return IMAGE_TABLES_LOOKUP;
+        }
+    }
+    if (shifts[0] == 0 && shifts[1] == 0 && shifts[2] == 0) {
+        return IMAGE_TABLES_SKIP;
+    }
+    image_shift_patterns(img, shifts, patterns);
+    return IMAGE_TABLES_SHIFT;
+}
+
+/* Runs a set of tables over one row of the image.
+*
+ * @param  img: the image.
+ * @param  row: index of the row.
+ * @param  tables: the table of each channel.
+ * @param  kind: IMAGE_TABLES_* from image_tables_kind.
+ * @param  patterns: the shift patterns from image_tables_kind.
+*/
+static void image_tables_image_row(Image* img, int row, const unsigned char tables[3][256], int kind,
+                                   const struct Image_Shift* patterns) {
+    if (kind == IMAGE_TABLES_SHIFT) {
+        image_shift_image_row(img, row, patterns);
+    } else if (kind == IMAGE_TABLES_LOOKUP) {
+        for (int c = 0; c < 3; c++) {
+            int step;
+            unsigned char* channel = image_channel_row(img, c, row, &step);
+            for (int j = 0; j < img->width; j++) {
+                channel[j * step] = tables[c][channel[j * step]];
             }
+        }
+    }
+}
 
-            // red color shift
-            afterShift = img->pArr[i][j].red + rShift;
+/* Mixes the channels of one row of the image through a 3x3 matrix in 2.14 fixed point. */
+static void image_matrix_image_row(Image* img, int row, const int matrix[3][3]) {
+    int step;
+    unsigned char* channel[3];
+    for (int c = 0; c < 3; c++) {
+        channel[c] = image_channel_row(img, c, row, &step);
+    }
+    for (int j = 0; j < img->width; j++) {
+        int in[3] = {channel[0][j * step], channel[1][j * step], channel[2][j * step]};
+        for (int c = 0; c < 3; c++) {
+            int value = (matrix[c][0] * in[0] + matrix[c][1] * in[1] + matrix[c][2] * in[2]) >> IMAGE_BW_SHIFT;
+            channel[c][j * step] = value < 0 ? 0 : value > 255 ? 255 : value;
+        }
+    }
+}
 
-            if (afterShift < 0) {
-                img->pArr[i][j].red = 0;
-            } else if (afterShift > 255) {
-                img->pArr[i][j].red = 255;
-            } else {
-                img->pArr[i][j].red = afterShift;
+/* A chain of point operations in progress, with how each part of each stage runs on the layout. */
+struct Image_Ops_Run {
+    Image* img;
+    const struct Image_Ops* ops;
+    Image_Row_Source source;        /* fills each row before the stages run, NULL if it holds pixels */
+    void* sourceArg;
+    int preKind[IMAGE_OPS_STAGES];
+    int postKind[IMAGE_OPS_STAGES];
+    int bw[IMAGE_OPS_STAGES];
+    struct Image_Shift prePatterns[IMAGE_OPS_STAGES][3];
+    struct Image_Shift postPatterns[IMAGE_OPS_STAGES][3];
+};
+
+/* Runs rows [first, last) of the image through every stage, one chunk of image_apply_ops. */
+static int image_ops_rows(void* arg, int first, int last) {
+    struct Image_Ops_Run* run = (struct Image_Ops_Run*)arg;
+    Image* img = run->img;
+    for (int i = first; i < last; i++) {
+        if (run->source != NULL) {
+            run->source(run->sourceArg, img->pArr[i], i);
+        }
+        for (int s = 0; s < run->ops->count; s++) {
+            const struct Image_Stage* stage = &run->ops->stage[s];
+            image_tables_image_row(img, i, stage->pre, run->preKind[s], run->prePatterns[s]);
+            if (run->bw[s]) {
+                image_bw_image_row(img, i);
+            } else if (stage->mix) {
+                image_matrix_image_row(img, i, stage->matrix);
             }
+            image_tables_image_row(img, i, stage->post, run->postKind[s], run->postPatterns[s]);
         }
     }
+    return 0;
+}
 
+/**
+ * Applies a chain of point operations to the image. Each row runs through every stage while
+ * it is still in cache, so the image is read and written once whatever the chain holds.
+ * The rows are split over the thread pool.
+ * Tables that are plain shifts and the grayscale matrix use the vector kernels.
+ * Works in any layout.
+ *
+ * @param  img: the image.
+ * @param  ops: the chain, from image_ops_init and the image_ops_* functions.
+ */
+void image_apply_ops(Image* img, const struct Image_Ops* ops) {
+    image_apply_ops_from(img, ops, NULL, NULL);
+}
+
+/**
+ * Fills the image row by row from source and runs each row through a chain of point
+ * operations right after it is filled, while it is still in cache. The pixels are written
+ * once, with no separate pass to decode them first. The rows are split over the thread pool,
+ * so source is called for different rows at the same time.
+ *
+ * @param  img: the image, in IMAGE_LAYOUT_RGB.
+ * @param  ops: the chain, from image_ops_init and the image_ops_* functions.
+ * @param  source: fills one row.
+ * @param  arg: passed to source.
+ */
+void image_apply_ops_from(Image* img, const struct Image_Ops* ops, Image_Row_Source source, void* arg) {
+    pthread_once(&image_kernels_once, image_kernels_select);
+
+    // how each part of each stage runs on this layout
+    struct Image_Ops_Run run;
+    run.img = img;
+    run.ops = ops;
+    run.source = source;
+    run.sourceArg = arg;
+    for (int s = 0; s < ops->count; s++) {
+        const struct Image_Stage* stage = &ops->stage[s];
+        run.preKind[s] = image_tables_kind(img, stage->pre, run.prePatterns[s]);
+        run.postKind[s] = stage->mix ? image_tables_kind(img, stage->post, run.postPatterns[s]) : IMAGE_TABLES_SKIP;
+        run.bw[s] = stage->mix && image_matrix_is_bw(stage->matrix);
+    }
+
+    parallelFor(img->height, parallelGrain(img->height, 4, IMAGE_PARALLEL_ROWS), image_ops_rows, &run);
+}
 
+/* A nearest neighbour resize in progress, shared by the threads working on it. */
+struct Image_Resize {
+    Image* img;
+    struct Pixel** newPixels;
+    const int* columns;     /* source column of each output column */
+    float factor;
+    int newWidth;
+};
 
+/* Fills output rows [first, last) of a nearest neighbour resize. */
+static int image_resize_rows(void* arg, int first, int last) {
+    struct Image_Resize* resize = (struct Image_Resize*)arg;
+    for (int i = first; i < last; i++) {
+        const struct Pixel* src = resize->img->pArr[(int)(i / resize->factor)];
+        struct Pixel* dst = resize->newPixels[i];
+        for (int j = 0; j < resize->newWidth; j++) {
+            dst[j] = src[resize->columns[j]];
+        }
+    }
+    return 0;
 }
 
-/* Converts the image to grayscale. If the scaling factor is less than 1 the new image will be
- * smaller, if it is larger than 1, the new image will be larger.
+/* Resizes the image with nearest neighbour sampling. If the scaling factor is less than 1 the
+ * new image will be smaller, if it is larger than 1, the new image will be larger.
+ * The source pixel of each output row and column is looked up once, and the pixels are
+ * written to a new block, so the source is never overwritten while it is still read.
+ * The output rows are split over the thread pool.
  *
  * @param  img: the image.
  * @param  factor: the scaling factor
 */
 void image_apply_resize(Image* img, float factor) {
-    int newWidth = img->width * factor;
-    int newHeight = img->height * factor;
-
     // verify the factor is greater than 0
     if (factor <= 0) {
         printf("Please try enter a factor greater than 0.\n");
         return;
     }
 
-    // when factor is smaller than 1, overwriting original array
-    if (factor <= 1 && factor > 0) {
-        for (int i = 0; i < newHeight; i++) {
-            for (int j = 0; j < newWidth; j++) {
-                int heightFactor = i / factor;
-                int widthFactor = j / factor;
-                img->pArr[i][j].blue =  img->pArr[heightFactor][widthFactor].blue;
-                img->pArr[i][j].green = img->pArr[heightFactor][widthFactor].green;
-                img->pArr[i][j].red = img->pArr[heightFactor][widthFactor].red;
+    // works on the packed pixel array
+    if (image_set_layout(img, IMAGE_RESIZE_LAYOUT) != 0) {
+        printf("Not enough memory to resize the image.\n");
+        return;
+    }
+
+    int newWidth = img->width * factor;
+    int newHeight = img->height * factor;
+
+    unsigned char* newData;
+    size_t newSize, newStride;
+    struct Pixel** newPixels = image_alloc_rows(newWidth, newHeight, &newData, &newSize, &newStride);
+    int* columns = (int*)malloc(sizeof(int) * (newWidth > 0 ? newWidth : 1));
+    if (newPixels == NULL || columns == NULL) {
+        if (newPixels != NULL) {
+            image_pool_free(newData, newSize);
+        }
+        free(columns);
+        printf("Not enough memory to resize the image.\n");
+        return;
+    }
+
+    // source column of each output column
+    for (int j = 0; j < newWidth; j++) {
+        columns[j] = j / factor;
+    }
+    // store pixel info into new array
+    struct Image_Resize resize;
+    resize.img = img;
+    resize.newPixels = newPixels;
+    resize.columns = columns;
+    resize.factor = factor;
+    resize.newWidth = newWidth;
+    parallelFor(newHeight, parallelGrain(newHeight, 4, IMAGE_PARALLEL_ROWS), image_resize_rows, &resize);
+    free(columns);
+
+    // the image owns the new pixels and returns the old ones
+    image_pool_free(img->data, img->data_size);
+    img->pArr = newPixels;
+    img->data = newData;
+    img->data_size = newSize;
+    img->stride = newStride;
+
+    // update width and height
+    img->width = newWidth;
+    img->height = newHeight;
+}
+
+/* Resampling weights are 2.14 fixed point, like the grayscale weights. */
+#define IMAGE_RESAMPLE_SHIFT 14
+#define IMAGE_RESAMPLE_ONE   (1 << IMAGE_RESAMPLE_SHIFT)
+
+/* Fewest rows a thread is handed at once by a resample pass. */
+#define IMAGE_RESAMPLE_MIN_ROWS 64
+
+/* Weights of the source pixels that make up each output pixel along one axis. */
+struct Image_Coefficients {
+    int taps;           /* weights per output pixel, even, unused ones are 0 */
+    int* start;         /* first source pixel of each output pixel */
+    short* weights;     /* taps weights of each output pixel, 2.14 fixed point, adding up to 1.0 */
+};
+
+/* A resample in progress, shared by the threads working on it. */
+struct Image_Resample {
+    Image* src;
+    Image* mid;         /* source rows resampled horizontally, src itself if the width is kept */
+    Image* dst;
+    struct Image_Coefficients horizontal;
+    struct Image_Coefficients vertical;
+};
+
+/* One pass of a resample, its rows split over the thread pool. */
+struct Image_Resample_Job {
+    struct Image_Resample* resample;
+    int pass;           /* 0 horizontal, 1 vertical */
+};
+
+/* Returns how far from its center a filter reaches, in source pixels at scale 1. */
+static double image_filter_support(int filter) {
+    switch (filter) {
+        case IMAGE_RESAMPLE_BILINEAR:
+            return 1.0;
+        case IMAGE_RESAMPLE_BICUBIC:
+            return 2.0;
+        case IMAGE_RESAMPLE_LANCZOS3:
+            return 3.0;
+        default:
+            return 0.5;
+    }
+}
+
+/* Returns the weight of a filter at distance x from its center. */
+static double image_filter_weight(int filter, double x) {
+    const double pi = 3.14159265358979323846;
+    const double a = -0.5; // bicubic sharpness, Keys' choice that matches the slope of the data
+    x = fabs(x);
+    switch (filter) {
+        case IMAGE_RESAMPLE_BILINEAR:
+            return x < 1.0 ? 1.0 - x : 0.0;
+        case IMAGE_RESAMPLE_BICUBIC:
+            if (x < 1.0) {
+                return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+            }
+            if (x < 2.0) {
+                return ((a * x - 5.0 * a) * x + 8.0 * a) * x - 4.0 * a;
+            }
+            return 0.0;
+        case IMAGE_RESAMPLE_LANCZOS3:
+            if (x == 0.0) {
+                return 1.0;
+            }
+            if (x < 3.0) {
+                return 3.0 * sin(pi * x) * sin(pi * x / 3.0) / (pi * pi * x * x);
             }
+            return 0.0;
+        default:
+            return x <= 0.5 ? 1.0 : 0.0;
+    }
+}
+
+/* Computes the weights of every output pixel along one axis. When shrinking, the filter is
+ * stretched over all the source pixels that fall into an output pixel, so none are skipped,
+ * except nearest, which takes the one source pixel under the center at every scale.
+ * Source pixels outside the image are left out and the others weighted up to make 1.0.
+*
+ * @param  co: the coefficients to fill, free with image_coefficients_free.
+ * @param  srcLength: source pixels along the axis.
+ * @param  dstLength: output pixels along the axis.
+ * @param  filter: IMAGE_RESAMPLE_*.
+ * @return 0 on success, -1 if the memory can not be allocated.
+*/
+static int image_coefficients(struct Image_Coefficients* co, int srcLength, int dstLength, int filter) {
+    double scale = (double)srcLength / dstLength;
+    double filterScale = scale > 1.0 && filter != IMAGE_RESAMPLE_NEAREST ? scale : 1.0;
+    double support = image_filter_support(filter) * filterScale;
+
+    // widest window of source pixels, rounded up to pairs for the vector kernels
+    co->taps = 2;
+    for (int x = 0; x < dstLength; x++) {
+        double center = (x + 0.5) * scale;
+        int first = (int)floor(center - support + 0.5);
+        int last = (int)floor(center + support + 0.5);
+        int window = (last < srcLength ? last : srcLength) - (first > 0 ? first : 0);
+        if (window > co->taps) {
+            co->taps = (window + 1) & ~1;
         }
     }
+    co->start = (int*)malloc(sizeof(int) * dstLength);
+    co->weights = (short*)calloc((size_t)dstLength * co->taps, sizeof(short));
+    double* weights = (double*)malloc(sizeof(double) * co->taps);
+    if (co->start == NULL || co->weights == NULL || weights == NULL) {
+        free(co->start);
+        free(co->weights);
+        free(weights);
+        return -1;
+    }
 
-    // if factor is greater than 1
-    if (factor > 1) {
-        // allocate more
-        struct Pixel** newPixels = (struct Pixel**)malloc(sizeof(struct Pixel*) * newHeight);
-        for (int p = 0; p < newHeight; p++) {
-            newPixels[p] = (struct Pixel*)malloc(sizeof(struct Pixel) * newWidth);
+    for (int x = 0; x < dstLength; x++) {
+        double center = (x + 0.5) * scale;
+        int first = (int)floor(center - support + 0.5);
+        int last = (int)floor(center + support + 0.5);
+        if (first < 0) {
+            first = 0;
+        }
+        if (last > srcLength) {
+            last = srcLength;
         }
-        // store pixel info into new array
-        for (int i = 0; i < newHeight; i++) {
-            for (int j = 0; j < newWidth; j++) {
-                int heightFactor = i / factor;
-                int widthFactor = j / factor;
-                newPixels[i][j].blue =  img->pArr[heightFactor][widthFactor].blue;
-                newPixels[i][j].green = img->pArr[heightFactor][widthFactor].green;
-                newPixels[i][j].red = img->pArr[heightFactor][widthFactor].red;
+
+        double total = 0.0;
+        for (int k = 0; k < last - first; k++) {
+            weights[k] = image_filter_weight(filter, (first + k + 0.5 - center) / filterScale);
+            total += weights[k];
+        }
+
+        // round to fixed point, the rounding error goes to the largest weight so they add up to 1.0
+        short* fixed = co->weights + (size_t)x * co->taps;
+        int sum = 0, largest = 0;
+        for (int k = 0; k < last - first; k++) {
+            fixed[k] = (short)lround(total != 0.0 ? weights[k] / total * IMAGE_RESAMPLE_ONE : 0.0);
+            sum += fixed[k];
+            if (fixed[k] > fixed[largest]) {
+                largest = k;
             }
         }
-        // update array pointer
-        img->pArr = newPixels;
+        fixed[largest] += IMAGE_RESAMPLE_ONE - sum;
+        co->start[x] = first;
     }
 
-    // update width and height
-    img->width = newWidth;
-    img->height = newHeight;
+    free(weights);
+    return 0;
+}
+
+/* Frees the tables of image_coefficients. */
+static void image_coefficients_free(struct Image_Coefficients* co) {
+    free(co->start);
+    free(co->weights);
+}
+
+/* Rounds a 2.14 fixed point sum to a byte, clamped to 0..255. */
+static inline unsigned char image_resample_clamp(int sum) {
+    sum = (sum + (IMAGE_RESAMPLE_ONE >> 1)) >> IMAGE_RESAMPLE_SHIFT;
+    return sum < 0 ? 0 : sum > 255 ? 255 : sum;
+}
+
+/* Resamples one row horizontally. This is the reference the vector version matches.
+*
+ * @param  src: the source pixels, red, green, blue and an unused byte each, followed by
+ *              co->taps zero pixels so every tap can be read.
+ * @param  dst: the output row.
+ * @param  width: output pixels.
+ * @param  co: the horizontal coefficients.
+*/
+static void image_resample_row_scalar(const unsigned char* src, unsigned char* dst, int width,
+                                      const struct Image_Coefficients* co) {
+    for (int x = 0; x < width; x++) {
+        const unsigned char* p = src + (size_t)co->start[x] * 4;
+        const short* w = co->weights + (size_t)x * co->taps;
+        int red = 0, green = 0, blue = 0;
+        for (int k = 0; k < co->taps; k++) {
+            red += w[k] * p[k * 4];
+            green += w[k] * p[k * 4 + 1];
+            blue += w[k] * p[k * 4 + 2];
+        }
+        dst[x * 3] = image_resample_clamp(red);
+        dst[x * 3 + 1] = image_resample_clamp(green);
+        dst[x * 3 + 2] = image_resample_clamp(blue);
+    }
+}
+
+/* Resamples bytes [first, bytes) of one output row vertically.
+*
+ * @param  rows: the source row of each tap.
+ * @param  dst: the output row.
+ * @param  first: first byte to resample.
+ * @param  bytes: bytes in a row.
+ * @param  w: the weight of each tap.
+ * @param  taps: number of taps.
+*/
+static void image_resample_column_range(const unsigned char** rows, unsigned char* dst, size_t first,
+                                        size_t bytes, const short* w, int taps) {
+    for (size_t b = first; b < bytes; b++) {
+        int sum = 0;
+        for (int k = 0; k < taps; k++) {
+            sum += w[k] * rows[k][b];
+        }
+        dst[b] = image_resample_clamp(sum);
+    }
+}
+
+/* Resamples one output row vertically. This is the reference the vector version matches.
+*
+ * @param  rows: the source row of each tap.
+ * @param  dst: the output row.
+ * @param  bytes: bytes in a row.
+ * @param  w: the weight of each tap.
+ * @param  taps: number of taps.
+*/
+static void image_resample_column_scalar(const unsigned char** rows, unsigned char* dst, size_t bytes,
+                                         const short* w, int taps) {
+    image_resample_column_range(rows, dst, 0, bytes, w, taps);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Returns the weights of taps k and k + 1 as one 32-bit lane for _mm_madd_epi16. */
+static inline int image_resample_pair(const short* w) {
+    int pair;
+    memcpy(&pair, w, sizeof(pair));
+    return pair;
+}
+
+/* Resamples one row horizontally with SSE2. The channels of two neighbouring source pixels
+ * are interleaved so one multiply-add weighs both.
+*/
+__attribute__((target("sse2")))
+static void image_resample_row_sse2(const unsigned char* src, unsigned char* dst, int width,
+                                    const struct Image_Coefficients* co) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(IMAGE_RESAMPLE_ONE >> 1);
+    for (int x = 0; x < width; x++) {
+        const unsigned char* p = src + (size_t)co->start[x] * 4;
+        const short* w = co->weights + (size_t)x * co->taps;
+        __m128i sum = round;
+        for (int k = 0; k < co->taps; k += 2) {
+            // red0 green0 blue0 x0 red1 green1 blue1 x1 as 16-bit, then red0 red1 green0 green1 ...
+            __m128i pixels = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(p + k * 4)), zero);
+            pixels = _mm_unpacklo_epi16(pixels, _mm_srli_si128(pixels, 8));
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(pixels, _mm_set1_epi32(image_resample_pair(w + k))));
+        }
+        sum = _mm_srai_epi32(sum, IMAGE_RESAMPLE_SHIFT);
+        sum = _mm_packus_epi16(_mm_packs_epi32(sum, sum), zero);
+        int rgbx = _mm_cvtsi128_si32(sum);
+        memcpy(dst + x * 3, &rgbx, 3);
+    }
+}
+
+/* Resamples one output row vertically with SSE2, 16 bytes at a time. Bytes of two source
+ * rows are interleaved so one multiply-add weighs both.
+*/
+__attribute__((target("sse2")))
+static void image_resample_column_sse2(const unsigned char** rows, unsigned char* dst, size_t bytes,
+                                       const short* w, int taps) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(IMAGE_RESAMPLE_ONE >> 1);
+    size_t b = 0;
+    for (; b + 16 <= bytes; b += 16) {
+        __m128i sum0 = round, sum1 = round, sum2 = round, sum3 = round;
+        for (int k = 0; k < taps; k += 2) {
+            __m128i weights = _mm_set1_epi32(image_resample_pair(w + k));
+            __m128i a = _mm_loadu_si128((const __m128i*)(rows[k] + b));
+            __m128i c = _mm_loadu_si128((const __m128i*)(rows[k + 1] + b));
+            __m128i lo = _mm_unpacklo_epi8(a, c);
+            __m128i hi = _mm_unpackhi_epi8(a, c);
+            sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), weights));
+            sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), weights));
+            sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), weights));
+            sum3 = _mm_add_epi32(sum3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), weights));
+        }
+        __m128i lo = _mm_packs_epi32(_mm_srai_epi32(sum0, IMAGE_RESAMPLE_SHIFT), _mm_srai_epi32(sum1, IMAGE_RESAMPLE_SHIFT));
+        __m128i hi = _mm_packs_epi32(_mm_srai_epi32(sum2, IMAGE_RESAMPLE_SHIFT), _mm_srai_epi32(sum3, IMAGE_RESAMPLE_SHIFT));
+        _mm_storeu_si128((__m128i*)(dst + b), _mm_packus_epi16(lo, hi));
+    }
+    image_resample_column_range(rows, dst, b, bytes, w, taps);
+}
+#endif
+
+/* Resampling kernels, picked once for the CPU the program runs on. */
+static void (*image_resample_row)(const unsigned char*, unsigned char*, int,
+                                  const struct Image_Coefficients*) = image_resample_row_scalar;
+static void (*image_resample_column)(const unsigned char**, unsigned char*, size_t,
+                                     const short*, int) = image_resample_column_scalar;
+static pthread_once_t image_resample_once = PTHREAD_ONCE_INIT;
+
+/* Picks the widest resampling kernels the CPU supports. */
+static void image_resample_select(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        image_resample_row = image_resample_row_sse2;
+        image_resample_column = image_resample_column_sse2;
+    }
+#endif
+}
+
+/* Runs rows [first, last) of one pass of a resample. */
+static int image_resample_rows(void* arg, int first, int last) {
+    struct Image_Resample_Job* job = (struct Image_Resample_Job*)arg;
+    struct Image_Resample* r = job->resample;
+
+    if (job->pass == 0) {
+        // each source row is spread to 4 bytes a pixel, with zero pixels behind it for the last taps
+        int srcWidth = r->src->width;
+        unsigned char* spread = (unsigned char*)calloc((size_t)srcWidth + r->horizontal.taps, 4);
+        if (spread == NULL) {
+            return -1;
+        }
+        for (int i = first; i < last; i++) {
+            const struct Pixel* src = r->src->pArr[i];
+            for (int j = 0; j < srcWidth; j++) {
+                spread[j * 4] = src[j].red;
+                spread[j * 4 + 1] = src[j].green;
+                spread[j * 4 + 2] = src[j].blue;
+            }
+            image_resample_row(spread, (unsigned char*)r->mid->pArr[i], r->mid->width, &r->horizontal);
+        }
+        free(spread);
+    } else {
+        // the source row of each tap, as many as the shrink ratio needs
+        int taps = r->vertical.taps;
+        const unsigned char** rows = (const unsigned char**)malloc(sizeof(const unsigned char*) * taps);
+        if (rows == NULL) {
+            return -1;
+        }
+        for (int i = first; i < last; i++) {
+            // taps past the last row have weight 0, point them at the last row
+            for (int k = 0; k < taps; k++) {
+                int row = r->vertical.start[i] + k;
+                rows[k] = (const unsigned char*)r->mid->pArr[row < r->mid->height ? row : r->mid->height - 1];
+            }
+            image_resample_column(rows, (unsigned char*)r->dst->pArr[i], (size_t)r->dst->width * 3,
+                                  r->vertical.weights + (size_t)i * taps, taps);
+        }
+        free(rows);
+    }
+    return 0;
+}
+
+/* Splits the rows of one pass of a resample over the thread pool.
+*
+ * @param  r: the resample.
+ * @param  pass: 0 horizontal, 1 vertical.
+ * @param  rows: rows the pass produces.
+ * @return 0 on success, -1 if the memory of a thread can not be allocated.
+*/
+static int image_resample_pass(struct Image_Resample* r, int pass, int rows) {
+    struct Image_Resample_Job job;
+    job.resample = r;
+    job.pass = pass;
+    return parallelFor(rows, parallelGrain(rows, 1, IMAGE_RESAMPLE_MIN_ROWS), image_resample_rows, &job);
+}
+
+/**
+ * Resamples an image to a new size with a filter, into a new image. The image is resampled
+ * horizontally and then vertically with fixed point weights computed once per row and
+ * column, and the rows of each pass are split over threads. The source keeps its pixels,
+ * so several sizes can be made from one image. Converts it to IMAGE_RESIZE_LAYOUT first.
+ *
+ * @param  img: the image to resample.
+ * @param  width: width of the new image, at least 1.
+ * @param  height: height of the new image, at least 1.
+ * @param  filter: IMAGE_RESAMPLE_NEAREST, _BILINEAR, _BICUBIC or _LANCZOS3.
+ * @return The new image, NULL if the memory can not be allocated.
+ */
+Image* image_resample(Image* img, int width, int height, int filter) {
+    pthread_once(&image_resample_once, image_resample_select);
+    if (image_set_layout(img, IMAGE_RESIZE_LAYOUT) != 0) {
+        return NULL;
+    }
+
+    struct Image_Resample r;
+    r.src = img;
+    r.dst = image_new(width, height);
+    // a kept width needs no horizontal pass, the weights would all be 1.0
+    r.mid = width == img->width ? img : image_new(width, img->height);
+    int ready = r.dst != NULL && r.mid != NULL;
+    int horizontal = ready && r.mid != img && image_coefficients(&r.horizontal, img->width, width, filter) == 0;
+    int vertical = ready && image_coefficients(&r.vertical, img->height, height, filter) == 0;
+
+    int result = -1;
+    if (ready && (horizontal || r.mid == img) && vertical) {
+        result = r.mid == img ? 0 : image_resample_pass(&r, 0, img->height);
+        if (result == 0) {
+            result = image_resample_pass(&r, 1, height);
+        }
+    }
+
+    if (horizontal) {
+        image_coefficients_free(&r.horizontal);
+    }
+    if (vertical) {
+        image_coefficients_free(&r.vertical);
+    }
+    if (r.mid != NULL && r.mid != img) {
+        image_destroy(&r.mid);
+    }
+    if (result != 0 && r.dst != NULL) {
+        image_destroy(&r.dst);
+    }
+    return r.dst;
+}
+
+/**
+ * Resizes the image to a new size with a filter. The new pixels are made with image_resample
+ * and then replace the old ones, which go back to the buffer pool.
+ *
+ * @param  img: the image.
+ * @param  width: width of the resized image, at least 1.
+ * @param  height: height of the resized image, at least 1.
+ * @param  filter: IMAGE_RESAMPLE_NEAREST, _BILINEAR, _BICUBIC or _LANCZOS3.
+ * @return 0 on success, -1 if the memory can not be allocated.
+ */
+int image_apply_resample(Image* img, int width, int height, int filter) {
+    Image* resampled = image_resample(img, width, height, filter);
+    if (resampled == NULL) {
+        return -1;
+    }
+
+    // take over the new pixels, hand the old ones to the shell that is destroyed
+    struct Pixel** pArr = img->pArr;
+    unsigned char* data = img->data;
+    size_t dataSize = img->data_size;
+    size_t stride = img->stride;
+    img->pArr = resampled->pArr;
+    img->data = resampled->data;
+    img->data_size = resampled->data_size;
+    img->stride = resampled->stride;
+    img->width = resampled->width;
+    img->height = resampled->height;
+    resampled->pArr = pArr;
+    resampled->data = data;
+    resampled->data_size = dataSize;
+    resampled->stride = stride;
+    image_destroy(&resampled);
+    return 0;
 }
\ No newline at end of file
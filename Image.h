@@ -16,10 +16,38 @@
 ////////////////////////////////////////////////////////////////////////////////
 typedef struct Image Image;
 
+/* Layouts the pixel values of an image can be held in */
+#define IMAGE_LAYOUT_RGB    0   /* packed struct Pixel rows, reached through pArr */
+#define IMAGE_LAYOUT_PLANAR 1   /* one plane of bytes per channel: red, green, blue */
+#define IMAGE_LAYOUT_BGRX   2   /* 4 bytes per pixel: blue, green, red, unused */
+
+/* Channels of a planar image */
+#define IMAGE_RED   0
+#define IMAGE_GREEN 1
+#define IMAGE_BLUE  2
+
+/* Layout each filter runs fastest on. Every filter accepts any layout and converts only if it must. */
+#define IMAGE_BW_LAYOUT         IMAGE_LAYOUT_PLANAR
+#define IMAGE_COLORSHIFT_LAYOUT IMAGE_LAYOUT_RGB
+#define IMAGE_RESIZE_LAYOUT     IMAGE_LAYOUT_RGB
+
+/* Filters of image_resample */
+#define IMAGE_RESAMPLE_NEAREST  0   /* the source pixel under the center of each output pixel, at any scale */
+#define IMAGE_RESAMPLE_BILINEAR 1   /* triangle, 2 source pixels wide when enlarging */
+#define IMAGE_RESAMPLE_BICUBIC  2   /* Keys cubic with a = -0.5, 4 source pixels wide */
+#define IMAGE_RESAMPLE_LANCZOS3 3   /* windowed sinc, 6 source pixels wide */
+
 struct Image {
     struct Pixel** pArr;
     int width;
     int height;
+    unsigned char* data;    /* row pointers and rows in one pooled 64-byte aligned block, NULL if pArr is borrowed */
+    size_t data_size;       /* bytes allocated for data */
+    size_t stride;          /* bytes from the start of one row to the next in data */
+    int layout;             /* IMAGE_LAYOUT_* the pixel values are currently held in */
+    unsigned char* alt;     /* 64-byte aligned planar or BGRX pixels, NULL until first needed */
+    size_t alt_size;        /* bytes allocated for alt */
+    size_t alt_stride;      /* bytes from one row to the next in alt, within a plane if planar */
 };
 
 struct Pixel{
@@ -28,6 +56,39 @@ struct Pixel{
     unsigned char blue;
 };
 
+/* A rectangle of an image's pixels that shares the image's memory, for cropping and tiling
+ * without copies. Only valid while the image is alive and holds packed RGB pixels.
+*/
+struct Image_View {
+    struct Pixel* origin;   /* top-left pixel of the view, row 0 */
+    int width;
+    int height;
+    size_t stride;          /* bytes from the start of one row to the next */
+};
+
+/* Most stages a chain of point operations compiles to. Tables and matrices fold into the
+ * current stage, a new one starts when the channels of a stage that already mixes are mixed again.
+*/
+#define IMAGE_OPS_STAGES 8
+
+/* One stage of a chain of point operations: a table per channel, then optionally a matrix
+ * mixing the channels and another table per channel. */
+struct Image_Stage {
+    unsigned char pre[3][256];  /* new value of each value, per channel IMAGE_RED... */
+    int mix;                    /* 1 if the matrix and the post tables follow */
+    int matrix[3][3];           /* weight of each input channel in each output channel, 2.14 fixed point */
+    unsigned char post[3][256]; /* new value of each mixed value, per channel */
+};
+
+/* A chain of per-pixel operations compiled into stages, applied in one pass by image_apply_ops. */
+struct Image_Ops {
+    int count;                  /* stages in use */
+    struct Image_Stage stage[IMAGE_OPS_STAGES];
+};
+
+/* Fills one row of an image, row 0 at the bottom, with pixels decoded from elsewhere. */
+typedef void (*Image_Row_Source)(void* arg, struct Pixel* dst, int row);
+
 ////////////////////////////////////////////////////////////////////////////////
 //Function Declarations
 
@@ -40,14 +101,32 @@ struct Pixel{
 */
 Image* image_create(struct Pixel** pArr, int width, int height);
 
+/** Creates a new image that owns its pixels. All rows live in one 64-byte aligned
+ * allocation, each row starts on a 64-byte boundary, stride bytes after the previous one.
+ * The pixels are not initialised.
+*
+ * @param  width: Width of this image.
+ * @param  height: Height of this image.
+ * @return A pointer to a new image, NULL if the memory can not be allocated.
+*/
+Image* image_new(int width, int height);
+
 
-/** Destroys an image. Does not deallocate internal pixel array.
+/** Destroys an image. Pixels the image owns (image_new) go back to the buffer pool,
+ * the pixel array given to image_create is not deallocated.
 *
  * @param  img: the image to destroy.
 */
 void image_destroy(Image** img);
 
-/** Returns a double pointer to the pixel array.
+/** Frees every pixel buffer the pool keeps for reuse. Destroyed images hand their buffers
+ * to the pool so the next image of a similar size needs no allocation; call this once the
+ * last image is done.
+*/
+void image_pool_release(void);
+
+/** Returns a double pointer to the pixel array. Only holds the current pixel values
+ * while the layout is IMAGE_LAYOUT_RGB, see image_set_layout.
 *
  * @param  img: the image.
 */
@@ -65,7 +144,79 @@ int image_get_width(Image* img);
 */
 int image_get_height(Image* img);
 
-/** Converts the image to grayscale.
+/** Returns a pointer to the first pixel of a row.
+*
+ * @param  img: the image.
+ * @param  row: index of the row.
+*/
+struct Pixel* image_get_row(Image* img, int row);
+
+/** Returns the number of bytes from the start of one row to the next,
+ * 0 if the rows were given to image_create and are not evenly spaced.
+*
+ * @param  img: the image.
+*/
+size_t image_get_stride(Image* img);
+
+/** Returns a view of a rectangle of an image. The image must own its pixels (image_new)
+ * and the rectangle must lie inside it.
+*
+ * @param  img: the image.
+ * @param  x: first column of the rectangle.
+ * @param  y: first row of the rectangle.
+ * @param  width: width of the rectangle.
+ * @param  height: height of the rectangle.
+*/
+struct Image_View image_get_view(Image* img, int x, int y, int width, int height);
+
+/** Returns a view of a rectangle of another view, which must lie inside it.
+*
+ * @param  view: the view.
+ * @param  x: first column of the rectangle.
+ * @param  y: first row of the rectangle.
+ * @param  width: width of the rectangle.
+ * @param  height: height of the rectangle.
+*/
+struct Image_View image_view_sub(const struct Image_View* view, int x, int y, int width, int height);
+
+/** Returns a pointer to the first pixel of a row of a view.
+*
+ * @param  view: the view.
+ * @param  row: index of the row.
+*/
+struct Pixel* image_view_row(const struct Image_View* view, int row);
+
+/** Returns the layout the pixel values are currently held in, one of IMAGE_LAYOUT_*.
+*
+ * @param  img: the image.
+*/
+int image_get_layout(Image* img);
+
+/** Converts the pixel values to another layout. Converting back to IMAGE_LAYOUT_RGB
+ * writes them into the pixel array again, which must be done before the image is written.
+*
+ * @param  img: the image.
+ * @param  layout: one of IMAGE_LAYOUT_*.
+ * @return 0 on success, -1 if the memory for the layout can not be allocated.
+*/
+int image_set_layout(Image* img, int layout);
+
+/** Returns the bytes of one channel of one row of an image in IMAGE_LAYOUT_PLANAR.
+*
+ * @param  img: the image.
+ * @param  channel: IMAGE_RED, IMAGE_GREEN or IMAGE_BLUE.
+ * @param  row: index of the row.
+*/
+unsigned char* image_get_plane_row(Image* img, int channel, int row);
+
+/** Returns the first byte of one row of an image in IMAGE_LAYOUT_BGRX.
+*
+ * @param  img: the image.
+ * @param  row: index of the row.
+*/
+unsigned char* image_get_bgrx_row(Image* img, int row);
+
+/** Converts the image to grayscale. Works in any layout, fastest in IMAGE_BW_LAYOUT.
 *
  * @param  img: the image.
 */
@@ -74,20 +225,151 @@ void image_apply_bw(Image* img);
 /**
  * Shift color of the internal Pixel array. The dimension of the array is width * height.
  * The shift value of RGB is rShift, gShift，bShift. Useful for color shift.
+ * Each row is converted to grayscale first if asked, then shifted while it is still in cache,
+ * so the image is read and written once. The rows are split over the thread pool.
+ * Works in any layout, fastest in IMAGE_COLORSHIFT_LAYOUT.
  *
  * @param  img: the image.
  * @param  rShift: the shift value of color r shift
  * @param  gShift: the shift value of color g shift
  * @param  bShift: the shift value of color b shift
+ * @param  grayscale: 1 to convert to grayscale before shifting, 0 to shift the colors as they are
+ */
+void image_apply_colorshift(Image* img, int rShift, int gShift, int bShift, int grayscale);
+
+/**
+ * Empties a chain of point operations.
+ *
+ * @param  ops: the chain.
+ */
+void image_ops_init(struct Image_Ops* ops);
+
+/**
+ * Appends a table per channel to a chain of point operations. The tables are folded into the
+ * last table of the chain, so any number of them costs one lookup per byte.
+ *
+ * @param  ops: the chain.
+ * @param  tables: new value of each value of red, green and blue.
+ * @return 0 on success, -1 if the chain has no room for another stage.
+ */
+int image_ops_table(struct Image_Ops* ops, const unsigned char tables[3][256]);
+
+/**
+ * Appends a 3x3 matrix mixing the channels to a chain of point operations. Output channel c is
+ * the sum of matrix[c][k] times input channel k, in 2.14 fixed point, clamped to 0..255.
+ *
+ * @param  ops: the chain.
+ * @param  matrix: weights of red, green and blue in each output channel.
+ * @return 0 on success, -1 if the chain has no room for another stage.
+ */
+int image_ops_matrix(struct Image_Ops* ops, const int matrix[3][3]);
+
+/**
+ * Appends a grayscale conversion to a chain of point operations, the same as image_apply_bw.
+ *
+ * @param  ops: the chain.
+ * @return 0 on success, -1 if the chain has no room for another stage.
+ */
+int image_ops_grayscale(struct Image_Ops* ops);
+
+/**
+ * Appends a color shift to a chain of point operations, the same as image_apply_colorshift
+ * without grayscale. The swiss cheese tint is a shift of blue by -100.
+ *
+ * @param  ops: the chain.
+ * @param  rShift: the shift value of color r shift
+ * @param  gShift: the shift value of color g shift
+ * @param  bShift: the shift value of color b shift
+ * @return 0 on success, -1 if the chain has no room for another stage.
  */
-void image_apply_colorshift(Image* img, int rShift, int gShift, int bShift);
+int image_ops_shift(struct Image_Ops* ops, int rShift, int gShift, int bShift);
 
-/** Converts the image to grayscale. If the scaling factor is less than 1 the new image will be
- * smaller, if it is larger than 1, the new image will be larger.
+/**
+ * Appends a gamma correction to a chain of point operations. Each value v becomes
+ * 255 * (v / 255)^(1 / gamma), so a gamma above 1 brightens the image.
+ *
+ * @param  ops: the chain.
+ * @param  gamma: the gamma, greater than 0.
+ * @return 0 on success, -1 if the chain has no room for another stage.
+ */
+int image_ops_gamma(struct Image_Ops* ops, double gamma);
+
+/**
+ * Appends an inversion of every channel to a chain of point operations.
+ *
+ * @param  ops: the chain.
+ * @return 0 on success, -1 if the chain has no room for another stage.
+ */
+int image_ops_invert(struct Image_Ops* ops);
+
+/**
+ * Appends a threshold to a chain of point operations. Pixels whose grayscale value is at least
+ * level become white, all others black.
+ *
+ * @param  ops: the chain.
+ * @param  level: the threshold, 0..255.
+ * @return 0 on success, -1 if the chain has no room for another stage.
+ */
+int image_ops_threshold(struct Image_Ops* ops, int level);
+
+/**
+ * Applies a chain of point operations to the image. Each row runs through every stage while
+ * it is still in cache, so the image is read and written once whatever the chain holds.
+ * The rows are split over the thread pool.
+ * Tables that are plain shifts and the grayscale matrix use the vector kernels.
+ * Works in any layout.
+ *
+ * @param  img: the image.
+ * @param  ops: the chain, from image_ops_init and the image_ops_* functions.
+ */
+void image_apply_ops(Image* img, const struct Image_Ops* ops);
+
+/**
+ * Fills the image row by row from source and runs each row through a chain of point
+ * operations right after it is filled, while it is still in cache. The pixels are written
+ * once, with no separate pass to decode them first. The rows are split over the thread pool,
+ * so source is called for different rows at the same time.
+ *
+ * @param  img: the image, in IMAGE_LAYOUT_RGB.
+ * @param  ops: the chain, from image_ops_init and the image_ops_* functions.
+ * @param  source: fills one row.
+ * @param  arg: passed to source.
+ */
+void image_apply_ops_from(Image* img, const struct Image_Ops* ops, Image_Row_Source source, void* arg);
+
+/** Resizes the image with nearest neighbour sampling. If the scaling factor is less than 1 the
+ * new image will be smaller, if it is larger than 1, the new image will be larger.
+ * Converts the image to IMAGE_RESIZE_LAYOUT first.
  *
  * @param  img: the image.
  * @param  factor: the scaling factor
 */
 void image_apply_resize(Image* img, float factor);
 
+/**
+ * Resamples an image to a new size with a filter, into a new image. The image is resampled
+ * horizontally and then vertically with fixed point weights computed once per row and
+ * column, and the rows of each pass are split over threads. The source keeps its pixels,
+ * so several sizes can be made from one image. Converts it to IMAGE_RESIZE_LAYOUT first.
+ *
+ * @param  img: the image to resample.
+ * @param  width: width of the new image, at least 1.
+ * @param  height: height of the new image, at least 1.
+ * @param  filter: IMAGE_RESAMPLE_NEAREST, _BILINEAR, _BICUBIC or _LANCZOS3.
+ * @return The new image, NULL if the memory can not be allocated.
+ */
+Image* image_resample(Image* img, int width, int height, int filter);
+
+/**
+ * Resizes the image to a new size with a filter. The new pixels are made with image_resample
+ * and then replace the old ones, which go back to the buffer pool.
+ *
+ * @param  img: the image.
+ * @param  width: width of the resized image, at least 1.
+ * @param  height: height of the resized image, at least 1.
+ * @param  filter: IMAGE_RESAMPLE_NEAREST, _BILINEAR, _BICUBIC or _LANCZOS3.
+ * @return 0 on success, -1 if the memory can not be allocated.
+ */
+int image_apply_resample(Image* img, int width, int height, int filter);
+
 #endif
\ No newline at end of file
@@ -6,11 +6,18 @@
  * 3. Scaling Filter
  *
  * @author Sheldon Pang
- * @version 1.1
+ * @version 1.2
  *
  * Update info:
  * In version 1.1: fixed image offset issue.
  * Now will skip bytes based on the image offset value, and update the output file's offset value accordingly.
+ * In version 1.2: more than one input file can be given, the next file is read and the previous
+ * one written in the background while the current one is filtered.
+ * In version 1.3: gamma, invert and threshold filters. All per-pixel filters are compiled into
+ * one chain of tables and matrices that runs over the image in a single pass.
+ * In version 1.4: -q picks a bilinear, bicubic or lanczos filter for the resize.
+ * In version 1.5: the filters split their rows over one pool of threads started once per run.
+ * In version 1.6: threads that run out of rows steal from the others, -T prints each thread's busy time.
 */
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -20,161 +27,674 @@
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
 #include "BMPHandler.h"
 #include "Image.h"
-
+#include "AsyncIO.h"
+#include "ThreadPool.h"
+
+// filters picked on the command line, applied to every input image
+struct Filter_Options {
+    int grayscale;
+    int red_shift;
+    int green_shift;
+    int blue_shift;
+    float scale;
+    int resample_filter;        // IMAGE_RESAMPLE_*, nearest keeps the original resize
+    int rle_output;
+    float gamma;                // 1 means no gamma correction
+    int invert;
+    int threshold;              // -1 means no threshold
+    struct Image_Ops point_ops; // the per-pixel filters above compiled into one chain
+};
+
+// number of threads probing files in parallel with -p
+#define PROBE_THREADS 8
+
+// what -p reports for one file
+struct Probe_Record {
+    int result;             // 0 ok, -1 can not be opened, -2 not a supported BMP
+    int width;
+    int height;             // as stored in the header, negative for top-down files
+    int bits_per_pixel;
+    int compression;
+    int size;               // file size given by the BMP header
+};
+
+// files shared by the probe threads, each thread claims the next batch of indices
+struct Probe_Work {
+    char **filenames;
+    struct Probe_Record *records;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 // Forward Declaration
 void usage(void);
 void process_args(int ac, char *av[], char **output_filename, int *grayscale,
-                  char **input_file, float *scale,
-                  int *red_shift, int *green_shift, int *blue_shift);
+                  char **input_file, float *scale, int *resample_filter,
+                  int *red_shift, int *green_shift, int *blue_shift,
+                  int *band_rows, int *rle_output, int *probe,
+                  float *gamma, int *invert, int *threshold, int *thread_stats);
+void compile_point_ops(struct Filter_Options *options);
+void print_file_error(const char *filename, int result);
+void print_thread_stats(void);
+void make_output_filename(char *buffer, size_t size, const char *output_filename, int index);
+int load_shrink(struct Filter_Options *options);
+int apply_filters(Image *img, struct Filter_Options *options, int full_width, int full_height,
+                  int point_ops_done);
+int finish_store(struct BMP_Store *store);
+int process_images(char **input_filenames, int count, char *output_filename, int first_index,
+                   struct Filter_Options *options);
+int process_bands(char *input_filename, char *output_filename, int band_rows,
+                  struct Filter_Options *options);
+char **read_filename_list(FILE *list, int *count);
+int probe_images(char **input_filenames, int count);
 
 ////////////////////////////////////////////////////////////////////////////////
 // MAIN
-// Note: command to compile in gcc 'gcc PangImageProcessor.c Image.c BMPHandler.c -o ImageProcessor'
+// Note: command to compile in gcc 'gcc PangImageProcessor.c Image.c BMPHandler.c AsyncIO.c ThreadPool.c -o ImageProcessor -pthread -lm'
 int main(int argc,char* argv[]) {
 
-    int grayscale = 0;
-    float scale = 1;
+    struct Filter_Options options = {.scale = 1, .resample_filter = IMAGE_RESAMPLE_NEAREST, .gamma = 1, .threshold = -1};
     char *input_filename = NULL;
     char *output_filename = "default_output.bmp"; // default name
-    int skipByOffSetValue = 0;
-
-    // default color shift value is 0
-    int red_shift = 0, green_shift = 0, blue_shift = 0;
+    int band_rows = 0; // 0 means the whole image is loaded at once
+    int probe = 0;
+    int thread_stats = 0;
 
     // call function to parse command line option
     process_args(argc,argv,
                  &output_filename,
-                 &grayscale,
+                 &options.grayscale,
                  &input_filename,
-                 &scale,
-                 &red_shift, &green_shift, & blue_shift);
+                 &options.scale, &options.resample_filter,
+                 &options.red_shift, &options.green_shift, &options.blue_shift,
+                 &band_rows, &options.rle_output, &probe,
+                 &options.gamma, &options.invert, &options.threshold, &thread_stats);
+
+    // -f file first, then any more file names left after the options
+    int input_count = 1 + argc - optind;
+    char **input_filenames = (char**)malloc(sizeof(char*) * input_count);
+    input_filenames[0] = input_filename;
+    for (int i = 1; i < input_count; i++) {
+        input_filenames[i] = argv[optind + i - 1];
+    }
+
+    // probe mode only reads headers and prints one record per file, nothing else
+    if (probe == 1) {
+        int from_stdin = input_count == 1 && strcmp(input_filename, "-") == 0;
+        if (from_stdin) {
+            // file names come one per line on stdin
+            free(input_filenames);
+            input_filenames = read_filename_list(stdin, &input_count);
+            if (input_filenames == NULL) {
+                printf("Not enough memory for the list of file names.\n");
+                return 1;
+            }
+        }
+        int probe_failures = probe_images(input_filenames, input_count);
+        for (int i = 0; from_stdin && i < input_count; i++) {
+            free(input_filenames[i]);
+        }
+        free(input_filenames);
+        return probe_failures == 0 ? 0 : 1;
+    }
 
     // printout user options
-    if (input_filename) {
-        printf("Input filename is: -f %s\n", input_filename);
+    for (int i = 0; i < input_count; i++) {
+        printf("Input filename is: -f %s\n", input_filenames[i]);
     }
-    if (grayscale == 1) {
+    if (options.grayscale == 1) {
         printf("Convert RGB to grayscale equivalent -w\n");
     }
-    if (red_shift) {
-        printf("Shifting color red by: -r %d\n", red_shift);
+    if (options.red_shift) {
+        printf("Shifting color red by: -r %d\n", options.red_shift);
+    }
+    if (options.green_shift) {
+        printf("Shifting color green by: -g %d\n", options.green_shift);
+    }
+    if (options.blue_shift) {
+        printf("Shifting color blue by: -b %d\n", options.blue_shift);
+    }
+    if (options.gamma != 1) {
+        printf("Gamma correct by: -G %f\n", options.gamma);
     }
-    if (green_shift) {
-        printf("Shifting color green by: -g %d\n", green_shift);
+    if (options.invert == 1) {
+        printf("Invert the colors -i\n");
     }
-    if (blue_shift) {
-        printf("Shifting color blue by: -b %d\n", blue_shift);
+    if (options.threshold >= 0) {
+        printf("Threshold the grayscale value at: -t %d\n", options.threshold);
     }
-    if (scale != 1 && scale > 0) {
-        printf("Resize the image by factor of -s %f\n", scale);
+    if (options.scale != 1 && options.scale > 0) {
+        printf("Resize the image by factor of -s %f\n", options.scale);
+    }
+    if (options.resample_filter != IMAGE_RESAMPLE_NEAREST) {
+        printf("Resize with the %s filter: -q\n", options.resample_filter == IMAGE_RESAMPLE_BILINEAR ? "bilinear" :
+               options.resample_filter == IMAGE_RESAMPLE_BICUBIC ? "bicubic" : "lanczos");
+    }
+    if (band_rows > 0) {
+        printf("Stream the image %d rows at a time: -l %d\n", band_rows, band_rows);
+    }
+    if (options.rle_output == 1) {
+        printf("Write RLE8 compressed output if possible -z\n");
     }
     printf("\n");
 
-/////////////////////////////////////////////////////////////////////////////////////
-//---------------------------------Reading Image-----------------------------------//
-/////////////////////////////////////////////////////////////////////////////////////
+    compile_point_ops(&options);
+    int failures = 0;
+
+    // point filters can run band by band, resize and RLE8 output need the whole image
+    if (band_rows > 0 && options.scale != 1) {
+        printf("Resize needs the whole image, ignoring -l\n");
+    } else if (band_rows > 0 && options.rle_output == 1) {
+        printf("RLE8 output needs the whole image, ignoring -l\n");
+    } else if (band_rows > 0) {
+        for (int i = 0; i < input_count; i++) {
+            char band_output[1024];
+            make_output_filename(band_output, sizeof(band_output), output_filename, i);
+
+            int band_result = process_bands(input_filenames[i], band_output, band_rows, &options);
+            if (band_result == -3) {
+                // compressed rows can not be read band by band
+                printf("Compressed input needs the whole image, ignoring -l\n");
+                failures += process_images(input_filenames + i, 1, output_filename, i, &options);
+            } else if (band_result == -4) {
+                printf("Could not read %s or write %s\n", input_filenames[i], band_output);
+                failures++;
+            } else if (band_result == -5) {
+                failures++;
+            } else if (band_result != 0) {
+                print_file_error(input_filenames[i], band_result);
+                failures++;
+            }
+        }
+        free(input_filenames);
+        image_pool_release();
+        if (thread_stats) {
+            print_thread_stats();
+        }
+        stopThreadPool();
+        if (failures == 0) {
+            printf("----------------------------------\n");
+            printf("   Image processed successfully\n");
+            printf("----------------------------------\n\n");
+        }
+        return failures == 0 ? 0 : 1;
+    }
 
-    struct BMP_Header BMP;
-    struct DIB_Header DIB;
+    failures = process_images(input_filenames, input_count, output_filename, 0, &options);
+    free(input_filenames);
+    image_pool_release(); // every image is written, drop the buffers kept for reuse
+    if (thread_stats) {
+        print_thread_stats();
+    }
+    stopThreadPool();
 
-    FILE* file_input;
+    if (failures == 0) {
+        printf("----------------------------------\n");
+        printf("   Image processed successfully\n");
+        printf("----------------------------------\n\n");
+    }
 
-    // check if file exists
-    if ((file_input = fopen(input_filename, "rb"))) {
-        fclose(file_input);
+    return failures == 0 ? 0 : 1;
+}
+
+// print the error box for a file that could not be read.
+// result is -1 if the file can not be opened, -2 if it is not a supported BMP.
+void print_file_error(const char *filename, int result)
+{
+    printf("----------------------------------------------------------------\n");
+    if (result == -1) {
+        printf("   File %s does not exist or not within the current folder.\n", filename);
     } else {
-        printf("----------------------------------------------------------------\n");
-        printf("   File %s does not exist or not within the current folder.\n", input_filename);
-        printf("----------------------------------------------------------------\n\n");
-        exit(1);
+        printf("   File %s is not a supported BMP image.\n", filename);
     }
+    printf("----------------------------------------------------------------\n\n");
+}
 
-    file_input = fopen(input_filename, "rb");
+// print how long each thread of the pool ran filter chunks. Busy times far apart mean
+// the work was split unevenly, thread 0 is the main thread.
+void print_thread_stats(void)
+{
+    struct Thread_Pool_Stats stats;
+    getThreadPoolStats(&stats);
+
+    double busy = 0;
+    printf("----------Thread busy time----------\n");
+    printf("thread   busy ms   share   chunks   steals\n");
+    for (int t = 0; t < stats.threads; t++) {
+        double share = stats.job_ms > 0 ? 100 * stats.busy_ms[t] / stats.job_ms : 0;
+        printf("%6d %9.1f %6.0f%% %8ld %8ld\n", t, stats.busy_ms[t], share, stats.chunks[t], stats.steals[t]);
+        busy += stats.busy_ms[t];
+    }
+    printf("parallel filters took %.1f ms, the threads were busy %.0f%% of it\n\n", stats.job_ms,
+           stats.job_ms > 0 ? 100 * busy / (stats.job_ms * stats.threads) : 0);
+}
 
+// name of the output file for the input at index: the -o name for the first input,
+// then the -o name with _1, _2 ... added before the extension.
+void make_output_filename(char *buffer, size_t size, const char *output_filename, int index)
+{
+    if (index == 0) {
+        snprintf(buffer, size, "%s", output_filename);
+        return;
+    }
+    const char *dot = strrchr(output_filename, '.');
+    int stem = dot ? (int)(dot - output_filename) : (int)strlen(output_filename);
+    snprintf(buffer, size, "%.*s_%d%s", stem, output_filename, index, dot ? dot : "");
+}
 
-    readBMPHeader(file_input, &BMP);
-    readDIBHeader(file_input, &DIB);
+// compile the per-pixel filters picked on the command line into one chain, in a fixed order:
+// grayscale, color shift, gamma, invert, threshold.
+// a color shift always works on the grayscale image.
+void compile_point_ops(struct Filter_Options *options)
+{
+    int shifting = options->red_shift != 0 || options->green_shift != 0 || options->blue_shift != 0;
 
-    // allocate memory for multi array
-    struct Pixel** pixels = (struct Pixel**)malloc(sizeof(struct Pixel*) * DIB.image_height);
-    for (int p = 0; p < DIB.image_height; p++) {
-        pixels[p] = (struct Pixel*)malloc(sizeof(struct Pixel) * DIB.image_width);
+    image_ops_init(&options->point_ops);
+    if (options->grayscale == 1 || shifting) {
+        image_ops_grayscale(&options->point_ops);
+    }
+    if (shifting) {
+        image_ops_shift(&options->point_ops, options->red_shift, options->green_shift, options->blue_shift);
     }
+    if (options->gamma != 1) {
+        image_ops_gamma(&options->point_ops, options->gamma);
+    }
+    if (options->invert == 1) {
+        image_ops_invert(&options->point_ops);
+    }
+    if (options->threshold >= 0) {
+        image_ops_threshold(&options->point_ops, options->threshold);
+    }
+}
 
-    printf("The image height is: %d width is: %d\n", DIB.image_height, DIB.image_width);
+// factor to shrink images by while they are decoded: the largest whole factor that still
+// leaves them at least as large as the resize makes them, 1 if they are not made smaller.
+// The decode averages the pixels it folds together, so below 0.5 even the nearest filter
+// only picks among those averages, see readPixelsShrunkMappedBMP.
+int load_shrink(struct Filter_Options *options)
+{
+    if (options->scale <= 0 || options->scale >= 0.5f) {
+        return 1;
+    }
+    return (int)(1 / options->scale);
+}
 
-    // readBMPHeader +  readDIBHeader is 54 byte
-    // skip additional info based on file offset value
-    skipByOffSetValue = BMP.offset_pixel_array - 54;
-    fseek(file_input, skipByOffSetValue, SEEK_CUR);
-    printf("The skipByOffSetValue is: %d\n", skipByOffSetValue);
+// apply the filters picked on the command line to one image.
+// full_width and full_height are the size of the image in its file, before any shrink on load.
+// point_ops_done is 1 if the per-pixel filters already ran while the image was decoded.
+// returns 0 on success, -1 if the image could not be resized for lack of memory.
+int apply_filters(Image *img, struct Filter_Options *options, int full_width, int full_height,
+                  int point_ops_done)
+{
+    // every per-pixel filter runs in one pass over the pixels
+    if (options->point_ops.count > 0 && !point_ops_done) {
+        image_apply_ops(img, &options->point_ops);
+    }
 
-    // store pixels info into array pixels
-    readPixelsBMP(file_input, pixels, DIB.image_width, DIB.image_height);
+    // resize will only trigger when factor is greater than 0 and not default 1
+    // an image shrunk on load is resampled the rest of the way to the size the full image would get
+    if (options->scale != 1 && options->scale > 0) {
+        int width = full_width * options->scale;
+        int height = full_height * options->scale;
+        if (options->resample_filter == IMAGE_RESAMPLE_NEAREST && image_get_width(img) == full_width &&
+            image_get_height(img) == full_height) {
+            image_apply_resize(img, options->scale);
+        } else if (image_apply_resample(img, width > 0 ? width : 1, height > 0 ? height : 1,
+                                        options->resample_filter) != 0) {
+            printf("Not enough memory to resize the image.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    // finished reading image and close file
-    fclose(file_input);
+// wait for a background write to finish and report how it went.
+// returns 1 if the file could not be written, 0 otherwise.
+int finish_store(struct BMP_Store *store)
+{
+    int store_result = waitStoreBMP(store);
+    if (store_result == -1) {
+        printf("Could not write %s\n", store->filename);
+        return 1;
+    }
+    if (store_result == 1) {
+        printf("Wrote RLE8 compressed output %s with %d colors, %d bytes of pixel data\n",
+               store->filename, store->dib.color_table, store->dib.image_size);
+    } else {
+        if (store->rle_output == 1) {
+            printf("The image has more than 256 colors or is too large to encode, writing 24-bit output\n");
+        }
+        printf("The update BMP offset value is: %d\n", store->bmp.offset_pixel_array);
+    }
+    return 0;
+}
+
+// read, filter and write each input image. While one image is filtered the next one is
+// read and the previous one written in the background.
+// first_index is the index of the first input, used to name the output files.
+// returns the number of images that could not be processed.
+int process_images(char **input_filenames, int count, char *output_filename, int first_index,
+                   struct Filter_Options *options)
+{
+    struct BMP_Load loads[2];
+    struct BMP_Store store;
+    char output_names[2][1024];
+    int storing = 0, failures = 0;
+    int shrink = load_shrink(options);
+    // with per-pixel filters, decode each row from the mapped file right before filtering it
+    int defer = options->point_ops.count > 0;
+
+/////////////////////////////////////////////////////////////////////////////////////
+//---------------------------------Reading Image-----------------------------------//
+/////////////////////////////////////////////////////////////////////////////////////
+    startLoadBMP(&loads[0], input_filenames[0], shrink, defer);
+
+    for (int i = 0; i < count; i++) {
+        struct BMP_Load *load = &loads[i % 2];
+        int load_result = waitLoadBMP(load);
+
+        // start reading the next file before working on this one
+        if (i + 1 < count) {
+            startLoadBMP(&loads[(i + 1) % 2], input_filenames[i + 1], shrink, defer);
+        }
+
+        if (load_result != 0) {
+            print_file_error(input_filenames[i], load_result);
+            failures++;
+            continue;
+        }
+
+        struct BMP_Header BMP = load->bmp;
+        struct DIB_Header DIB = load->dib;
+        printf("The image has %d bits per pixel\n", load->format.bits_per_pixel);
+        printf("The image height is: %d width is: %d\n", DIB.image_height, DIB.image_width);
+
+        // pixel array starts at the file offset value, extra info before it is skipped
+        int skipByOffSetValue = BMP.offset_pixel_array - 54;
+        printf("The skipByOffSetValue is: %d\n", skipByOffSetValue);
 
 /////////////////////////////////////////////////////////////////////////////////////
 //-------------------------------Image Manipulation--------------------------------//
 /////////////////////////////////////////////////////////////////////////////////////
-    Image* img = image_create(pixels, DIB.image_width, DIB.image_height);
+        int point_ops_done = finishLoadBMP(load, &options->point_ops);
+        Image* img = load->img;
+        load->img = NULL;
+        if (apply_filters(img, options, load->format.width, load->format.height, point_ops_done) != 0) {
+            image_destroy(&img);
+            failures++;
+            continue;
+        }
+
+        // the previous file must be written before its store can be reused
+        if (storing) {
+            failures += finish_store(&store);
+        }
 
-    // Grayscale filter will only trigger is user enter -w option
-    if (grayscale == 1) {
-        image_apply_bw(img);
+        make_output_filename(output_names[i % 2], sizeof(output_names[i % 2]), output_filename, first_index + i);
+        startStoreBMP(&store, output_names[i % 2], &BMP, &DIB, img, options->rle_output);
+        storing = 1;
     }
 
-    // Color shift filter will only trigger if user enter -r or -g or -b with any value
-    if (red_shift != 0 || green_shift != 0 || blue_shift != 0) {
-        image_apply_colorshift(img, red_shift, green_shift, blue_shift);
+    if (storing) {
+        failures += finish_store(&store);
     }
 
-    // resize will only trigger when factor is greater than 0 and not default 1
-    if (scale != 1 && scale > 0) {
-        image_apply_resize(img, scale);
+    return failures;
+}
+
+// stream the image through the point filters band_rows rows at a time, so only one
+// band is held in memory no matter how tall the image is.
+// returns 0 on success, -1 if a file can not be opened, -2 if the input is not a supported BMP,
+// -3 if the input is compressed and can not be read band by band, -4 if the input ends early or
+// the output can not be written, -5 if a filter failed, which apply_filters reports itself.
+int process_bands(char *input_filename, char *output_filename, int band_rows,
+                  struct Filter_Options *options)
+{
+    struct BMP_Header BMP;
+    struct DIB_Header DIB;
+
+    FILE* file_input = fopen(input_filename, "rb");
+    if (file_input == NULL) {
+        return -1;
+    }
+
+    struct BMP_Format format;
+    readBMPHeader(file_input, &BMP);
+    readDIBHeader(file_input, &DIB);
+    if (readFormatBMP(file_input, &BMP, &DIB, &format) != 0) {
+        fclose(file_input);
+        return -2;
+    }
+    if (format.compression == BI_RLE8 || format.compression == BI_RLE4) {
+        fclose(file_input);
+        return -3;
     }
 
     FILE* file_output = fopen(output_filename, "wb");
+    if (file_output == NULL) {
+        fclose(file_input);
+        return -1;
+    }
+    int width = format.width;
+    int height = format.height;
 
-    // update header and dib info
-    makeBMPHeader(&BMP, img->width, img->height);
-    makeDIBHeader(&DIB, img->width, img->height);
+    printf("The image height is: %d width is: %d\n", height, width);
 
-    ///////////////
-    printf("The update BMP offset value is: %d\n", BMP.offset_pixel_array);
+    // allocate memory for one band
+    Image* buffer = image_new(width, band_rows);
+    if (buffer == NULL) {
+        fclose(file_input);
+        fclose(file_output);
+        return -1;
+    }
+    struct Pixel** pixels = image_get_pixels(buffer);
+
+    // output has the same size, write its headers first
+    struct BMP_Header out_BMP = BMP;
+    struct DIB_Header out_DIB = DIB;
+    makeBMPHeader(&out_BMP, width, height);
+    makeDIBHeader(&out_DIB, width, height);
+    writeBMPHeader(file_output, &out_BMP);
+    writeDIBHeader(file_output, &out_DIB);
+
+    int result = 0;
+    for (int band_start = 0; band_start < height; band_start += band_rows) {
+        int rows = band_rows;
+        if (band_start + rows > height) {
+            rows = height - band_start;
+        }
 
-    // write update header and dib info
-    writeBMPHeader(file_output, &BMP);
-    writeDIBHeader(file_output, &DIB);
+        // a truncated input or a full disk fails the whole image
+        if (readRowsBMP(file_input, &BMP, &format, pixels, band_start, rows) != 0) {
+            result = -4;
+            break;
+        }
+        Image* band = image_create(pixels, width, rows);
 
-    // write pixels info into new files
-    writePixelsBMP(file_output, image_get_pixels(img), image_get_width(img), image_get_height(img));
+        int filter_result = apply_filters(band, options, width, rows, 0);
+        image_set_layout(band, IMAGE_LAYOUT_RGB);
 
-    // finished writing and close file
-    fclose(file_output);
+        if (filter_result != 0) {
+            result = -5;
+        } else if (writePixelsBMP(file_output, image_get_pixels(band), width, rows) != 0) {
+            result = -4;
+        }
+        image_destroy(&band);
+        if (result != 0) {
+            break;
+        }
+    }
 
-    // free memory
-    image_destroy(&img);
-    free(pixels);
-    pixels = NULL;
+    // free memory, buffered header and pixel writes only fail for sure once the file is closed
+    image_destroy(&buffer);
+    fclose(file_input);
+    if (ferror(file_output) && result == 0) {
+        result = -4;
+    }
+    if (fclose(file_output) != 0 && result == 0) {
+        result = -4;
+    }
 
-    printf("----------------------------------\n");
-    printf("   Image processed successfully\n");
-    printf("----------------------------------\n\n");
+    return result;
+}
 
-    return 0;
+// read file names one per line, blank lines skipped.
+// returns a newly allocated array of newly allocated names, count is set to its length,
+// or NULL if the memory can not be allocated.
+char **read_filename_list(FILE *list, int *count)
+{
+    int capacity = 64;
+    char **filenames = (char**)malloc(sizeof(char*) * capacity);
+    char line[4096];
+    int failed = filenames == NULL;
+
+    *count = 0;
+    while (!failed && fgets(line, sizeof(line), list) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        if (*count == capacity) {
+            // keep the old block until the larger one is known to exist
+            char **larger = (char**)realloc(filenames, sizeof(char*) * capacity * 2);
+            if (larger == NULL) {
+                failed = 1;
+                break;
+            }
+            filenames = larger;
+            capacity *= 2;
+        }
+        char *name = strdup(line);
+        if (name == NULL) {
+            failed = 1;
+            break;
+        }
+        filenames[(*count)++] = name;
+    }
+
+    // stopped early for lack of memory, drop what was read
+    if (failed) {
+        for (int i = 0; i < *count; i++) {
+            free(filenames[i]);
+        }
+        free(filenames);
+        *count = 0;
+        return NULL;
+    }
+    return filenames;
+}
+
+// name of a BI_* compression value for probe records.
+static const char *compression_name(int compression)
+{
+    switch (compression) {
+        case BI_RGB: return "RGB";
+        case BI_RLE8: return "RLE8";
+        case BI_RLE4: return "RLE4";
+        case BI_BITFIELDS: return "BITFIELDS";
+        case BI_ALPHABITFIELDS: return "ALPHABITFIELDS";
+        default: return "UNKNOWN";
+    }
+}
+
+// probe thread: claim batches of files until none are left.
+static void *probe_thread(void *arg)
+{
+    struct Probe_Work *work = (struct Probe_Work*)arg;
+    const int batch = 64;
+
+    while (1) {
+        pthread_mutex_lock(&work->lock);
+        int first = work->next;
+        work->next += batch;
+        pthread_mutex_unlock(&work->lock);
+        if (first >= work->count) {
+            break;
+        }
+
+        int last = first + batch < work->count ? first + batch : work->count;
+        for (int i = first; i < last; i++) {
+            struct BMP_Header bmp;
+            struct DIB_Header dib;
+            struct BMP_Format format;
+            struct Probe_Record *record = &work->records[i];
+
+            record->result = probeBMP(work->filenames[i], &bmp, &dib, &format);
+            if (record->result == 0) {
+                record->width = dib.image_width;
+                record->height = dib.image_height;
+                record->bits_per_pixel = dib.bits_per_pixel;
+                record->compression = dib.compression;
+                record->size = bmp.size;
+            }
+        }
+    }
+    return NULL;
+}
+
+// read only the headers of each file, on several threads, and print one tab separated
+// record per file in input order:
+// filename, status (ok, unreadable, invalid), width, height, bits per pixel, compression, file size.
+// fields that are not known are printed as -.
+// returns the number of files that are not readable, supported BMPs.
+int probe_images(char **input_filenames, int count)
+{
+    struct Probe_Work work;
+    pthread_t threads[PROBE_THREADS];
+    int started[PROBE_THREADS];
+    int failures = 0;
+
+    work.filenames = input_filenames;
+    work.records = (struct Probe_Record*)calloc(count > 0 ? count : 1, sizeof(struct Probe_Record));
+    work.count = count;
+    work.next = 0;
+    pthread_mutex_init(&work.lock, NULL);
+
+    // no more threads than batches; if none start the work is done right here
+    int thread_count = (count + 63) / 64 < PROBE_THREADS ? (count + 63) / 64 : PROBE_THREADS;
+    int running = 0;
+    for (int t = 0; t < thread_count; t++) {
+        started[t] = pthread_create(&threads[t], NULL, probe_thread, &work) == 0;
+        running += started[t];
+    }
+    if (running == 0) {
+        probe_thread(&work);
+    }
+    for (int t = 0; t < thread_count; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    pthread_mutex_destroy(&work.lock);
+
+    for (int i = 0; i < count; i++) {
+        struct Probe_Record *record = &work.records[i];
+        if (record->result == 0) {
+            printf("%s\tok\t%d\t%d\t%d\t%s\t%d\n", input_filenames[i], record->width, record->height,
+                   record->bits_per_pixel, compression_name(record->compression), record->size);
+        } else {
+            printf("%s\t%s\t-\t-\t-\t-\t-\n", input_filenames[i],
+                   record->result == -1 ? "unreadable" : "invalid");
+            failures++;
+        }
+    }
+
+    free(work.records);
+    return failures;
 }
 
 // parse command line arguments using getopt.
 void process_args(int ac, char *av[], char **output_filename,
                   int *grayscale, char **input_file,
-                  float *scale,
-                  int *red_shift, int *green_shift, int *blue_shift)
+                  float *scale, int *resample_filter,
+                  int *red_shift, int *green_shift, int *blue_shift,
+                  int *band_rows, int *rle_output, int *probe,
+                  float *gamma, int *invert, int *threshold, int *thread_stats)
 {
 
     int command, f = 0;
@@ -186,9 +706,17 @@ void process_args(int ac, char *av[], char **output_filename,
         // 'w'    option for grayscale
         // 'r:', 'g:', 'b:' option for rgb color shift followed by an integer
         // 's:'   option for scale followed by a float
+        // 'q:'   option for the resize filter: bilinear, bicubic or lanczos
+        // 'l:'   option for streaming the image in bands of rows followed by an integer
+        // 'z'    option for RLE8 compressed output
+        // 'p'    option for printing a header record per input file, nothing is processed
+        // 'G:'   option for gamma correction followed by a float
+        // 'i'    option for inverting the colors
+        // 't:'   option for a black and white threshold followed by an integer
+        // 'T'    option for printing how busy each thread was
         // 'o:'   option for output file name
         // 'h'    option for help manu
-        command = getopt(ac, av, "f: w r: g: b: s: o: h");
+        command = getopt(ac, av, "f: w r: g: b: s: q: l: z p G: i t: T o: h");
 
         if( command == -1) {
             break; // nothing left to parse in the command line
@@ -250,6 +778,60 @@ void process_args(int ac, char *av[], char **output_filename,
                     exit(1); //error, exit program
                 }
                 break;
+            case 'q':
+                if (strcmp(optarg, "nearest") == 0) {
+                    *resample_filter = IMAGE_RESAMPLE_NEAREST;
+                } else if (strcmp(optarg, "bilinear") == 0) {
+                    *resample_filter = IMAGE_RESAMPLE_BILINEAR;
+                } else if (strcmp(optarg, "bicubic") == 0) {
+                    *resample_filter = IMAGE_RESAMPLE_BICUBIC;
+                } else if (strcmp(optarg, "lanczos") == 0) {
+                    *resample_filter = IMAGE_RESAMPLE_LANCZOS3;
+                } else {
+                    fprintf(stderr, "\nError: resize filter -q %s must be nearest, bilinear, bicubic or lanczos\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'l':
+                *band_rows = atoi(optarg);
+                if (*band_rows <= 0) {
+                    fprintf(stderr, "\nError: band size -l %s must be a positive number of rows\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'z': *rle_output = 1;
+                break;
+            case 'p': *probe = 1;
+                break;
+            case 'G':
+                *gamma = atof(optarg);
+                if (*gamma <= 0) {
+                    fprintf(stderr, "\nError: gamma value -G %f is less than 0\n"
+                                    "Must enter a value greater than 0\n", *gamma);
+                    exit(1);
+                }
+                break;
+            case 'i': *invert = 1;
+                break;
+            case 't':
+                length = strlen (optarg);
+                for (i = 0; i < length; i++)
+                    if (!isdigit(optarg[i]))
+                    {
+                        printf ("\n-----------------------------------------------\n");
+                        printf ("         Entered input is not a number\n");
+                        printf ("      Please enter -t follow by an integer\n");
+                        printf ("-----------------------------------------------\n\n");
+                        exit(1);
+                    }
+                *threshold = atoi(optarg);
+                if (*threshold > 255) {
+                    fprintf(stderr, "\nError: threshold -t %d must be between 0 and 255\n", *threshold);
+                    exit(1);
+                }
+                break;
+            case 'T': *thread_stats = 1;
+                break;
             case 'o': *output_filename = optarg;
                 break;
 
@@ -277,14 +859,25 @@ void process_args(int ac, char *av[], char **output_filename,
 void usage(void){
     fprintf(stderr,
             " usage:\n"
-            "    ./ImageProcessor -f filename [-h] [-r -g -b val] [-w] [-s val] [-o filename]\n"
+            "    ./ImageProcessor -f filename [more filenames] [-h] [-r -g -b val] [-w] [-G val] [-i] [-t val] [-s val] [-q filter] [-l rows] [-z] [-p] [-T] [-o filename]\n"
             "       -f  filename:    !!!must have a input file name  to run!!！\n"
             "       -r  value:       use value to increase or decrease the color red\n"
             "       -g  value:       use value to increase or decrease the color green\n"
             "       -b  value:       use value to increase or decrease the color blue\n"
             "       -w:              convert RGB to grayscale equivalent\n"
+            "       -G  float:       gamma correct, values above 1 brighten the image\n"
+            "       -i:              invert the colors\n"
+            "       -t  value:       black and white threshold of the grayscale value, 0 to 255\n"
             "       -s  float:       use value to resize the image\n"
-            "       -o  filename:    optional to customize output filename\n"
+            "       -q  filter:      resize filter: nearest (default), bilinear, bicubic or lanczos\n"
+            "       -l  rows:        stream the image this many rows at a time (low memory)\n"
+            "       -z:              write RLE8 compressed output if the image has 256 colors or less\n"
+            "       -p:              only read the headers, print one tab separated record per file:\n"
+            "                        name, ok/unreadable/invalid, width, height, bits, compression, size\n"
+            "                        with -f - the file names are read from stdin, one per line\n"
+            "       -T:              print how long each thread was busy filtering\n"
+            "       -o  filename:    optional to customize output filename, later input files\n"
+            "                        get _1, _2 ... added before the extension\n"
             "       -h:              print out this help message\n"
             "\n");
 }
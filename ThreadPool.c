@@ -0,0 +1,374 @@
+/**
+* Implementation of the thread pool shared by the filters.
+* One job runs at a time. Its chunks are dealt out in equal runs, one run per thread, into a
+* deque each. A thread takes chunks from the front of its own deque, and once that is empty
+* steals the back half of another thread's, until every deque is empty and the caller returns.
+*
+* @author Sheldon Pang
+* @version 1.1
+* 1.1 update notes: Work stealing deques instead of one shared counter, busy time per thread
+*/
+
+////////////////////////////////////////////////////////////////////////////////
+// Include Files
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ThreadPool.h"
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWork = PTHREAD_COND_INITIALIZER;     /* a job was posted or the pool stops */
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;     /* the last worker left the job */
+static pthread_mutex_t poolSubmit = PTHREAD_MUTEX_INITIALIZER; /* held by the caller of the running job */
+
+static int poolSize = 0;                /* threads including the caller, 0 for one per CPU */
+static pthread_t* poolThreads = NULL;
+static int poolWorkers = 0;             /* worker threads running */
+static int poolStopping = 0;
+static unsigned long poolGeneration = 0; /* bumped for every job */
+
+/* Chunks [first, last) of the running job a thread still has to run, packed as first << 32 | last
+ * so the owner taking the front and a thief taking the back agree with one compare and swap.
+ * One cache line each, so threads working on their own deque do not slow each other down. */
+struct Pool_Deque {
+    unsigned long long range;
+    char padding[64 - sizeof(unsigned long long)];
+};
+
+/* Counters of one thread, written only by that thread, padded like the deques. */
+struct Pool_Counters {
+    double busy_ms;
+    long chunks;
+    long steals;
+    char padding[64 - sizeof(double) - 2 * sizeof(long)];
+};
+
+static struct Pool_Deque poolDeques[THREAD_POOL_MAX] __attribute__((aligned(64)));
+static struct Pool_Counters poolCounters[THREAD_POOL_MAX] __attribute__((aligned(64)));
+static double poolJobMs = 0;            /* time the caller spent waiting for jobs */
+
+/* the running job */
+static Parallel_Body jobBody;
+static void* jobArg;
+static int jobCount;
+static int jobGrain;
+static int jobThreads;                  /* deques dealt out, the caller's and one per worker */
+static int jobFailed;
+static int jobBusy;                     /* workers still taking chunks */
+
+/* 1 on the pool's own threads, so a body that calls parallelFor runs it itself */
+static __thread int inPoolThread = 0;
+
+/* Milliseconds on a clock that only goes forward. */
+static double poolClockMs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+/* Run items [first, last) and count the time against thread self. */
+static int runTimedChunk(int self, Parallel_Body body, void* arg, int first, int last) {
+    double start = poolClockMs();
+    int result = body(arg, first, last);
+    poolCounters[self].busy_ms += poolClockMs() - start;
+    poolCounters[self].chunks++;
+    return result;
+}
+
+/* Take the front chunk of thread self's deque. Returns 0 if the deque is empty. */
+static int popChunk(int self, int* chunk) {
+    unsigned long long range = __atomic_load_n(&poolDeques[self].range, __ATOMIC_ACQUIRE);
+    while (1) {
+        unsigned int first = (unsigned int)(range >> 32), last = (unsigned int)range;
+        if (first >= last) {
+            return 0;
+        }
+        unsigned long long rest = ((unsigned long long)(first + 1) << 32) | last;
+        if (__atomic_compare_exchange_n(&poolDeques[self].range, &range, rest, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *chunk = (int)first;
+            return 1;
+        }
+    }
+}
+
+/* Move the back half of the first other deque that has chunks into thread self's own, which
+ * is empty. Returns 0 if every deque is empty, the job is then done apart from running chunks. */
+static int stealChunks(int self) {
+    for (int step = 1; step < jobThreads; step++) {
+        int victim = (self + step) % jobThreads;
+        unsigned long long range = __atomic_load_n(&poolDeques[victim].range, __ATOMIC_ACQUIRE);
+        while (1) {
+            unsigned int first = (unsigned int)(range >> 32), last = (unsigned int)range;
+            if (first >= last) {
+                break;
+            }
+            unsigned int split = last - (last - first + 1) / 2;
+            unsigned long long kept = ((unsigned long long)first << 32) | split;
+            if (__atomic_compare_exchange_n(&poolDeques[victim].range, &range, kept, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&poolDeques[self].range, ((unsigned long long)split << 32) | last,
+                                 __ATOMIC_RELEASE);
+                poolCounters[self].steals++;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Run the chunks of the running job from thread self's deque, then stolen ones, until none are left. */
+static void runJobChunks(int self) {
+    int chunk;
+    while (1) {
+        if (!popChunk(self, &chunk)) {
+            // what was stolen may be stolen again before it is taken, look once more
+            if (!stealChunks(self)) {
+                return;
+            }
+            continue;
+        }
+        int first = chunk * jobGrain;
+        int last = jobCount - first < jobGrain ? jobCount : first + jobGrain;
+        if (runTimedChunk(self, jobBody, jobArg, first, last) != 0) {
+            __atomic_store_n(&jobFailed, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Wait for a job, help with it, tell the caller when done, until the pool stops. The argument
+ * is the thread's deque, 1 for the first worker as the caller has deque 0. */
+static void* poolThread(void* arg) {
+    unsigned long seen = 0;
+    int self = (int)(long)arg;
+    inPoolThread = 1;
+
+    pthread_mutex_lock(&poolLock);
+    while (1) {
+        while (!poolStopping && poolGeneration == seen) {
+            pthread_cond_wait(&poolWork, &poolLock);
+        }
+        if (poolStopping) {
+            break;
+        }
+        seen = poolGeneration;
+        pthread_mutex_unlock(&poolLock);
+
+        runJobChunks(self);
+
+        pthread_mutex_lock(&poolLock);
+        if (--jobBusy == 0) {
+            pthread_cond_signal(&poolDone);
+        }
+    }
+    pthread_mutex_unlock(&poolLock);
+    return NULL;
+}
+
+/* Start the workers, one less than the pool size as the caller works too. Called with
+ * poolSubmit held. Fewer workers are kept if not all of them can be started. */
+static void startPoolThreads(void) {
+    int workers = getThreadPoolSize() - 1;
+    if (workers < 1) {
+        return;
+    }
+    poolThreads = (pthread_t*)malloc(sizeof(pthread_t) * workers);
+    if (poolThreads == NULL) {
+        return;
+    }
+    poolStopping = 0;
+    while (poolWorkers < workers &&
+           pthread_create(&poolThreads[poolWorkers], NULL, poolThread, (void*)(long)(poolWorkers + 1)) == 0) {
+        poolWorkers++;
+    }
+}
+
+/* Stop and join the workers. Called with poolSubmit held. */
+static void stopPoolThreads(void) {
+    pthread_mutex_lock(&poolLock);
+    poolStopping = 1;
+    pthread_cond_broadcast(&poolWork);
+    pthread_mutex_unlock(&poolLock);
+
+    for (int t = 0; t < poolWorkers; t++) {
+        pthread_join(poolThreads[t], NULL);
+    }
+    free(poolThreads);
+    poolThreads = NULL;
+    poolWorkers = 0;
+    poolStopping = 0;
+}
+
+/* Run every chunk of a job on the calling thread. Inside a body the time already counts
+ * against the thread running it, otherwise it counts against the caller's. */
+static int runInline(int count, int grain, Parallel_Body body, void* arg) {
+    double start = inPoolThread ? 0 : poolClockMs();
+    int result = 0;
+    for (int first = 0; first < count; first += grain) {
+        int last = count - first < grain ? count : first + grain;
+        if ((inPoolThread ? body(arg, first, last) : runTimedChunk(0, body, arg, first, last)) != 0) {
+            result = -1;
+        }
+    }
+    if (!inPoolThread) {
+        poolJobMs += poolClockMs() - start;
+    }
+    return result;
+}
+
+/**
+ * Set the number of threads work is split over, the calling thread included. Stops the
+ * workers if they are running, they are started again at the new size when next needed.
+ *
+ * @param  threads: Number of threads, 0 for one per CPU
+ */
+void setThreadPoolSize(int threads) {
+    pthread_mutex_lock(&poolSubmit);
+    if (poolWorkers > 0) {
+        stopPoolThreads();
+    }
+    poolSize = threads < 0 ? 0 : (threads > THREAD_POOL_MAX ? THREAD_POOL_MAX : threads);
+    pthread_mutex_unlock(&poolSubmit);
+}
+
+/**
+ * Get the number of threads work is split over, the calling thread included.
+ *
+ * @return The number of threads, at least 1
+ */
+int getThreadPoolSize(void) {
+    if (poolSize > 0) {
+        return poolSize;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus > THREAD_POOL_MAX ? THREAD_POOL_MAX : (int)cpus;
+}
+
+/**
+ * Run body over the items [0, count) in chunks of grain items, on the pool's threads and the
+ * calling thread, and wait for all of them. Every thread starts on an equal run of chunks and
+ * steals from the others once its own run is done, so uneven chunks still keep all of them
+ * busy. Called from inside a body, or with a single chunk, it runs on the calling thread.
+ *
+ * @param  count: Number of items, such as rows or tiles
+ * @param  grain: Items per chunk, at least 1
+ * @param  body: Work of one chunk
+ * @param  arg: Passed to body
+ * @return 0 on success, -1 if body failed for a chunk
+ */
+int parallelFor(int count, int grain, Parallel_Body body, void* arg) {
+    if (grain < 1) {
+        grain = 1;
+    }
+    if (count <= grain || inPoolThread) {
+        return runInline(count, grain, body, arg);
+    }
+
+    // one job at a time, the workers are started by the first one
+    pthread_mutex_lock(&poolSubmit);
+    if (poolWorkers == 0) {
+        startPoolThreads();
+    }
+    if (poolWorkers == 0) {
+        pthread_mutex_unlock(&poolSubmit);
+        return runInline(count, grain, body, arg);
+    }
+
+    double start = poolClockMs();
+    pthread_mutex_lock(&poolLock);
+    jobBody = body;
+    jobArg = arg;
+    jobCount = count;
+    jobGrain = grain;
+    jobThreads = poolWorkers + 1;
+    int chunks = (count + grain - 1) / grain;
+    for (int t = 0; t < jobThreads; t++) {
+        unsigned long long first = (unsigned long long)chunks * t / jobThreads;
+        unsigned long long last = (unsigned long long)chunks * (t + 1) / jobThreads;
+        poolDeques[t].range = first << 32 | last;
+    }
+    jobFailed = 0;
+    jobBusy = poolWorkers;
+    poolGeneration++;
+    pthread_cond_broadcast(&poolWork);
+    pthread_mutex_unlock(&poolLock);
+
+    // the caller takes chunks too, then waits for the workers still busy with theirs
+    inPoolThread = 1;
+    runJobChunks(0);
+    inPoolThread = 0;
+
+    pthread_mutex_lock(&poolLock);
+    while (jobBusy > 0) {
+        pthread_cond_wait(&poolDone, &poolLock);
+    }
+    int result = jobFailed ? -1 : 0;
+    pthread_mutex_unlock(&poolLock);
+    poolJobMs += poolClockMs() - start;
+
+    pthread_mutex_unlock(&poolSubmit);
+    return result;
+}
+
+/**
+ * Returns how many items each chunk should get so every thread gets about chunks_per_thread
+ * chunks, never fewer than min_grain items.
+ *
+ * @param  count: Number of items
+ * @param  chunks_per_thread: Chunks to aim for per thread, more balances uneven work better
+ * @param  min_grain: Fewest items worth a chunk
+ * @return Items per chunk, at least 1
+ */
+int parallelGrain(int count, int chunks_per_thread, int min_grain) {
+    long chunks = (long)getThreadPoolSize() * (chunks_per_thread < 1 ? 1 : chunks_per_thread);
+    int grain = (int)((count + chunks - 1) / chunks);
+    if (grain < min_grain) {
+        grain = min_grain;
+    }
+    return grain < 1 ? 1 : grain;
+}
+
+/**
+ * Stop the worker threads and free them, for the end of the program.
+ */
+void stopThreadPool(void) {
+    pthread_mutex_lock(&poolSubmit);
+    if (poolWorkers > 0) {
+        stopPoolThreads();
+    }
+    pthread_mutex_unlock(&poolSubmit);
+}
+
+/**
+ * Get how busy each thread of the pool has been since the program started or the stats were
+ * last cleared. Thread 0 is the calling thread. Time a thread spends waiting while the others
+ * finish their chunks is not busy, so uneven busy times show the work was split unevenly.
+ *
+ * @param  stats: Filled in, one entry per thread up to the pool size
+ */
+void getThreadPoolStats(struct Thread_Pool_Stats* stats) {
+    pthread_mutex_lock(&poolSubmit);
+    stats->threads = getThreadPoolSize();
+    stats->job_ms = poolJobMs;
+    for (int t = 0; t < stats->threads; t++) {
+        stats->busy_ms[t] = poolCounters[t].busy_ms;
+        stats->chunks[t] = poolCounters[t].chunks;
+        stats->steals[t] = poolCounters[t].steals;
+    }
+    pthread_mutex_unlock(&poolSubmit);
+}
+
+/**
+ * Clear the counters getThreadPoolStats reports.
+ */
+void clearThreadPoolStats(void) {
+    pthread_mutex_lock(&poolSubmit);
+    memset(poolCounters, 0, sizeof(poolCounters));
+    poolJobMs = 0;
+    pthread_mutex_unlock(&poolSubmit);
+}